@@ -5,6 +5,7 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
 #include <errno.h>
 
 #include "int.h"
@@ -15,6 +16,7 @@
 #include "util.h"
 #include "xmalloc.h"
 #include "page.h"
+#include "uring.h"
 
 #undef LOG_PREFIX
 #define LOG_PREFIX "bfd: "
@@ -39,16 +41,21 @@ static int buf_get(struct xbuf *xb)
 	struct bfd_buf *b;
 
 	if (list_empty(&bufs)) {
+		unsigned int i, nr = BUFBATCH;
 		void *mem;
-		int i;
 
-		mem = mmap(NULL, BUFBATCH * BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-		if (mem == MAP_FAILED) {
-			pr_perror("No buf");
-			return -1;
+		/* Memory registered with io_uring goes first */
+		mem = uring_fixed_bufs(BUFSIZE, &nr);
+		if (!mem) {
+			nr = BUFBATCH;
+			mem = mmap(NULL, BUFBATCH * BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+			if (mem == MAP_FAILED) {
+				pr_perror("No buf");
+				return -1;
+			}
 		}
 
-		for (i = 0; i < BUFBATCH; i++) {
+		for (i = 0; i < nr; i++) {
 			b = xmalloc(sizeof(*b));
 			if (!b) {
 				if (i == 0) {
@@ -95,6 +102,8 @@ static int bfdopen(struct bfd *f, bool writable)
 	}
 
 	f->writable = writable;
+	f->async = false;
+	f->window = false;
 	return 0;
 }
 
@@ -103,9 +112,39 @@ int bfdopenr(struct bfd *f)
 	return bfdopen(f, false);
 }
 
+/*
+ * Buffers of regular files are written with io_uring at explicit
+ * offsets, so the file position is only updated on bfd_flush().
+ */
+static void bfd_set_async(struct bfd *f)
+{
+	struct stat st;
+	int flags;
+
+	if (!uring_enabled())
+		return;
+
+	if (fstat(f->fd, &st) || !S_ISREG(st.st_mode))
+		return;
+
+	flags = fcntl(f->fd, F_GETFL);
+	if (flags < 0 || (flags & O_APPEND))
+		return;
+
+	f->pos = lseek(f->fd, 0, SEEK_CUR);
+	if (f->pos < 0)
+		return;
+
+	f->async = true;
+}
+
 int bfdopenw(struct bfd *f)
 {
-	return bfdopen(f, true);
+	if (bfdopen(f, true))
+		return -1;
+
+	bfd_set_async(f);
+	return 0;
 }
 
 static int bflush(struct bfd *bfd);
@@ -119,7 +158,7 @@ int bfd_flush_images(void)
 void bclose(struct bfd *f)
 {
 	if (bfd_buffered(f)) {
-		if (f->writable && bflush(f) < 0) {
+		if (f->writable && (bflush(f) < 0 || (f->async && uring_wait_fd(f->fd)))) {
 			/*
 			 * This is to propagate error up. It's
 			 * hardly possible by returning and
@@ -136,6 +175,31 @@ void bclose(struct bfd *f)
 	close_safe(&f->fd);
 }
 
+static ssize_t bfd_read(struct bfd *f, void *buf, size_t size)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	if (!f->window)
+		return read_all(f->fd, buf, size);
+
+	size = min_t(size_t, size, f->end - f->pos);
+	while (done < size) {
+		ret = pread(f->fd, buf + done, size - done, f->pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ret;
+		}
+		if (ret == 0)
+			break;
+		f->pos += ret;
+		done += ret;
+	}
+
+	return done;
+}
+
 static int brefill(struct bfd *f)
 {
 	int ret;
@@ -144,7 +208,7 @@ static int brefill(struct bfd *f)
 	memmove(b->mem, b->data, b->sz);
 	b->data = b->mem;
 
-	ret = read_all(f->fd, b->mem + b->sz, BUFSIZE - b->sz);
+	ret = bfd_read(f, b->mem + b->sz, BUFSIZE - b->sz);
 	if (ret < 0) {
 		pr_perror("Error reading file");
 		return -1;
@@ -232,6 +296,69 @@ again:
 	goto again;
 }
 
+static int bwrite_at(struct bfd *bfd, const void *buf, int size)
+{
+	int done = 0;
+
+	while (done < size) {
+		ssize_t ret;
+
+		ret = pwrite(bfd->fd, buf + done, size - done, bfd->pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+
+		done += ret;
+		bfd->pos += ret;
+	}
+
+	return done;
+}
+
+static void bflush_done(void *arg, int err)
+{
+	struct bfd_buf *buf = arg;
+
+	if (err)
+		flush_failed = true;
+	list_add(&buf->l, &bufs);
+}
+
+/*
+ * The buffer is handed over to io_uring and gets back to the pool
+ * once written, the bfd goes on with a new one.
+ */
+static int bflush_async(struct bfd *bfd)
+{
+	struct xbuf *b = &bfd->b;
+
+	/* E.g. a dump worker failed to set up its own ring */
+	if (!uring_enabled()) {
+		if (bwrite_at(bfd, b->data, b->sz) != b->sz)
+			return -1;
+		b->sz = 0;
+		return 0;
+	}
+
+	if (uring_write(bfd->fd, b->data, b->sz, bfd->pos, bflush_done, b->buf))
+		return -1;
+
+	bfd->pos += b->sz;
+	b->buf = NULL;
+
+	if (buf_get(b)) {
+		/* Wait for the buffer to get back to the pool */
+		if (uring_wait_fd(bfd->fd) || buf_get(b))
+			return -1;
+	}
+
+	return 0;
+}
+
 static int bflush(struct bfd *bfd)
 {
 	struct xbuf *b = &bfd->b;
@@ -240,6 +367,9 @@ static int bflush(struct bfd *bfd)
 	if (!b->sz)
 		return 0;
 
+	if (bfd->async)
+		return bflush_async(bfd);
+
 	ret = write_all(bfd->fd, b->data, b->sz);
 	if (ret != b->sz)
 		return -1;
@@ -248,6 +378,29 @@ static int bflush(struct bfd *bfd)
 	return 0;
 }
 
+int bfd_flush(struct bfd *f)
+{
+	if (!bfd_buffered(f) || !f->writable)
+		return 0;
+
+	if (bflush(f) < 0) {
+		pr_perror("Error flushing image");
+		return -1;
+	}
+
+	/* Somebody else is going to write the file after us */
+	if (f->async) {
+		if (uring_wait_fd(f->fd))
+			return -1;
+		if (lseek(f->fd, f->pos, SEEK_SET) < 0) {
+			pr_perror("Can't set image position");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int __bwrite(struct bfd *bfd, const void *buf, int size)
 {
 	struct xbuf *b = &bfd->b;
@@ -259,8 +412,11 @@ static int __bwrite(struct bfd *bfd, const void *buf, int size)
 			return ret;
 	}
 
-	if (size > BUFSIZE)
+	if (size > BUFSIZE) {
+		if (bfd->async)
+			return bwrite_at(bfd, buf, size);
 		return write_all(bfd->fd, buf, size);
+	}
 
 	memcpy(b->data + b->sz, buf, size);
 	b->sz += size;
@@ -308,7 +464,7 @@ int bread(struct bfd *bfd, void *buf, int size)
 	int more = 1, filled = 0;
 
 	if (!bfd_buffered(bfd))
-		return read_all(bfd->fd, buf, size);
+		return bfd_read(bfd, buf, size);
 
 	while (more > 0) {
 		int chunk;
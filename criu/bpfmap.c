@@ -123,6 +123,7 @@ struct collect_image_info bpfmap_data_cinfo = {
 	.pb_type = PB_BPFMAP_DATA,
 	.priv_size = sizeof(struct bpfmap_data_rst),
 	.collect = collect_bpfmap_data,
+	.flags = COLLECT_IMG_DATA,
 };
 
 int dump_one_bpfmap_data(BpfmapFileEntry *bpf, int lfd, const struct fd_parms *p)
@@ -0,0 +1,76 @@
+#include <zstd.h>
+
+#include "compress.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "compress: "
+
+/*
+ * Pages are dumped once and are usually restored from the local disk,
+ * so the fastest level gives the best end-to-end times.
+ */
+#define COMPRESS_LEVEL 1
+
+static ZSTD_CCtx *cctx;
+static ZSTD_DCtx *dctx;
+
+size_t compress_bound(size_t len)
+{
+	return ZSTD_compressBound(len);
+}
+
+/*
+ * Returns the size of the compressed frame. If the data doesn't
+ * compress into less than @src_len bytes, @src_len is returned and
+ * the caller is expected to store the frame as is.
+ */
+ssize_t compress_frame(void *dst, size_t dst_len, const void *src, size_t src_len)
+{
+	size_t ret;
+
+	if (!cctx) {
+		cctx = ZSTD_createCCtx();
+		if (!cctx) {
+			pr_err("Unable to create compression context\n");
+			return -1;
+		}
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, COMPRESS_LEVEL);
+	}
+
+	ret = ZSTD_compress2(cctx, dst, dst_len, src, src_len);
+	if (ZSTD_isError(ret)) {
+		if (ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall)
+			return src_len;
+		pr_err("Unable to compress frame: %s\n", ZSTD_getErrorName(ret));
+		return -1;
+	}
+
+	return ret < src_len ? ret : src_len;
+}
+
+int decompress_frame(void *dst, size_t dst_len, const void *src, size_t src_len)
+{
+	size_t ret;
+
+	if (!dctx) {
+		dctx = ZSTD_createDCtx();
+		if (!dctx) {
+			pr_err("Unable to create decompression context\n");
+			return -1;
+		}
+	}
+
+	ret = ZSTD_decompressDCtx(dctx, dst, dst_len, src, src_len);
+	if (ZSTD_isError(ret)) {
+		pr_err("Unable to decompress frame: %s\n", ZSTD_getErrorName(ret));
+		return -1;
+	}
+
+	if (ret != dst_len) {
+		pr_err("Decompressed frame is %zu bytes, expected %zu\n", ret, dst_len);
+		return -1;
+	}
+
+	return 0;
+}
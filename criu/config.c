@@ -13,8 +13,10 @@
 #include "cgroup.h"
 #include "cgroup-props.h"
 #include "common/bug.h"
+#include "compress.h"
 #include "cpu.h"
 #include "crtools.h"
+#include "dump-workers.h"
 #include "cr_options.h"
 #include "filesystems.h"
 #include "file-lock.h"
@@ -23,9 +25,14 @@
 #include "mount-v2.h"
 #include "namespaces.h"
 #include "net.h"
+#include "page-xfer.h"
+#include "protobuf.h"
 #include "sk-inet.h"
 #include "sockets.h"
 #include "tty.h"
+#include "uring.h"
+#include "uffd.h"
+#include "uffd-xfer.h"
 #include "version.h"
 
 #include "common/xmalloc.h"
@@ -428,6 +435,10 @@ void init_opts(void)
 	opts.status_fd = -1;
 	opts.log_level = DEFAULT_LOGLEVEL;
 	opts.pre_dump_mode = PRE_DUMP_SPLICE;
+	opts.dump_workers = 1;
+	opts.collect_workers = 1;
+	opts.ps_streams = 1;
+	opts.io_uring_depth = URING_DEPTH;
 	opts.file_validation_method = FILE_VALIDATION_DEFAULT;
 	opts.network_lock_method = NETWORK_LOCK_DEFAULT;
 	opts.ghost_fiemap = FIEMAP_DEFAULT;
@@ -444,6 +455,27 @@ bool deprecated_ok(char *what)
 	return false;
 }
 
+/*
+ * Parses a number from 1 to @max. The atoi() would take negative or
+ * trailing garbage values, which then wrap in the unsigned fields.
+ */
+static int parse_uint_opt(const char *optarg, unsigned int max, unsigned int *val)
+{
+	unsigned long v;
+	char *end;
+
+	if (!isdigit(optarg[0]))
+		return -1;
+
+	errno = 0;
+	v = strtoul(optarg, &end, 10);
+	if (errno || *end || !v || v > max)
+		return -1;
+
+	*val = v;
+	return 0;
+}
+
 static int parse_cpu_cap(struct cr_options *opts, const char *optarg)
 {
 	bool inverse = false;
@@ -686,6 +718,7 @@ int parse_options(int argc, char **argv, bool *usage_error, bool *has_exec_cmd,
 		{ "verbosity", optional_argument, 0, 'v' },
 		{ "ps-socket", required_argument, 0, 1091 },
 		BOOL_OPT("stream", &opts.stream),
+		BOOL_OPT("stream-mux", &opts.stream_mux),
 		{ "config", required_argument, 0, 1089 },
 		{ "no-default-config", no_argument, 0, 1090 },
 		{ "tls-cacert", required_argument, 0, 1092 },
@@ -700,6 +733,23 @@ int parse_options(int argc, char **argv, bool *usage_error, bool *has_exec_cmd,
 		BOOL_OPT("skip-file-rwx-check", &opts.skip_file_rwx_check),
 		{ "lsm-mount-context", required_argument, 0, 1099 },
 		{ "network-lock", required_argument, 0, 1100 },
+		{ "dump-workers", required_argument, 0, 1101 },
+		BOOL_OPT("compress", &opts.compress),
+		{ "ps-streams", required_argument, 0, 1102 },
+		BOOL_OPT("dedup-pages", &opts.dedup_pages),
+		BOOL_OPT("skip-zero-pages", &opts.skip_zero_pages),
+		BOOL_OPT("io-uring", &opts.io_uring),
+		{ "io-uring-depth", required_argument, 0, 1103 },
+		BOOL_OPT("prefetch-pages", &opts.prefetch_pages),
+		{ "lazy-xfer", required_argument, 0, 1104 },
+		{ "lazy-workers", required_argument, 0, 1105 },
+		BOOL_OPT("lazy-push", &opts.lazy_push),
+		{ "track-mem-mode", required_argument, 0, 1107 },
+		{ "pre-dump-iters", required_argument, 0, 1108 },
+		{ "downtime", required_argument, 0, 1109 },
+		{ "pre-dump-bandwidth", required_argument, 0, 1110 },
+		{ "collect-workers", required_argument, 0, 1111 },
+		{ "images-file", required_argument, 0, 1112 },
 		BOOL_OPT("mntns-compat-mode", &opts.mntns_compat_mode),
 		BOOL_OPT("unprivileged", &opts.unprivileged),
 		BOOL_OPT("ghost-fiemap", &opts.ghost_fiemap),
@@ -1043,6 +1093,56 @@ int parse_options(int argc, char **argv, bool *usage_error, bool *has_exec_cmd,
 				return 1;
 			}
 			break;
+		case 1101:
+			if (parse_uint_opt(optarg, DUMP_WORKERS_MAX, &opts.dump_workers))
+				goto bad_arg;
+			break;
+		case 1102:
+			if (parse_uint_opt(optarg, PS_STREAMS_MAX, &opts.ps_streams))
+				goto bad_arg;
+			break;
+		case 1103:
+			if (parse_uint_opt(optarg, URING_DEPTH_MAX, &opts.io_uring_depth))
+				goto bad_arg;
+			break;
+		case 1104:
+			opts.lazy_xfer = xfer_ctl_parse(optarg);
+			if (opts.lazy_xfer < 0) {
+				pr_err("Unable to parse value of --lazy-xfer\n");
+				return 1;
+			}
+			break;
+		case 1105:
+			if (parse_uint_opt(optarg, LAZY_WORKERS_MAX, &opts.lazy_workers))
+				goto bad_arg;
+			break;
+		case 1107:
+			if (!strcmp("uffd-wp", optarg)) {
+				opts.track_mem_mode = TRACK_MEM_UFFD_WP;
+			} else if (strcmp("soft-dirty", optarg)) {
+				pr_err("Unable to parse value of --track-mem-mode\n");
+				return 1;
+			}
+			break;
+		case 1108:
+			if (parse_uint_opt(optarg, UINT_MAX, &opts.pre_dump_iters))
+				goto bad_arg;
+			break;
+		case 1109:
+			if (parse_uint_opt(optarg, UINT_MAX, &opts.downtime))
+				goto bad_arg;
+			break;
+		case 1110:
+			if (parse_uint_opt(optarg, UINT_MAX, &opts.pre_dump_bw))
+				goto bad_arg;
+			break;
+		case 1111:
+			if (parse_uint_opt(optarg, COLLECT_WORKERS_MAX, &opts.collect_workers))
+				goto bad_arg;
+			break;
+		case 1112:
+			SET_CHAR_OPTS(images_file, optarg);
+			break;
 		case 'V':
 			pr_msg("Version: %s\n", CRIU_VERSION);
 			if (strcmp(CRIU_GITID, "0"))
@@ -1114,6 +1214,46 @@ int check_options(void)
 	}
 #endif
 
+	if (opts.compress) {
+		if (!compress_supported()) {
+			pr_err("CRIU was built without pages compression support\n");
+			return 1;
+		}
+		if (opts.stream) {
+			pr_err("--compress can't be used together with --stream\n");
+			return 1;
+		}
+		if (opts.auto_dedup) {
+			pr_err("--compress can't be used together with --auto-dedup\n");
+			return 1;
+		}
+	}
+
+	if (opts.dedup_pages) {
+		if (opts.stream || opts.compress || opts.auto_dedup) {
+			pr_err("--dedup-pages can't be used together with --stream, --compress or --auto-dedup\n");
+			return 1;
+		}
+		/* The store is kept where the images are written */
+		if (opts.use_page_server) {
+			pr_warn("--dedup-pages is ignored with --page-server, pass it to the page server\n");
+			opts.dedup_pages = 0;
+		}
+	}
+
+	if (opts.ps_streams > 1) {
+		/* Compressed frames are sent over the main connection */
+		if (opts.compress) {
+			pr_err("--ps-streams can't be used together with --compress\n");
+			return 1;
+		}
+		/* Only the main connection is encrypted or passed by fd */
+		if (opts.ps_socket != -1 || opts.tls || opts.lazy_pages) {
+			pr_warn("--ps-streams is ignored with --ps-socket, --tls or --lazy-pages\n");
+			opts.ps_streams = 1;
+		}
+	}
+
 	if (opts.mntns_compat_mode && opts.mode != CR_RESTORE) {
 		pr_err("Option --mntns-compat-mode is only valid on restore\n");
 		return 1;
@@ -1124,7 +1264,60 @@ int check_options(void)
 		}
 	}
 
-	if (opts.track_mem && !kdat.has_dirty_track) {
+	if (opts.lazy_push) {
+		if (!opts.use_page_server) {
+			pr_err("--lazy-push requires --page-server\n");
+			return 1;
+		}
+		/* The pages already decrypted by TLS can't be polled for */
+		if (opts.tls) {
+			pr_err("--lazy-push can't be used together with --tls\n");
+			return 1;
+		}
+	}
+
+	if (opts.stream_mux && !opts.stream) {
+		pr_err("--stream-mux requires --stream\n");
+		return 1;
+	}
+
+	if (opts.images_file) {
+		/* The images of a dump with --images-file can't be anybody's parent */
+		if (opts.mode == CR_PRE_DUMP || opts.pre_dump_iters || opts.img_parent) {
+			pr_err("--images-file can't be used with pre-dumps\n");
+			return 1;
+		}
+		if (opts.stream || opts.use_page_server || opts.lazy_pages) {
+			pr_err("--images-file can't be used together with --stream, --page-server or --lazy-pages\n");
+			return 1;
+		}
+		/* The images are only read from the file */
+		if (opts.auto_dedup) {
+			pr_err("--images-file can't be used together with --auto-dedup\n");
+			return 1;
+		}
+	}
+
+	if (opts.pre_dump_iters) {
+		if (opts.mode != CR_DUMP) {
+			pr_err("Option --pre-dump-iters is only valid on dump\n");
+			return 1;
+		}
+		/* Every pre-dump would overwrite the images of the previous one */
+		if (opts.use_page_server || opts.stream) {
+			pr_err("--pre-dump-iters can't be used together with --page-server or --stream\n");
+			return 1;
+		}
+		/* The final dump puts the unchanged pages into the pre-dumps */
+		opts.track_mem = true;
+	}
+
+	if (opts.track_mem_mode == TRACK_MEM_UFFD_WP) {
+		if (!kdat.has_pagemap_scan || !uffd_wp_async()) {
+			pr_err("Write-protect memory tracking is not available. Consider omitting --track-mem-mode option.\n");
+			return 1;
+		}
+	} else if (opts.track_mem && !kdat.has_dirty_track) {
 		pr_err("Tracking memory is not available. Consider omitting --track-mem option.\n");
 		return 1;
 	}
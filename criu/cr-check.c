@@ -56,6 +56,7 @@
 #include "linux/aio_abi.h"
 #include "syscall.h"
 #include "mount-v2.h"
+#include "compress.h"
 
 #include "images/inventory.pb-c.h"
 
@@ -1193,6 +1194,16 @@ static int check_nftables_cr(void)
 #endif
 }
 
+static int check_compress(void)
+{
+	if (!compress_supported()) {
+		pr_warn("CRIU was built without pages compression support\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int check_ipt_legacy(void)
 {
 	char *ipt_legacy_bin;
@@ -1393,6 +1404,27 @@ static int check_pagemap_scan(void)
 	return 0;
 }
 
+static int check_uffd_wp_async(void)
+{
+	if (check_pagemap_scan())
+		return -1;
+
+	if (!uffd_wp_async()) {
+		pr_err("UFFD asynchronous write-protection is not supported\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_io_uring(void)
+{
+	if (!kdat.has_io_uring)
+		return -1;
+
+	return 0;
+}
+
 /* musl doesn't have a statx wrapper... */
 struct staty {
 	__u32 stx_dev_major;
@@ -1703,6 +1735,8 @@ int cr_check(void)
 		ret |= check_ptrace_get_rseq_conf();
 		ret |= check_ipv6_freebind();
 		ret |= check_pagemap_scan();
+		ret |= check_uffd_wp_async();
+		ret |= check_io_uring();
 		ret |= check_overlayfs_maps();
 
 		if (kdat.lsm == LSMTYPE__APPARMOR)
@@ -1826,7 +1860,10 @@ static struct feature_list feature_list[] = {
 	{ "get_rseq_conf", check_ptrace_get_rseq_conf },
 	{ "ipv6_freebind", check_ipv6_freebind },
 	{ "pagemap_scan", check_pagemap_scan },
+	{ "uffd_wp_async", check_uffd_wp_async },
 	{ "overlayfs_maps", check_overlayfs_maps },
+	{ "compress", check_compress },
+	{ "io_uring", check_io_uring },
 	{ NULL, NULL },
 };
 
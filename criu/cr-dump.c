@@ -82,7 +82,11 @@
 #include "eventpoll.h"
 #include "memfd.h"
 #include "timens.h"
+#include "img-file.h"
 #include "img-streamer.h"
+#include "dump-workers.h"
+#include "dirty-track.h"
+#include "page-store.h"
 #include "pidfd-store.h"
 #include "apparmor.h"
 #include "asm/dump.h"
@@ -1847,33 +1851,17 @@ static int cr_pre_dump_finish(int status)
 	for_each_pstree_item(item) {
 		struct parasite_ctl *ctl = dmpi(item)->parasite_ctl;
 		struct page_pipe *mem_pp;
-		struct page_xfer xfer;
 
 		if (!ctl)
 			continue;
 
 		pr_info("\tPre-dumping %d\n", vpid(item));
-		timing_start(TIME_MEMWRITE);
-		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, vpid(item));
-		if (ret < 0)
-			goto err;
-
 		mem_pp = dmpi(item)->mem_pp;
 
-		if (opts.pre_dump_mode == PRE_DUMP_READ) {
-			timing_stop(TIME_MEMWRITE);
-			ret = page_xfer_predump_pages(item->pid->real, &xfer, mem_pp);
-		} else {
-			ret = page_xfer_dump_pages(&xfer, mem_pp);
-		}
-
-		xfer.close(&xfer);
-
+		ret = xfer_task_pages(item, mem_pp, opts.pre_dump_mode == PRE_DUMP_READ);
 		if (ret)
 			goto err;
 
-		timing_stop(TIME_MEMWRITE);
-
 		destroy_page_pipe(mem_pp);
 		if (compel_cure_local(ctl))
 			pr_err("Can't cure local: something happened with mapping?\n");
@@ -1888,6 +1876,11 @@ static int cr_pre_dump_finish(int status)
 	}
 
 err:
+	if (dump_workers_wait())
+		ret = -1;
+
+	page_store_close();
+
 	if (unsuspend_lsm())
 		ret = -1;
 
@@ -2026,6 +2019,15 @@ static int cr_dump_finish(int ret)
 {
 	int post_dump_ret = 0;
 
+	/*
+	 * Workers may still be writing pages drained from the tasks,
+	 * these must stay frozen until all of them are done.
+	 */
+	if (dump_workers_wait())
+		ret = -1;
+
+	page_store_close();
+
 	if (disconnect_from_page_server())
 		ret = -1;
 
@@ -2034,6 +2036,10 @@ static int cr_dump_finish(int ret)
 	if (bfd_flush_images())
 		ret = -1;
 
+	/* The post-dump script may take the images file somewhere */
+	if (!ret && img_file_enabled() && img_file_finish())
+		ret = -1;
+
 	cr_plugin_fini(CR_PLUGIN_STAGE__DUMP, ret);
 	cgp_fini();
 
@@ -2090,6 +2096,8 @@ static int cr_dump_finish(int ret)
 		return -1;
 	pstree_switch_state(root_item, (ret || post_dump_ret) ? TASK_ALIVE : opts.final_state);
 	timing_stop(TIME_FROZEN);
+
+	dirty_track_fini();
 	free_pstree(root_item);
 	seccomp_free_entries();
 	free_file_locks();
@@ -2098,6 +2106,9 @@ static int cr_dump_finish(int ret)
 	free_userns_maps();
 
 	close_service_fd(CR_PROC_FD_OFF);
+	/* The images are only complete once the streamer has them all */
+	if (opts.stream && img_streamer_finish())
+		ret = -1;
 	close_image_dir();
 
 	if (ret || post_dump_ret) {
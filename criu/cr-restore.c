@@ -49,6 +49,7 @@
 #include "uffd.h"
 #include "namespaces.h"
 #include "mem.h"
+#include "page-prefetch.h"
 #include "mount.h"
 #include "fsnotify.h"
 #include "pstree.h"
@@ -191,6 +192,18 @@ static int restore_wait_inprogress_tasks(void)
 	return __restore_wait_inprogress_tasks(0);
 }
 
+/*
+ * While the tasks are being forked criu has nothing to do, so
+ * it reads their pages ahead, see page-prefetch.c for details.
+ */
+static int restore_wait_forking_tasks(void)
+{
+	while ((int)futex_get(&task_entries->nr_in_progress) > 0 && page_prefetch_step() > 0)
+		;
+
+	return restore_wait_inprogress_tasks();
+}
+
 /* Wait all tasks except the current one */
 static int restore_wait_other_tasks(void)
 {
@@ -2183,6 +2196,20 @@ static void ignore_kids(void)
 		pr_perror("Restoring CHLD sigaction failed");
 }
 
+/* All the pages are read by the time tasks restore their creds */
+static void collect_pages_read_stats(void)
+{
+	u64 bytes = task_entries->read_bytes;
+	u64 us = (task_entries->read_end - task_entries->read_start) / 1000;
+
+	if (!bytes)
+		return;
+
+	pr_info("Read %" PRIu64 " bytes of pages in %" PRIu64 " us\n", bytes, us);
+	cnt_add(CNT_PAGES_READ, bytes >> PAGE_SHIFT);
+	cnt_add(CNT_PAGES_READ_TIME, us);
+}
+
 static unsigned int saved_loginuid;
 
 static int prepare_userns_hook(void)
@@ -2347,7 +2374,7 @@ static int restore_root_task(struct pstree_item *init)
 		goto out_kill;
 
 	pr_info("Wait until namespaces are created\n");
-	ret = restore_wait_inprogress_tasks();
+	ret = restore_wait_forking_tasks();
 	if (ret)
 		goto out_kill;
 
@@ -2386,7 +2413,8 @@ static int restore_root_task(struct pstree_item *init)
 
 skip_ns_bouncing:
 
-	ret = restore_wait_inprogress_tasks();
+	ret = restore_wait_forking_tasks();
+	page_prefetch_fini();
 	if (ret < 0)
 		goto out_kill;
 
@@ -2467,6 +2495,7 @@ skip_ns_bouncing:
 		goto out_kill_network_unlocked;
 
 	timing_stop(TIME_RESTORE);
+	collect_pages_read_stats();
 
 	if (catch_tasks(root_seized)) {
 		pr_err("Can't catch all tasks\n");
@@ -2585,6 +2614,8 @@ int prepare_task_entries(void)
 	task_entries->nr_tasks = 0;
 	task_entries->nr_helpers = 0;
 	futex_set(&task_entries->start, CR_STATE_FAIL);
+	task_entries->read_bytes = 0;
+	task_entries->read_start = task_entries->read_end = 0;
 	mutex_init(&task_entries->userns_sync_lock);
 	mutex_init(&task_entries->last_pid_mutex);
 
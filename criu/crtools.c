@@ -46,6 +46,7 @@
 
 #include "setproctitle.h"
 #include "sysctl.h"
+#include "pre-dump-iter.h"
 
 void flush_early_log_to_stderr(void) __attribute__((destructor));
 
@@ -286,6 +287,9 @@ int main(int argc, char *argv[], char *envp[])
 		if (!opts.tree_id)
 			goto opt_pid_missing;
 
+		if (opts.pre_dump_iters && cr_pre_dump_iterate(opts.tree_id))
+			return 1;
+
 		return cr_dump_tasks(opts.tree_id);
 	}
 
@@ -410,7 +414,19 @@ usage:
 	       "                        this requires running a second instance of criu\n"
 	       "                        in lazy-pages mode: 'criu lazy-pages -D DIR'\n"
 	       "                        --lazy-pages and lazy-pages mode require userfaultfd\n"
+	       "  --lazy-xfer MODE      how lazy-pages daemon transfers pages in background:\n"
+	       "                        adaptive - sized by fault rate, bandwidth and RTT\n"
+	       "                                   (default)\n"
+	       "                        fixed    - grow by 64K, drop back on a page fault\n"
+	       "  --lazy-workers NUM    serve page faults of the restored processes in up to\n"
+	       "                        NUM lazy-pages daemon processes (default 1)\n"
+	       "  --lazy-push           in lazy-pages mode, let the page server push all the\n"
+	       "                        lazy pages in the background, hot ones first\n"
 	       "  --stream              dump/restore images using criu-image-streamer\n"
+	       "  --stream-mux          stream several images at once over one multiplexed\n"
+	       "                        connection to the image streamer\n"
+	       "  --images-file FILE    on dump write the images into FILE, on restore read\n"
+	       "                        them from it\n"
 	       "  --mntns-compat-mode   Use mount engine in compatibility mode. By default criu\n"
 	       "                        tries to use mount-v2 mode with more reliable algorithm\n"
 	       "                        based on MOVE_MOUNT_SET_GROUP kernel feature\n"
@@ -543,11 +559,37 @@ usage:
 	       "                        will be punched from the image\n"
 	       "  --pre-dump-mode       splice - parasite based pre-dumping (default)\n"
 	       "                        read   - process_vm_readv syscall based pre-dumping\n"
+	       "  --track-mem-mode MODE how the memory changes are tracked:\n"
+	       "                        soft-dirty - soft-dirty bits in page tables (default)\n"
+	       "                        uffd-wp    - userfaultfd write-protection, works\n"
+	       "                                     while the tasks are dumped by one criu\n"
+	       "  --pre-dump-iters NUM  on dump, pre-dump the memory up to NUM times before\n"
+	       "                        the final dump, stopping once it converges\n"
+	       "  --downtime MSEC       with --pre-dump-iters, stop pre-dumping once the final\n"
+	       "                        dump is expected to write its memory within MSEC\n"
+	       "  --pre-dump-bandwidth MB\n"
+	       "                        with --pre-dump-iters, the rate the memory is written\n"
+	       "                        with, MB/s (default is measured by the pre-dumps)\n"
+	       "  --dump-workers NUM    write pages of up to NUM tasks and shared memory\n"
+	       "                        segments into images in parallel\n"
+	       "                        (default 1, i.e. one task after another)\n"
+	       "  --compress            write pages into images in compressed frames\n"
+	       "  --dedup-pages         keep only one copy of identical pages of all tasks\n"
+	       "                        in the pages store image\n"
+	       "  --skip-zero-pages     don't write zero pages of anonymous memory\n"
+	       "  --io-uring            write pages and images asynchronously with io_uring,\n"
+	       "                        on restore read pages with it\n"
+	       "  --io-uring-depth NUM  keep up to NUM io_uring requests in flight (default 64)\n"
+	       "  --prefetch-pages      on restore read pages images ahead while the tasks\n"
+	       "                        are being forked\n"
+	       "  --collect-workers NUM on restore unpack the images of files, sockets etc\n"
+	       "                        with up to NUM threads (default 1)\n"
 	       "\n"
 	       "Page/Service server options:\n"
 	       "  --address ADDR        address of server or service\n"
 	       "  --port PORT           port of page server\n"
 	       "  --ps-socket FD        use specified FD as page server socket\n"
+	       "  --ps-streams NUM      send pages over NUM more connections to page server\n"
 	       "  -d|--daemon           run in the background after creating socket\n"
 	       "  --status-fd FD        write \\0 to the FD and close it once process is ready\n"
 	       "                        to handle requests\n"
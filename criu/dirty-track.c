@@ -0,0 +1,271 @@
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "linux/userfaultfd.h"
+#include "common/scm.h"
+
+#include "cr_options.h"
+#include "dirty-track.h"
+#include "parasite-syscall.h"
+#include "pstree.h"
+#include "vma.h"
+#include "xmalloc.h"
+#include "util.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "dirty-track: "
+
+/*
+ * With --track-mem-mode uffd-wp the private anonymous memory of the
+ * tasks is registered for the asynchronous write-protection with a
+ * userfaultfd, that each task creates in the parasite and hands over
+ * to criu. The writes into the protected pages are resolved by the
+ * kernel, which clears the protection of the written pages. The
+ * PAGEMAP_SCAN ioctl then reports them as PAGE_IS_WRITTEN and, with
+ * PM_SCAN_WP_MATCHING, protects them again in the same call, so the
+ * pages written between the scan and the reset are never missed.
+ *
+ * The protection lives as long as the userfaultfd, so the trackers
+ * are kept for the whole criu run and the memory is only tracked
+ * between the iterations done by it. For the VMAs that weren't
+ * registered by the tracker before, all the pages are dumped.
+ */
+
+struct dirty_tracker {
+	struct list_head list;
+	pid_t pid;
+	int uffd;
+};
+
+static LIST_HEAD(trackers);
+
+bool dirty_track_wp(void)
+{
+	return opts.track_mem && opts.track_mem_mode == TRACK_MEM_UFFD_WP;
+}
+
+static struct dirty_tracker *tracker_find(pid_t pid)
+{
+	struct dirty_tracker *t;
+
+	list_for_each_entry(t, &trackers, list)
+		if (t->pid == pid)
+			return t;
+
+	return NULL;
+}
+
+static struct dirty_tracker *tracker_new(pid_t pid, struct parasite_ctl *ctl)
+{
+	struct dirty_tracker *t;
+
+	t = xmalloc(sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->uffd = parasite_get_uffd_seized(ctl);
+	if (t->uffd < 0) {
+		pr_err("Can't get userfaultfd of %d\n", pid);
+		xfree(t);
+		return NULL;
+	}
+
+	t->pid = pid;
+	list_add_tail(&t->list, &trackers);
+	pr_info("Tracking %d's memory with userfaultfd %d\n", pid, t->uffd);
+	return t;
+}
+
+static void tracker_del(struct dirty_tracker *t)
+{
+	list_del(&t->list);
+	close(t->uffd);
+	xfree(t);
+}
+
+static bool vma_can_be_tracked(struct vma_area *vma)
+{
+	return vma_area_is(vma, VMA_AREA_REGULAR) && vma_area_is(vma, VMA_ANON_PRIVATE) &&
+	       !vma_area_is(vma, VMA_AREA_AIORING) && !(vma->e->flags & MAP_HUGETLB);
+}
+
+static int wp_register(int uffd, struct vma_area *vma)
+{
+	struct uffdio_register reg = {
+		.range.start = vma->e->start,
+		.range.len = vma_area_len(vma),
+		.mode = UFFDIO_REGISTER_MODE_WP,
+	};
+
+	/* The range is registered in the mm of the task, that created the uffd */
+	if (ioctl(uffd, UFFDIO_REGISTER, &reg))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Registers the task's VMAs for the write-protection, the ones that are
+ * registered already stay so. Called on each iteration with the task
+ * frozen and its VMAs just collected, before the pages are scanned.
+ */
+int dirty_track_prepare(struct pstree_item *item, struct vm_area_list *vmas, struct parasite_ctl *ctl)
+{
+	pid_t pid = item->pid->real;
+	struct dirty_tracker *t;
+	struct vma_area *vma;
+	int nr_tracked = 0, nr_written = 0;
+	bool fresh = false;
+	int ret;
+
+	t = tracker_find(pid);
+	if (!t) {
+		t = tracker_new(pid, ctl);
+		if (!t)
+			return -1;
+		fresh = true;
+	}
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		if (!vma_can_be_tracked(vma))
+			continue;
+again:
+		ret = wp_register(t->uffd, vma);
+		if ((ret == -ESRCH || ret == -ENOMEM) && !fresh) {
+			/*
+			 * The mm the tracker was created for is gone, the
+			 * task has exec-ed or the pid is reused.
+			 */
+			pr_info("Restarting tracking of %d\n", pid);
+			tracker_del(t);
+			t = tracker_new(pid, ctl);
+			if (!t)
+				return -1;
+			fresh = true;
+			goto again;
+		}
+
+		if (ret == -EBUSY || ret == -EINVAL || ret == -EPERM) {
+			/* Registered by someone else or not supported */
+			pr_debug("Can't track %lx-%lx (%d)\n", (long)vma->e->start, (long)vma->e->end, ret);
+			continue;
+		}
+
+		if (ret) {
+			errno = -ret;
+			pr_perror("Can't register %d's %lx-%lx for write-protection", pid, (long)vma->e->start,
+				  (long)vma->e->end);
+			return -1;
+		}
+
+		vma->wp_track = true;
+		/* The writes are only known since the tracker registered it */
+		vma->wp_written = vma->uffd_wp && !fresh;
+		nr_tracked++;
+		nr_written += vma->wp_written;
+	}
+
+	pr_info("%d: %d VMAs tracked, %d with the writes known\n", pid, nr_tracked, nr_written);
+	return 0;
+}
+
+/*
+ * The pre-dumps of criu dump --pre-dump-iters run in child processes,
+ * which pass the trackers back, so that the next iteration and the
+ * final dump inherit them.
+ */
+int dirty_track_send(int sk)
+{
+	struct dirty_tracker *t;
+	int nr = 0, ret = -1;
+	pid_t *pids = NULL;
+	int *fds = NULL;
+
+	list_for_each_entry(t, &trackers, list)
+		nr++;
+
+	if (write(sk, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_perror("Can't send the number of trackers");
+		return -1;
+	}
+
+	if (!nr)
+		return 0;
+
+	fds = xmalloc(nr * sizeof(*fds));
+	pids = xmalloc(nr * sizeof(*pids));
+	if (!fds || !pids)
+		goto out;
+
+	nr = 0;
+	list_for_each_entry(t, &trackers, list) {
+		fds[nr] = t->uffd;
+		pids[nr] = t->pid;
+		nr++;
+	}
+
+	ret = send_fds(sk, NULL, 0, fds, nr, pids, sizeof(*pids));
+	if (ret)
+		pr_err("Can't send trackers\n");
+out:
+	xfree(fds);
+	xfree(pids);
+	return ret;
+}
+
+/* Replaces the trackers with the ones sent by dirty_track_send() */
+int dirty_track_recv(int sk)
+{
+	struct dirty_tracker *t;
+	pid_t *pids = NULL;
+	int *fds = NULL;
+	int nr, i, ret = -1;
+
+	if (read(sk, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_perror("Can't receive the number of trackers");
+		return -1;
+	}
+
+	dirty_track_fini();
+	if (!nr)
+		return 0;
+
+	fds = xmalloc(nr * sizeof(*fds));
+	pids = xmalloc(nr * sizeof(*pids));
+	if (!fds || !pids)
+		goto out;
+
+	if (recv_fds(sk, fds, nr, pids, sizeof(*pids))) {
+		pr_err("Can't receive trackers\n");
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		t = xmalloc(sizeof(*t));
+		if (!t) {
+			for (; i < nr; i++)
+				close(fds[i]);
+			goto out;
+		}
+
+		t->pid = pids[i];
+		t->uffd = fds[i];
+		list_add_tail(&t->list, &trackers);
+	}
+
+	ret = 0;
+out:
+	xfree(fds);
+	xfree(pids);
+	return ret;
+}
+
+void dirty_track_fini(void)
+{
+	struct dirty_tracker *t, *tmp;
+
+	list_for_each_entry_safe(t, tmp, &trackers, list)
+		tracker_del(t);
+}
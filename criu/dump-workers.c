@@ -0,0 +1,128 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "cr_options.h"
+#include "dump-workers.h"
+#include "page-store.h"
+#include "stats.h"
+#include "util.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "dump-workers: "
+
+/*
+ * Dump workers are forked processes that write the already drained
+ * pages of a task into images, while criu itself goes on with the
+ * next task. They cannot be threads -- the parasite can only be
+ * driven by the process which has ptrace-seized the task, and the
+ * logging, bfd buffers and image ids are not thread-safe anyway.
+ *
+ * The jobs are collected in FIFO order, so when all the workers are
+ * busy we wait for the oldest one.
+ */
+
+static pid_t workers[DUMP_WORKERS_MAX];
+static unsigned int next_worker;
+static bool workers_failed;
+
+int dump_workers_nr(void)
+{
+	if (opts.dump_workers <= 1)
+		return 1;
+
+	/*
+	 * Both page server and image streamer have a single
+	 * connection all the images go through, so pages can't
+	 * be written there from several processes at once. The
+	 * multiplexed streamer protocol has a channel per image.
+	 */
+	if (opts.use_page_server || (opts.stream && !opts.stream_mux))
+		return 1;
+
+	/* The pages store index lives in the memory of one process */
+	if (page_store_enabled())
+		return 1;
+
+	return min_t(unsigned int, opts.dump_workers, DUMP_WORKERS_MAX);
+}
+
+bool dump_workers_enabled(void)
+{
+	return dump_workers_nr() > 1;
+}
+
+static int reap_worker(unsigned int id)
+{
+	pid_t pid = workers[id];
+	int status;
+
+	workers[id] = 0;
+
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Unable to wait for worker %d", pid);
+		workers_failed = true;
+		return -1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		pr_err("Worker %d failed (status 0x%x)\n", pid, status);
+		workers_failed = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Runs @fn(@arg) in a dump worker. Returns 1 if the job was handed
+ * over to a forked worker, so the caller has to release its own copy
+ * of the job resources, 0 if the job was run in place and -1 on error.
+ */
+int dump_worker_run(dump_worker_fn fn, void *arg)
+{
+	unsigned int id;
+	pid_t pid;
+
+	if (!dump_workers_enabled())
+		return fn(arg) ? -1 : 0;
+
+	id = next_worker;
+	if (workers[id] && reap_worker(id))
+		return -1;
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork worker, running job in place");
+		return fn(arg) ? -1 : 0;
+	}
+
+	if (pid == 0) {
+		stats_set_dump_worker(id);
+		exit(fn(arg) ? 1 : 0);
+	}
+
+	pr_debug("Started worker %d in slot %u\n", pid, id);
+	workers[id] = pid;
+	next_worker = (id + 1) % dump_workers_nr();
+	return 1;
+}
+
+int dump_workers_wait(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < DUMP_WORKERS_MAX; i++)
+		if (workers[i])
+			reap_worker(i);
+
+	next_worker = 0;
+	if (workers_failed) {
+		workers_failed = false;
+		return -1;
+	}
+
+	return 0;
+}
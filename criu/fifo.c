@@ -178,4 +178,5 @@ struct collect_image_info fifo_data_cinfo = {
 	.pb_type = PB_PIPE_DATA,
 	.priv_size = sizeof(struct pipe_data_rst),
 	.collect = collect_fifo_data,
+	.flags = COLLECT_IMG_DATA,
 };
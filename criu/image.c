@@ -17,6 +17,7 @@
 #include "images/inventory.pb-c.h"
 #include "images/pagemap.pb-c.h"
 #include "proc_parse.h"
+#include "img-file.h"
 #include "img-streamer.h"
 #include "namespaces.h"
 
@@ -355,6 +356,11 @@ struct cr_img *open_image_at(int dfd, int type, unsigned long flags, ...)
 	if (!img)
 		return NULL;
 
+	img->_x.window = false;
+	img->_x.base = img->_x.end = 0;
+	img->_x.idx = NULL;
+	img->_x.slot = NULL;
+
 	oflags = flags | imgset_template[type].oflags;
 
 	va_start(args, flags);
@@ -446,7 +452,9 @@ static int do_open_image(struct cr_img *img, int dfd, int type, unsigned long of
 
 	flags = oflags & ~(O_NOBUF | O_SERVICE | O_FORCE_LOCAL);
 
-	if (opts.stream && !(oflags & O_FORCE_LOCAL)) {
+	if (img_file_enabled() && dfd == get_service_fd(IMG_FD_OFF) && img_file_takes(flags)) {
+		ret = img_file_open_image(&img->_x, type, flags, path);
+	} else if (opts.stream && !(oflags & O_FORCE_LOCAL)) {
 		ret = img_streamer_open(path, flags);
 		errno = EIO; /* errno value is meaningless, only the ret value is meaningful */
 	} else if (root_ns_mask & CLONE_NEWUSER && type == CR_FD_PAGES && oflags & O_RDWR) {
@@ -490,6 +498,9 @@ static int do_open_image(struct cr_img *img, int dfd, int type, unsigned long of
 			goto err;
 	}
 
+	if (img->_x.idx && img_file_set_window(img, type))
+		goto err;
+
 	if (imgset_template[type].magic == RAW_IMAGE_MAGIC)
 		goto skip_magic;
 
@@ -534,12 +545,30 @@ void close_image(struct cr_img *img)
 		 */
 		unlinkat(get_service_fd(IMG_FD_OFF), img->path, 0);
 		xfree(img->path);
-	} else if (!empty_image(img))
+	} else if (!empty_image(img)) {
+		if (img->_x.slot)
+			img_file_close_image(img);
 		bclose(&img->_x);
+	}
 
 	xfree(img);
 }
 
+/*
+ * Write out the buffered data, so that the image can be
+ * inherited by a child process, which will go on writing it.
+ */
+int flush_image(struct cr_img *img)
+{
+	if (empty_image(img) || lazy_image(img))
+		return 0;
+
+	if (img->_x.slot && img_file_keep(img))
+		return -1;
+
+	return bfd_flush(&img->_x);
+}
+
 struct cr_img *img_from_fd(int fd)
 {
 	struct cr_img *img;
@@ -547,12 +576,38 @@ struct cr_img *img_from_fd(int fd)
 	img = xmalloc(sizeof(*img));
 	if (img) {
 		img->_x.fd = fd;
+		img->_x.window = false;
+		img->_x.base = img->_x.end = 0;
+		img->_x.idx = NULL;
+		img->_x.slot = NULL;
 		bfd_setraw(&img->_x);
 	}
 
 	return img;
 }
 
+static int link_parent(int dfd)
+{
+	int ret;
+
+	if (faccessat(dfd, opts.img_parent, R_OK, 0)) {
+		pr_perror("Invalid parent image directory provided");
+		return -1;
+	}
+
+	ret = symlinkat(opts.img_parent, dfd, CR_PARENT_LINK);
+	if (ret < 0 && errno != EEXIST) {
+		pr_perror("Can't link parent snapshot");
+		return -1;
+	}
+
+	if (opts.img_parent[0] == '/')
+		pr_warn("Absolute paths for parent links "
+			"may not work on restore!\n");
+
+	return 0;
+}
+
 /*
  * `mode` should be O_RSTR or O_DUMP depending on the intent.
  * This is used when opts.stream is enabled for picking the right streamer
@@ -578,21 +633,15 @@ int open_image_dir(char *dir, int mode)
 	if (opts.stream) {
 		if (img_streamer_init(dir, mode) < 0)
 			goto err;
-	} else if (opts.img_parent) {
-		if (faccessat(fd, opts.img_parent, R_OK, 0)) {
-			pr_perror("Invalid parent image directory provided");
+	} else if (img_file_enabled() && mode == O_RSTR) {
+		if (img_file_open())
 			goto err;
-		}
-
-		ret = symlinkat(opts.img_parent, fd, CR_PARENT_LINK);
-		if (ret < 0 && errno != EEXIST) {
-			pr_perror("Can't link parent snapshot");
+	} else if (img_file_enabled() && mode == O_DUMP && opts.mode == CR_DUMP) {
+		if (img_file_create())
+			goto err;
+	} else if (opts.img_parent) {
+		if (link_parent(fd))
 			goto err;
-		}
-
-		if (opts.img_parent[0] == '/')
-			pr_warn("Absolute paths for parent links "
-				"may not work on restore!\n");
 	}
 
 	return 0;
@@ -602,10 +651,57 @@ err:
 	return -1;
 }
 
+/*
+ * Switches to the @name directory inside the images one, creating it
+ * if needed. Used by the pre-dumps that criu dump runs by itself.
+ */
+int open_image_subdir(char *name)
+{
+	int dfd = get_service_fd(IMG_FD_OFF), fd;
+
+	if (mkdirat(dfd, name, 0700) && errno != EEXIST) {
+		pr_perror("Can't create images dir %s", name);
+		return -1;
+	}
+
+	fd = openat(dfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		pr_perror("Can't open images dir %s", name);
+		return -1;
+	}
+
+	fd = install_service_fd(IMG_FD_OFF, fd);
+	if (fd < 0) {
+		pr_err("install_service_fd failed.\n");
+		return -1;
+	}
+
+	if (opts.img_parent && link_parent(fd))
+		return -1;
+
+	return 0;
+}
+
+/* Re-points the parent link of the images directory to @parent */
+int relink_image_parent(char *parent)
+{
+	int dfd = get_service_fd(IMG_FD_OFF);
+
+	if (unlinkat(dfd, CR_PARENT_LINK, 0) && errno != ENOENT) {
+		pr_perror("Can't unlink parent snapshot");
+		return -1;
+	}
+
+	SET_CHAR_OPTS(img_parent, parent);
+	return link_parent(dfd);
+}
+
 void close_image_dir(void)
 {
 	if (opts.stream)
 		img_streamer_finish();
+	else if (img_file_enabled())
+		img_file_close();
 	close_service_fd(IMG_FD_OFF);
 }
 
@@ -761,6 +857,9 @@ off_t img_raw_size(struct cr_img *img)
 {
 	struct stat stat;
 
+	if (img->_x.idx)
+		return img_file_size(img);
+
 	if (fstat(img->_x.fd, &stat)) {
 		pr_perror("Failed to get image stats");
 		return -1;
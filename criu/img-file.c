@@ -0,0 +1,733 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "int.h"
+#include "cr_options.h"
+#include "crtools.h"
+#include "image.h"
+#include "image-desc.h"
+#include "img-file.h"
+#include "servicefd.h"
+#include "common/lock.h"
+#include "page.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "img-file: "
+
+/*
+ * With --images-file criu dump writes the images into a single file as
+ * they are opened, and criu restore reads them from there. The file
+ * starts with a header pointing to the table of contents at its end.
+ * The table lists the images by their names, which tell the type and
+ * the id of an image (e.g. core-1.img), with the extents of the file
+ * each one consists of. Every extent starts at a page boundary, so the
+ * pages can be mapped right from the file and read with O_DIRECT.
+ *
+ * The pages go right into the file. Each pagemap entry gets its room
+ * at the end of the file (see img_raw_reserve()), the room of the next
+ * entry of the same image just extends the extent unless some other
+ * image, e.g. one written by a dump worker, got its room in between.
+ * The other images are written into memfd-s and each one is appended
+ * to the file as a single extent when it's closed. Some of them are
+ * written by tools like iptables-save or tar, which are only given a
+ * file descriptor, and none of them are nearly as big as the pages.
+ * The images handed over to the dump workers (see flush_image()) are
+ * appended when all the workers are done.
+ *
+ * The end of the file and the extents are kept in a shared mapping, so
+ * that the dump workers get their rooms from the same place. Only the
+ * images this dump has created are listed in the table, the one that
+ * was opened the last wins if there are several with the same name.
+ * The table and the header are written after all the images and the
+ * header goes the last, so the file of a failed dump is never taken
+ * for a complete one.
+ *
+ * On restore the images are not opened, each one gets a dup of the file
+ * descriptor and is read with pread()-s within its part of the file (see
+ * struct bfd). The pages images are read at explicit offsets anyway, so
+ * the page-read just starts at the image's one (see img_raw_off()) and
+ * jumps to the next extent where it ends (see img_raw_next()). The few
+ * images that are handed over as raw files, e.g. to iptables-restore,
+ * are copied into a memfd when their raw descriptor is requested.
+ */
+
+#define IMG_FILE_MAGIC	 0x454c4946 /* "FILE" */
+#define IMG_FILE_VERSION 1
+
+struct img_file_head {
+	u32 magic;
+	u32 version;
+	u32 nr;
+	u32 pad;
+	u64 toc_off;
+	u64 toc_size;
+};
+
+/*
+ * The extents of the image and its name, with the trailing zero, follow
+ * the entry, the next entry starts at the 8 bytes boundary.
+ */
+struct img_file_entry {
+	u32 name_len;
+	u32 nr_ext;
+};
+
+struct img_file_ext {
+	u64 off;
+	u64 len;
+};
+
+struct img_file_idx {
+	const char *name;
+	unsigned int nr_ext;
+	struct img_file_ext *ext;
+	off_t size;
+};
+
+#define IMG_FILE_SLOTS	 (1 << 16)
+#define IMG_FILE_EXTENTS (1 << 22)
+#define IMG_FILE_NAME	 64
+
+/* An image the dump has created */
+struct img_file_slot {
+	char name[IMG_FILE_NAME];
+	pid_t pid;    /* the process which has created it */
+	bool spool;   /* written into a memfd */
+	bool kept;    /* the memfd is appended when the dump is over */
+	bool dropped; /* removed by the dump */
+	int last;     /* the image's last extent, -1 if there's none */
+};
+
+struct img_file_xent {
+	unsigned int slot;
+	struct img_file_ext e;
+};
+
+struct img_file_shared {
+	mutex_t lock;
+	bool failed;
+	u64 tail;
+	unsigned int nr_slots;
+	unsigned int nr_ext;
+	struct img_file_slot slots[IMG_FILE_SLOTS];
+	struct img_file_xent ext[IMG_FILE_EXTENTS];
+};
+
+struct img_file_spool {
+	unsigned int slot;
+	int fd;
+};
+
+static struct {
+	/* restore */
+	unsigned int nr;
+	struct img_file_idx *idx; /* sorted by name */
+	void *toc;
+
+	/* dump */
+	struct img_file_shared *sh;
+	pid_t owner;
+	unsigned int nr_kept;
+	struct img_file_spool *kept;
+} img_file;
+
+bool img_file_enabled(void)
+{
+	return opts.images_file != NULL;
+}
+
+/*
+ * Tells whether an image opened in the images directory with @flags
+ * goes to the images file or comes from it.
+ */
+bool img_file_takes(int flags)
+{
+	if (flags == O_RDONLY)
+		return img_file.toc != NULL;
+
+	return img_file.sh != NULL && (flags & O_CREAT);
+}
+
+static int cmp_idx(const void *a, const void *b)
+{
+	return strcmp(((const struct img_file_idx *)a)->name, ((const struct img_file_idx *)b)->name);
+}
+
+int img_file_create(void)
+{
+	int fd;
+
+	img_file.sh = mmap(NULL, sizeof(*img_file.sh), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (img_file.sh == MAP_FAILED) {
+		pr_perror("Can't map the images file index");
+		img_file.sh = NULL;
+		return -1;
+	}
+
+	mutex_init(&img_file.sh->lock);
+	/* The header is written into the first page in the end */
+	img_file.sh->tail = PAGE_SIZE;
+	img_file.owner = getpid();
+
+	fd = open(opts.images_file, O_RDWR | O_CREAT | O_TRUNC, CR_FD_PERM);
+	if (fd < 0) {
+		pr_perror("Can't create %s", opts.images_file);
+		goto err;
+	}
+
+	if (install_service_fd(IMG_FILE_FD_OFF, fd) < 0)
+		goto err;
+
+	return 0;
+
+err:
+	munmap(img_file.sh, sizeof(*img_file.sh));
+	img_file.sh = NULL;
+	return -1;
+}
+
+static struct img_file_slot *new_slot(int type, const char *name)
+{
+	struct img_file_shared *sh = img_file.sh;
+	struct img_file_slot *s = NULL;
+
+	if (strlen(name) >= IMG_FILE_NAME) {
+		pr_err("Too long image name %s\n", name);
+		return NULL;
+	}
+
+	mutex_lock(&sh->lock);
+	if (sh->nr_slots < IMG_FILE_SLOTS)
+		s = &sh->slots[sh->nr_slots++];
+	mutex_unlock(&sh->lock);
+
+	if (!s) {
+		pr_err("Too many images in %s\n", opts.images_file);
+		return NULL;
+	}
+
+	strcpy(s->name, name);
+	s->pid = getpid();
+	s->spool = type != CR_FD_PAGES;
+	s->last = -1;
+	return s;
+}
+
+/* Reserves @len bytes at the end of the file for the @s image */
+static off_t reserve_extent(struct img_file_slot *s, size_t len)
+{
+	struct img_file_shared *sh = img_file.sh;
+	struct img_file_xent *x = NULL;
+	off_t off = -1;
+
+	mutex_lock(&sh->lock);
+	if (s->last >= 0)
+		x = &sh->ext[s->last];
+
+	if (x && x->e.off + x->e.len == sh->tail) {
+		x->e.len += len;
+	} else if (sh->nr_ext < IMG_FILE_EXTENTS) {
+		sh->tail = round_up(sh->tail, PAGE_SIZE);
+		x = &sh->ext[sh->nr_ext];
+		x->slot = s - sh->slots;
+		x->e.off = sh->tail;
+		x->e.len = len;
+		s->last = sh->nr_ext++;
+	} else
+		goto out;
+
+	off = sh->tail;
+	sh->tail += len;
+out:
+	mutex_unlock(&sh->lock);
+
+	if (off < 0)
+		pr_err("Too many extents in %s\n", opts.images_file);
+	return off;
+}
+
+int img_file_reserve(struct cr_img *img, size_t len, off_t *poff)
+{
+	off_t off;
+
+	off = reserve_extent(img->_x.slot, len);
+	if (off < 0)
+		return -1;
+
+	if (lseek(img->_x.fd, off, SEEK_SET) < 0) {
+		pr_perror("Can't seek %s", opts.images_file);
+		return -1;
+	}
+
+	*poff = off;
+	return 0;
+}
+
+static int append_spool(struct img_file_slot *s, int fd)
+{
+	int ifd = get_service_fd(IMG_FILE_FD_OFF);
+	size_t done = 0;
+	struct stat st;
+	ssize_t ret;
+	void *data;
+	off_t off;
+
+	if (fstat(fd, &st)) {
+		pr_perror("Can't stat image %s", s->name);
+		return -1;
+	}
+
+	if (!st.st_size)
+		return 0;
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		pr_perror("Can't map image %s", s->name);
+		return -1;
+	}
+
+	off = reserve_extent(s, st.st_size);
+	if (off < 0)
+		goto err;
+
+	while (done < st.st_size) {
+		ret = pwrite(ifd, data + done, st.st_size - done, off + done);
+		if (ret <= 0) {
+			pr_perror("Can't write image %s into %s", s->name, opts.images_file);
+			goto err;
+		}
+		done += ret;
+	}
+
+	munmap(data, st.st_size);
+	return 0;
+
+err:
+	munmap(data, st.st_size);
+	return -1;
+}
+
+int img_file_open_image(struct bfd *b, int type, int flags, const char *name)
+{
+	struct img_file_idx key = { .name = name };
+	struct img_file_slot *s;
+	int fd;
+
+	if (flags == O_RDONLY) {
+		b->idx = bsearch(&key, img_file.idx, img_file.nr, sizeof(key), cmp_idx);
+		if (!b->idx) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		return dup(get_service_fd(IMG_FILE_FD_OFF));
+	}
+
+	s = new_slot(type, name);
+	if (!s)
+		return -1;
+
+	/* The pages image gets a file position of its own */
+	if (s->spool)
+		fd = memfd_create("criu-image", 0);
+	else
+		fd = open_proc_rw(PROC_SELF, "fd/%d", get_service_fd(IMG_FILE_FD_OFF));
+	if (fd < 0) {
+		s->dropped = true;
+		return -1;
+	}
+
+	b->slot = s;
+	return fd;
+}
+
+/*
+ * The image is going to be written by a dump worker, so the criu
+ * itself appends it when the workers are done.
+ */
+int img_file_keep(struct cr_img *img)
+{
+	struct img_file_slot *s = img->_x.slot;
+	struct img_file_spool *sp;
+	int fd;
+
+	if (!s->spool || s->kept || getpid() != img_file.owner)
+		return 0;
+
+	if (xrealloc_safe(&img_file.kept, (img_file.nr_kept + 1) * sizeof(*img_file.kept)))
+		return -1;
+
+	fd = dup(img->_x.fd);
+	if (fd < 0) {
+		pr_perror("Can't keep image %s", s->name);
+		return -1;
+	}
+
+	sp = &img_file.kept[img_file.nr_kept++];
+	sp->slot = s - img_file.sh->slots;
+	sp->fd = fd;
+	s->kept = true;
+	return 0;
+}
+
+void img_file_close_image(struct cr_img *img)
+{
+	struct img_file_slot *s = img->_x.slot;
+
+	if (!s->spool || s->kept || s->dropped || s->pid != getpid())
+		return;
+
+	if (bfd_flush(&img->_x) || append_spool(s, img->_x.fd))
+		img_file.sh->failed = true;
+}
+
+void img_file_drop(struct cr_img *img)
+{
+	if (img->_x.slot)
+		img->_x.slot->dropped = true;
+}
+
+static int cmp_slots(const void *a, const void *b)
+{
+	struct img_file_slot *slots = img_file.sh->slots;
+	unsigned int sa = *(const unsigned int *)a, sb = *(const unsigned int *)b;
+	int ret;
+
+	ret = strcmp(slots[sa].name, slots[sb].name);
+	if (ret)
+		return ret;
+
+	/* The image opened later goes first */
+	return sa < sb ? 1 : -1;
+}
+
+static size_t toc_entry_size(struct img_file_slot *s, unsigned int nr_ext)
+{
+	return round_up(sizeof(struct img_file_entry) + nr_ext * sizeof(struct img_file_ext) + strlen(s->name) + 1,
+			8);
+}
+
+/*
+ * Called at the end of a successful dump, after all the dump workers are
+ * done and the images are closed. Writes the table of contents and the
+ * header, the data of the images is in the file by now.
+ */
+int img_file_finish(void)
+{
+	struct img_file_shared *sh = img_file.sh;
+	int fd = get_service_fd(IMG_FILE_FD_OFF), ret = -1;
+	struct img_file_head head = {
+		.magic = IMG_FILE_MAGIC,
+		.version = IMG_FILE_VERSION,
+	};
+	unsigned int *nr_ext = NULL, *first = NULL, *sel = NULL, nr_sel = 0, i, j;
+	struct img_file_ext *ext = NULL;
+	size_t toc_size = 0;
+	void *toc = NULL, *p;
+
+	for (i = 0; i < img_file.nr_kept; i++) {
+		struct img_file_slot *s = &sh->slots[img_file.kept[i].slot];
+
+		if (!s->dropped && append_spool(s, img_file.kept[i].fd))
+			goto out;
+	}
+
+	if (sh->failed) {
+		pr_err("Some images are not written into %s\n", opts.images_file);
+		goto out;
+	}
+
+	nr_ext = xzalloc(sh->nr_slots * sizeof(*nr_ext));
+	first = xmalloc(sh->nr_slots * sizeof(*first));
+	sel = xmalloc(sh->nr_slots * sizeof(*sel));
+	ext = xmalloc(sh->nr_ext * sizeof(*ext));
+	if (!nr_ext || !first || !sel || !ext)
+		goto out;
+
+	/* The extents go to the slots in the order of their offsets */
+	for (i = 0; i < sh->nr_ext; i++)
+		nr_ext[sh->ext[i].slot]++;
+	for (i = 0, j = 0; i < sh->nr_slots; i++) {
+		first[i] = j;
+		j += nr_ext[i];
+	}
+	for (i = 0; i < sh->nr_ext; i++)
+		ext[first[sh->ext[i].slot]++] = sh->ext[i].e;
+	for (i = 0; i < sh->nr_slots; i++)
+		first[i] -= nr_ext[i];
+
+	for (i = 0; i < sh->nr_slots; i++)
+		if (!sh->slots[i].dropped)
+			sel[nr_sel++] = i;
+	qsort(sel, nr_sel, sizeof(*sel), cmp_slots);
+
+	for (i = 0, j = 0; i < nr_sel; i++) {
+		struct img_file_slot *s = &sh->slots[sel[i]];
+
+		if (j && !strcmp(s->name, sh->slots[sel[j - 1]].name))
+			continue;
+
+		sel[j++] = sel[i];
+		toc_size += toc_entry_size(s, nr_ext[sel[i]]);
+	}
+	nr_sel = j;
+
+	toc = xzalloc(toc_size);
+	if (!toc)
+		goto out;
+
+	p = toc;
+	for (i = 0; i < nr_sel; i++) {
+		struct img_file_slot *s = &sh->slots[sel[i]];
+		struct img_file_entry *e = p;
+
+		e->name_len = strlen(s->name) + 1;
+		e->nr_ext = nr_ext[sel[i]];
+		memcpy(p + sizeof(*e), ext + first[sel[i]], e->nr_ext * sizeof(*ext));
+		memcpy(p + sizeof(*e) + e->nr_ext * sizeof(*ext), s->name, e->name_len);
+		p += toc_entry_size(s, e->nr_ext);
+	}
+
+	head.nr = nr_sel;
+	head.toc_off = sh->tail;
+	head.toc_size = toc_size;
+
+	if (pwrite(fd, toc, toc_size, head.toc_off) != toc_size) {
+		pr_perror("Can't write %s contents", opts.images_file);
+		goto out;
+	}
+
+	/* The header can only get to the disk after all the rest */
+	if (fdatasync(fd) || pwrite(fd, &head, sizeof(head), 0) != sizeof(head) || fsync(fd)) {
+		pr_perror("Can't write %s", opts.images_file);
+		goto out;
+	}
+
+	pr_info("Wrote %u images in %u extents into %s (%lu bytes)\n", nr_sel, sh->nr_ext, opts.images_file,
+		(unsigned long)(head.toc_off + toc_size));
+	ret = 0;
+out:
+	xfree(nr_ext);
+	xfree(first);
+	xfree(sel);
+	xfree(ext);
+	xfree(toc);
+	return ret;
+}
+
+int img_file_open(void)
+{
+	struct img_file_head head;
+	struct stat st;
+	unsigned int i, j;
+	void *p, *end;
+	int fd;
+
+	fd = open(opts.images_file, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open %s", opts.images_file);
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		pr_perror("Can't stat %s", opts.images_file);
+		goto err;
+	}
+
+	if (pread(fd, &head, sizeof(head), 0) != sizeof(head)) {
+		pr_perror("Can't read %s header", opts.images_file);
+		goto err;
+	}
+
+	if (head.magic != IMG_FILE_MAGIC || head.version != IMG_FILE_VERSION) {
+		pr_err("%s is not an images file (magic %#x version %u)\n", opts.images_file, head.magic,
+		       head.version);
+		goto err;
+	}
+
+	if (head.toc_off + head.toc_size > st.st_size) {
+		pr_err("Truncated %s\n", opts.images_file);
+		goto err;
+	}
+
+	img_file.toc = xmalloc(head.toc_size);
+	img_file.idx = xmalloc(head.nr * sizeof(*img_file.idx));
+	if (!img_file.toc || !img_file.idx)
+		goto err;
+
+	if (pread(fd, img_file.toc, head.toc_size, head.toc_off) != head.toc_size) {
+		pr_perror("Can't read %s contents", opts.images_file);
+		goto err;
+	}
+
+	p = img_file.toc;
+	end = p + head.toc_size;
+	for (i = 0; i < head.nr; i++) {
+		struct img_file_idx *idx = &img_file.idx[i];
+		struct img_file_entry *e = p;
+		struct img_file_ext *ext;
+		char *name;
+
+		if (p + sizeof(*e) > end)
+			goto corrupted;
+
+		ext = p + sizeof(*e);
+		if ((end - (void *)ext) / sizeof(*ext) < e->nr_ext)
+			goto corrupted;
+
+		name = (char *)(ext + e->nr_ext);
+		if (!e->name_len || (void *)name + e->name_len > end || name[e->name_len - 1] != '\0')
+			goto corrupted;
+
+		idx->name = name;
+		idx->nr_ext = e->nr_ext;
+		idx->ext = ext;
+		idx->size = 0;
+		for (j = 0; j < e->nr_ext; j++) {
+			if (ext[j].off + ext[j].len > head.toc_off || (j && ext[j].off < ext[j - 1].off + ext[j - 1].len))
+				goto corrupted;
+			idx->size += ext[j].len;
+		}
+
+		p += round_up(sizeof(*e) + e->nr_ext * sizeof(*ext) + e->name_len, 8);
+	}
+
+	img_file.nr = head.nr;
+	qsort(img_file.idx, img_file.nr, sizeof(*img_file.idx), cmp_idx);
+
+	if (install_service_fd(IMG_FILE_FD_OFF, fd) < 0)
+		goto err_free;
+
+	pr_info("Opened %s with %u images\n", opts.images_file, img_file.nr);
+	return 0;
+
+corrupted:
+	pr_err("Corrupted entry %u in %s\n", i, opts.images_file);
+err:
+	close(fd);
+err_free:
+	img_file_close();
+	return -1;
+}
+
+void img_file_close(void)
+{
+	unsigned int i;
+
+	close_service_fd(IMG_FILE_FD_OFF);
+	xfree(img_file.toc);
+	xfree(img_file.idx);
+	img_file.toc = NULL;
+	img_file.idx = NULL;
+	img_file.nr = 0;
+
+	for (i = 0; i < img_file.nr_kept; i++)
+		close(img_file.kept[i].fd);
+	xfree(img_file.kept);
+	img_file.kept = NULL;
+	img_file.nr_kept = 0;
+
+	if (img_file.sh) {
+		munmap(img_file.sh, sizeof(*img_file.sh));
+		img_file.sh = NULL;
+	}
+}
+
+int img_file_set_window(struct cr_img *img, int type)
+{
+	struct bfd *b = &img->_x;
+	struct img_file_idx *idx = b->idx;
+
+	b->base = idx->nr_ext ? idx->ext[0].off : 0;
+	b->end = b->base + idx->size;
+	b->pos = b->base;
+
+	/* The pages are read at their offsets in the file by the page-read */
+	if (type == CR_FD_PAGES)
+		return 0;
+
+	if (idx->nr_ext > 1) {
+		pr_err("Image %s is split in %s\n", idx->name, opts.images_file);
+		return -1;
+	}
+
+	b->window = type != CR_FD_PAGES_STORE;
+	return 0;
+}
+
+off_t img_file_size(struct cr_img *img)
+{
+	return img->_x.idx->size;
+}
+
+/* The extents go one after another, so the one ending at @off is looked up */
+off_t img_file_next(struct cr_img *img, off_t off)
+{
+	struct img_file_idx *idx = img->_x.idx;
+	unsigned int lo = 0, hi = idx->nr_ext;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		off_t end = idx->ext[mid].off + idx->ext[mid].len;
+
+		if (end == off)
+			return mid + 1 < idx->nr_ext ? idx->ext[mid + 1].off : off;
+		if (end < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return off;
+}
+
+/*
+ * The raw descriptor of an image may be read from its current position
+ * or at the offsets in the image, so the whole image is copied and the
+ * copy is positioned where the image was read till.
+ */
+int img_file_raw(struct cr_img *img)
+{
+	struct bfd *b = &img->_x;
+	off_t off = b->base;
+	ssize_t ret;
+	int fd;
+
+	fd = memfd_create("criu-image", 0);
+	if (fd < 0) {
+		pr_perror("Can't create memfd for image");
+		return -1;
+	}
+
+	while (off < b->end) {
+		ret = sendfile(fd, b->fd, &off, b->end - off);
+		if (ret <= 0) {
+			pr_perror("Can't copy image from %s", opts.images_file);
+			goto err;
+		}
+	}
+
+	if (lseek(fd, b->pos - b->base, SEEK_SET) < 0) {
+		pr_perror("Can't seek image copy");
+		goto err;
+	}
+
+	close(b->fd);
+	b->fd = fd;
+	b->window = false;
+	b->base = b->end = 0;
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
@@ -1,7 +1,11 @@
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include "cr_options.h"
 #include "img-streamer.h"
@@ -12,7 +16,12 @@
 #include "rst-malloc.h"
 #include "common/scm.h"
 #include "common/lock.h"
+#include "common/list.h"
+#include "page.h"
+#include "page-pipe.h"
 #include "action-scripts.h"
+#include "util.h"
+#include "xmalloc.h"
 
 /*
  * We use different path names for the dump and restore sockets because:
@@ -30,6 +39,12 @@ static mutex_t *img_streamer_fd_lock;
 /* Either O_DUMP or O_RSTR */
 static int img_streamer_mode;
 
+/* The criu that has connected to the streamer, see img_streamer_finish() */
+static pid_t img_streamer_owner;
+
+static int img_streamer_mux_start(int sk);
+static int img_streamer_mux_wait(int ctl);
+
 static const char *socket_name_for_mode(int mode)
 {
 	switch (mode) {
@@ -76,6 +91,16 @@ int img_streamer_init(const char *image_dir, int mode)
 		goto err;
 	}
 
+	if (opts.stream_mux) {
+		int ctl = img_streamer_mux_start(sockfd);
+
+		close(sockfd);
+		if (ctl < 0)
+			return -1;
+		sockfd = ctl;
+	}
+
+	img_streamer_owner = getpid();
 	img_streamer_fd_lock = shmalloc(sizeof(*img_streamer_fd_lock));
 	if (!img_streamer_fd_lock) {
 		pr_err("Failed to allocate memory\n");
@@ -96,13 +121,23 @@ err:
 /*
  * img_streamer_finish() indicates that no more files will be opened.
  * In other words, img_streamer_open() will no longer be called.
+ *
+ * The restored tasks call it too while closing the service fds, but
+ * only the criu that has connected to the streamer may dismiss the
+ * multiplexer, the descriptor is shared with the tasks.
  */
-void img_streamer_finish(void)
+int img_streamer_finish(void)
 {
-	if (get_service_fd(IMG_STREAMER_FD_OFF) >= 0) {
-		pr_info("Dismissing the image streamer\n");
-		close_service_fd(IMG_STREAMER_FD_OFF);
-	}
+	int fd = get_service_fd(IMG_STREAMER_FD_OFF), ret = 0;
+
+	if (fd < 0)
+		return 0;
+
+	pr_info("Dismissing the image streamer\n");
+	if (opts.stream_mux && img_streamer_owner == getpid())
+		ret = img_streamer_mux_wait(fd);
+	close_service_fd(IMG_STREAMER_FD_OFF);
+	return ret;
 }
 
 /*
@@ -126,14 +161,14 @@ static int pb_write_one_fd(int fd, void *obj, int type)
 	return ret;
 }
 
-static int pb_read_one_fd(int fd, void **pobj, int type)
+static int pb_read_one_fd(int fd, void **pobj, int type, bool eof)
 {
 	int ret;
 	struct cr_img img;
 	memset(&img, 0, sizeof(img));
 
 	img._x.fd = fd;
-	ret = pb_read_one(&img, pobj, type);
+	ret = do_pb_read_one(&img, pobj, type, eof);
 	if (ret < 0)
 		pr_perror("Failed to communicate with the image streamer");
 	return ret;
@@ -149,7 +184,7 @@ static int send_file_request(char *filename)
 static int recv_file_reply(bool *exists)
 {
 	ImgStreamerReplyEntry *reply;
-	int ret = pb_read_one_fd(get_service_fd(IMG_STREAMER_FD_OFF), (void **)&reply, PB_IMG_STREAMER_REPLY);
+	int ret = pb_read_one_fd(get_service_fd(IMG_STREAMER_FD_OFF), (void **)&reply, PB_IMG_STREAMER_REPLY, false);
 	if (ret < 0)
 		return ret;
 
@@ -163,10 +198,14 @@ static int recv_file_reply(bool *exists)
  * Using a pipe for image file transfers allows the data to be spliced by the
  * image streamer, greatly improving performance.
  * Transfer rates of up to 15GB/s can be seen with this technique.
+ *
+ * The pipes of the pages images are as big as the page pipes are, so that
+ * the pages from the parasite are moved into them with a single splice()
+ * per page pipe buffer, instead of being pushed through in 64K pieces.
  */
 #define READ_PIPE  0 /* index of the read pipe returned by pipe() */
 #define WRITE_PIPE 1
-static int establish_streamer_file_pipe(void)
+static int establish_streamer_file_pipe(bool pages)
 {
 	/*
 	 * If the other end of the pipe closes, the kernel will want to kill
@@ -183,6 +222,10 @@ static int establish_streamer_file_pipe(void)
 		return -1;
 	}
 
+	/* The default size is still fine, e.g. for a non-root criu */
+	if (pages && fcntl(fds[0], F_SETPIPE_SZ, PIPE_MAX_SIZE * PAGE_SIZE) < 0)
+		pr_debug("Can't grow the pages image pipe: %m\n");
+
 	if (send_fd(get_service_fd(IMG_STREAMER_FD_OFF), NULL, 0, fds[streamer_pipe_direction]) < 0)
 		close(fds[criu_pipe_direction]);
 	else
@@ -216,7 +259,7 @@ static int _img_streamer_open(char *filename)
 	 * via a shell pipe.
 	 */
 
-	return establish_streamer_file_pipe();
+	return establish_streamer_file_pipe(!strncmp(filename, "pages-", 6));
 }
 
 /*
@@ -238,3 +281,578 @@ int img_streamer_open(char *filename, int flags)
 	mutex_unlock(img_streamer_fd_lock);
 	return ret;
 }
+
+/*
+ * The multiplexed protocol (--stream-mux).
+ *
+ * The images go through the streamer connection itself, as the data of
+ * their channels, so several of them, e.g. the pages images written by
+ * the dump workers, are streamed at once. Every image still gets a pipe
+ * from img_streamer_open(), but the other end of it goes to the
+ * multiplexer process instead of the streamer. The multiplexer talks
+ * the per-file protocol above with criu over a socketpair and moves the
+ * data between the pipes and the connection.
+ *
+ * Each frame is a struct streamer_frame followed by len bytes:
+ *
+ *   HELLO   opens the connection, arg is the protocol version, the
+ *           streamer answers with its own HELLO
+ *   OPEN    opens a new channel for the file named by the payload
+ *   REPLY   restore only, the streamer tells in arg whether the file
+ *           of the channel exists
+ *   DATA    the next bytes of the channel's file
+ *   CREDIT  the receiver of the channel's data lets the sender send
+ *           arg more bytes
+ *   CLOSE   the sender has sent all the data of the channel, or the
+ *           receiver doesn't need any more of it
+ *
+ * The frames of a channel come in order and the channel ids are not
+ * reused. The sender may send STREAMER_MUX_WINDOW bytes of a new channel
+ * and then only as much as the receiver credits, so an image nobody
+ * reads at the moment doesn't hold the others back.
+ */
+
+#define STREAMER_MUX_VERSION 1
+#define STREAMER_MUX_WINDOW  (4 << 20)
+#define STREAMER_MUX_CHUNK   (1 << 20)
+
+enum {
+	STREAMER_MUX_HELLO = 1,
+	STREAMER_MUX_OPEN,
+	STREAMER_MUX_REPLY,
+	STREAMER_MUX_DATA,
+	STREAMER_MUX_CREDIT,
+	STREAMER_MUX_CLOSE,
+};
+
+struct streamer_frame {
+	u32 cmd;
+	u32 chan;
+	u32 len;
+	u32 arg;
+};
+
+struct mux_chan {
+	struct list_head l;
+	u32 id;
+	int fd;	    /* the multiplexer's end of the image pipe */
+	u32 credit; /* dump: how much may be sent */
+	char *buf;  /* restore: received, but not yet in the pipe */
+	u32 head, tail;
+	u32 drained; /* restore: put into the pipe, but not yet credited */
+	bool eof;    /* restore: the streamer has sent all the data */
+};
+
+struct mux {
+	int sk, ctl;
+	u32 next_id;
+	struct list_head chans;
+	unsigned int nr_chans;
+	struct mux_chan *pending; /* restore: waits for the REPLY */
+	bool ctl_eof;
+};
+
+static int mux_send(int sk, u32 cmd, u32 chan, u32 len, u32 arg)
+{
+	struct streamer_frame f = {
+		.cmd = cmd,
+		.chan = chan,
+		.len = len,
+		.arg = arg,
+	};
+
+	if (write_all(sk, &f, sizeof(f)) != sizeof(f)) {
+		pr_perror("Can't send frame %u to the image streamer", cmd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mux_recv(int sk, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	ret = read_all(sk, buf, len);
+	if (ret == len)
+		return 0;
+
+	if (ret < 0)
+		pr_perror("Can't receive from the image streamer");
+	else
+		pr_err("The image streamer has closed the connection\n");
+	return -1;
+}
+
+static int mux_skip(int sk, u32 len)
+{
+	char buf[PAGE_SIZE];
+	u32 n;
+
+	while (len) {
+		n = min_t(u32, len, sizeof(buf));
+		if (mux_recv(sk, buf, n))
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int mux_hello(int sk)
+{
+	struct streamer_frame f;
+
+	if (mux_send(sk, STREAMER_MUX_HELLO, 0, 0, STREAMER_MUX_VERSION))
+		return -1;
+
+	if (mux_recv(sk, &f, sizeof(f)))
+		return -1;
+
+	if (f.cmd != STREAMER_MUX_HELLO || f.len) {
+		pr_err("The image streamer doesn't support the multiplexed protocol\n");
+		return -1;
+	}
+
+	if (f.arg != STREAMER_MUX_VERSION) {
+		pr_err("The image streamer has multiplexed protocol version %u, %u is needed\n", f.arg,
+		       STREAMER_MUX_VERSION);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct mux_chan *mux_find(struct mux *m, u32 id)
+{
+	struct mux_chan *c;
+
+	list_for_each_entry(c, &m->chans, l)
+		if (c->id == id)
+			return c;
+
+	return NULL;
+}
+
+static void mux_add(struct mux *m, struct mux_chan *c)
+{
+	list_add_tail(&c->l, &m->chans);
+	m->nr_chans++;
+}
+
+static void mux_put(struct mux *m, struct mux_chan *c)
+{
+	list_del(&c->l);
+	m->nr_chans--;
+	close_safe(&c->fd);
+	xfree(c->buf);
+	xfree(c);
+}
+
+static int mux_request(struct mux *m)
+{
+	ImgStreamerRequestEntry *req;
+	struct mux_chan *c;
+	int ret;
+
+	ret = pb_read_one_fd(m->ctl, (void **)&req, PB_IMG_STREAMER_REQUEST, true);
+	if (ret <= 0) {
+		if (ret == 0)
+			m->ctl_eof = true;
+		return ret;
+	}
+
+	ret = -1;
+	c = xzalloc(sizeof(*c));
+	if (!c)
+		goto out;
+
+	c->id = m->next_id++;
+	c->fd = -1;
+	c->credit = STREAMER_MUX_WINDOW;
+
+	if (mux_send(m->sk, STREAMER_MUX_OPEN, c->id, strlen(req->filename), 0) ||
+	    write_all(m->sk, req->filename, strlen(req->filename)) != strlen(req->filename)) {
+		pr_perror("Can't open channel for %s", req->filename);
+		goto err;
+	}
+
+	pr_debug("Opened channel %u for %s\n", c->id, req->filename);
+
+	/* On restore the pipe comes once the streamer replies */
+	if (img_streamer_mode == O_RSTR) {
+		m->pending = c;
+		ret = 0;
+		goto out;
+	}
+
+	c->fd = recv_fd(m->ctl);
+	if (c->fd < 0) {
+		pr_err("Can't receive the pipe for %s\n", req->filename);
+		goto err;
+	}
+
+	mux_add(m, c);
+	ret = 0;
+	goto out;
+err:
+	xfree(c);
+out:
+	img_streamer_request_entry__free_unpacked(req, NULL);
+	return ret;
+}
+
+static int mux_reply(struct mux *m, struct streamer_frame *f)
+{
+	ImgStreamerReplyEntry reply = IMG_STREAMER_REPLY_ENTRY__INIT;
+	struct mux_chan *c = m->pending;
+
+	if (!c || c->id != f->chan || img_streamer_mode != O_RSTR) {
+		pr_err("Unexpected reply for channel %u from the image streamer\n", f->chan);
+		return -1;
+	}
+
+	m->pending = NULL;
+	reply.exists = f->arg;
+	if (pb_write_one_fd(m->ctl, &reply, PB_IMG_STREAMER_REPLY) < 0)
+		goto err;
+
+	if (!reply.exists) {
+		xfree(c);
+		return 0;
+	}
+
+	c->fd = recv_fd(m->ctl);
+	if (c->fd < 0) {
+		pr_err("Can't receive the pipe for channel %u\n", c->id);
+		goto err;
+	}
+
+	/* A pipe nobody reads at the moment mustn't block the others */
+	if (fcntl(c->fd, F_SETFL, O_NONBLOCK)) {
+		pr_perror("Can't make the pipe of channel %u non-blocking", c->id);
+		goto err;
+	}
+
+	c->buf = xmalloc(STREAMER_MUX_WINDOW);
+	if (!c->buf)
+		goto err;
+
+	mux_add(m, c);
+	return 0;
+
+err:
+	close_safe(&c->fd);
+	xfree(c);
+	return -1;
+}
+
+/* Restore: the streamer sends the data of a channel */
+static int mux_data_in(struct mux *m, struct streamer_frame *f)
+{
+	struct mux_chan *c;
+
+	c = mux_find(m, f->chan);
+	/* The image reader has gone, the streamer will stop soon */
+	if (!c || c->fd < 0)
+		return mux_skip(m->sk, f->len);
+
+	if (c->tail - c->head + f->len > STREAMER_MUX_WINDOW) {
+		pr_err("The image streamer has overrun the window of channel %u\n", c->id);
+		return -1;
+	}
+
+	if (c->tail + f->len > STREAMER_MUX_WINDOW) {
+		memmove(c->buf, c->buf + c->head, c->tail - c->head);
+		c->tail -= c->head;
+		c->head = 0;
+	}
+
+	if (mux_recv(m->sk, c->buf + c->tail, f->len))
+		return -1;
+
+	c->tail += f->len;
+	return 0;
+}
+
+/* Restore: the pipe of a channel has room for the received data */
+static int mux_data_out(struct mux *m, struct mux_chan *c)
+{
+	ssize_t ret;
+
+	ret = write(c->fd, c->buf + c->head, c->tail - c->head);
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		if (errno != EPIPE) {
+			pr_perror("Can't write the data of channel %u", c->id);
+			return -1;
+		}
+
+		/* The image isn't read till the end, e.g. on errors */
+		close_safe(&c->fd);
+		c->head = c->tail = 0;
+		if (c->eof) {
+			mux_put(m, c);
+			return 0;
+		}
+		return mux_send(m->sk, STREAMER_MUX_CLOSE, c->id, 0, 0);
+	}
+
+	c->head += ret;
+	c->drained += ret;
+	if (c->head == c->tail) {
+		c->head = c->tail = 0;
+		if (c->eof) {
+			mux_put(m, c);
+			return 0;
+		}
+	}
+
+	if (c->drained >= STREAMER_MUX_WINDOW / 4) {
+		if (mux_send(m->sk, STREAMER_MUX_CREDIT, c->id, 0, c->drained))
+			return -1;
+		c->drained = 0;
+	}
+
+	return 0;
+}
+
+/* Dump: the pipe of a channel has data, or all its writers are gone */
+static int mux_data_send(struct mux *m, struct mux_chan *c)
+{
+	ssize_t ret;
+	int avail;
+	u32 len;
+
+	if (ioctl(c->fd, FIONREAD, &avail) < 0) {
+		pr_perror("Can't get the data size of channel %u", c->id);
+		return -1;
+	}
+
+	if (!avail) {
+		if (mux_send(m->sk, STREAMER_MUX_CLOSE, c->id, 0, 0))
+			return -1;
+		pr_debug("Closed channel %u\n", c->id);
+		mux_put(m, c);
+		return 0;
+	}
+
+	len = min_t(u32, min_t(u32, avail, c->credit), STREAMER_MUX_CHUNK);
+	if (mux_send(m->sk, STREAMER_MUX_DATA, c->id, len, 0))
+		return -1;
+
+	/* The data is in the pipe already, splice() won't wait for it */
+	while (len) {
+		ret = splice(c->fd, NULL, m->sk, NULL, len, SPLICE_F_MOVE);
+		if (ret <= 0) {
+			pr_perror("Can't send the data of channel %u", c->id);
+			return -1;
+		}
+		len -= ret;
+		c->credit -= ret;
+	}
+
+	return 0;
+}
+
+static int mux_frame(struct mux *m)
+{
+	struct streamer_frame f;
+	struct mux_chan *c;
+
+	if (mux_recv(m->sk, &f, sizeof(f)))
+		return -1;
+
+	switch (f.cmd) {
+	case STREAMER_MUX_REPLY:
+		return mux_reply(m, &f);
+	case STREAMER_MUX_DATA:
+		if (img_streamer_mode != O_RSTR)
+			break;
+		return mux_data_in(m, &f);
+	case STREAMER_MUX_CREDIT:
+		/* Credits may still come for the channels closed by now */
+		c = mux_find(m, f.chan);
+		if (c && img_streamer_mode == O_DUMP)
+			c->credit += f.arg;
+		return mux_skip(m->sk, f.len);
+	case STREAMER_MUX_CLOSE:
+		if (img_streamer_mode != O_RSTR) {
+			pr_err("The image streamer has closed channel %u\n", f.chan);
+			return -1;
+		}
+		c = mux_find(m, f.chan);
+		if (c) {
+			c->eof = true;
+			if (c->fd < 0 || c->head == c->tail)
+				mux_put(m, c);
+		}
+		return 0;
+	}
+
+	pr_err("Unexpected frame %u for channel %u from the image streamer\n", f.cmd, f.chan);
+	return -1;
+}
+
+static int mux_run(struct mux *m)
+{
+	struct mux_chan **chans = NULL, *c;
+	struct pollfd *pfd = NULL;
+	unsigned int nr, size = 0, i;
+	int ret = -1;
+
+	while (!m->ctl_eof || m->pending || !list_empty(&m->chans)) {
+		if (m->nr_chans + 2 > size) {
+			size = (m->nr_chans + 2) * 2;
+			if (xrealloc_safe(&pfd, size * sizeof(*pfd)) || xrealloc_safe(&chans, size * sizeof(*chans)))
+				goto out;
+		}
+
+		pfd[0].fd = m->sk;
+		pfd[0].events = POLLIN;
+		/* The requests are handled one by one */
+		pfd[1].fd = m->ctl_eof || m->pending ? -1 : m->ctl;
+		pfd[1].events = POLLIN;
+
+		nr = 2;
+		list_for_each_entry(c, &m->chans, l) {
+			chans[nr] = c;
+			if (img_streamer_mode == O_DUMP) {
+				pfd[nr].fd = c->credit ? c->fd : -1;
+				pfd[nr].events = POLLIN;
+			} else {
+				pfd[nr].fd = c->head != c->tail ? c->fd : -1;
+				pfd[nr].events = POLLOUT;
+			}
+			nr++;
+		}
+
+		if (poll(pfd, nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("Can't poll the image streamer channels");
+			goto out;
+		}
+
+		for (i = 2; i < nr; i++) {
+			if (!pfd[i].revents)
+				continue;
+			if (img_streamer_mode == O_DUMP)
+				ret = mux_data_send(m, chans[i]);
+			else
+				ret = mux_data_out(m, chans[i]);
+			if (ret)
+				goto out;
+		}
+
+		ret = -1;
+		if (pfd[1].revents && mux_request(m) < 0)
+			goto out;
+		if (pfd[0].revents && mux_frame(m))
+			goto out;
+	}
+
+	ret = 0;
+out:
+	xfree(pfd);
+	xfree(chans);
+	return ret;
+}
+
+static void mux_main(int sk, int ctl)
+{
+	struct mux m = {
+		.sk = sk,
+		.ctl = ctl,
+	};
+	int ret;
+
+	INIT_LIST_HEAD(&m.chans);
+
+	ret = mux_run(&m);
+	close(sk);
+
+	/* criu waits for it in img_streamer_mux_wait() */
+	if (write(ctl, &ret, sizeof(ret)) != sizeof(ret))
+		pr_perror("Can't report the multiplexer status");
+
+	exit(ret ? 1 : 0);
+}
+
+/*
+ * Starts the multiplexer process on the @sk connection and returns the
+ * socket to talk the per-file protocol with it. The multiplexer is
+ * detached from criu, which doesn't expect its own children to exit,
+ * e.g. while restoring the tasks.
+ */
+static int img_streamer_mux_start(int sk)
+{
+	int ctl[2], status;
+	pid_t pid;
+
+	if (mux_hello(sk))
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl)) {
+		pr_perror("Can't create the image streamer multiplexer socket");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork the image streamer multiplexer");
+		goto err;
+	}
+
+	if (pid == 0) {
+		close(ctl[0]);
+
+		pid = fork();
+		if (pid < 0) {
+			pr_perror("Can't fork the image streamer multiplexer");
+			exit(1);
+		}
+		if (pid == 0)
+			mux_main(sk, ctl[1]);
+		exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || status) {
+		pr_err("Can't start the image streamer multiplexer\n");
+		goto err;
+	}
+
+	close(ctl[1]);
+	return ctl[0];
+
+err:
+	close(ctl[0]);
+	close(ctl[1]);
+	return -1;
+}
+
+/*
+ * Tells the multiplexer there will be no more images and waits till it
+ * sends all the data the images have, on dump it's only safe to report
+ * success after that.
+ */
+static int img_streamer_mux_wait(int ctl)
+{
+	int ret;
+
+	if (shutdown(ctl, SHUT_WR)) {
+		pr_perror("Can't dismiss the image streamer multiplexer");
+		return -1;
+	}
+
+	if (img_streamer_mode != O_DUMP)
+		return 0;
+
+	if (read_all(ctl, &ret, sizeof(ret)) != sizeof(ret) || ret) {
+		pr_err("The image streamer multiplexer has failed\n");
+		return -1;
+	}
+
+	return 0;
+}
@@ -1,9 +1,14 @@
 #ifndef __CR_BFD_H__
 #define __CR_BFD_H__
 
+#include <stdbool.h>
+#include <sys/types.h>
+
 #include "common/err.h"
 
 struct bfd_buf;
+struct img_file_idx;
+struct img_file_slot;
 struct xbuf {
 	char *mem;	 /* buffer */
 	char *data;	 /* position we see bytes at */
@@ -14,7 +19,18 @@ struct xbuf {
 struct bfd {
 	int fd;
 	bool writable;
+	bool async; /* buffers are flushed with io_uring at pos */
+	off_t pos;
 	struct xbuf b;
+	/*
+	 * A part of a bigger file from base till end, read at pos with
+	 * pread()-s (an image in the --images-file).
+	 */
+	bool window;
+	off_t base, end;
+	/* The image's entry in the --images-file read or written */
+	struct img_file_idx *idx;
+	struct img_file_slot *slot;
 };
 
 static inline bool bfd_buffered(struct bfd *b)
@@ -30,6 +46,7 @@ static inline void bfd_setraw(struct bfd *b)
 int bfdopenr(struct bfd *f);
 int bfdopenw(struct bfd *f);
 void bclose(struct bfd *f);
+int bfd_flush(struct bfd *f);
 char *breadline(struct bfd *f);
 char *breadchr(struct bfd *f, char c);
 int bwrite(struct bfd *f, const void *buf, int sz);
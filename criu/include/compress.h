@@ -0,0 +1,34 @@
+#ifndef __CR_COMPRESS_H__
+#define __CR_COMPRESS_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Compressed pages are stored in frames of this many pages, each
+ * frame is compressed independently so that restore can decompress
+ * only the pages it needs. Entries are further split into chunks of
+ * COMPRESS_CHUNK_FRAMES frames to limit the buffers size.
+ */
+#define COMPRESS_FRAME_PAGES  16
+#define COMPRESS_CHUNK_FRAMES 16
+#define COMPRESS_CHUNK_PAGES  (COMPRESS_FRAME_PAGES * COMPRESS_CHUNK_FRAMES)
+
+#ifdef CONFIG_HAS_ZSTD
+
+#define compress_supported() (true)
+
+size_t compress_bound(size_t len);
+ssize_t compress_frame(void *dst, size_t dst_len, const void *src, size_t src_len);
+int decompress_frame(void *dst, size_t dst_len, const void *src, size_t src_len);
+
+#else /* CONFIG_HAS_ZSTD */
+
+#define compress_supported()			     (false)
+#define compress_bound(len)			     (len)
+#define compress_frame(dst, dst_len, src, src_len)   (-1)
+#define decompress_frame(dst, dst_len, src, src_len) (-1)
+
+#endif /* CONFIG_HAS_ZSTD */
+
+#endif /* __CR_COMPRESS_H__ */
@@ -49,6 +49,12 @@ struct cg_root_opt {
 #define PRE_DUMP_SPLICE 1 /* Pre-dump using parasite */
 #define PRE_DUMP_READ	2 /* Pre-dump using process_vm_readv syscall */
 
+/*
+ * Memory changes tracking (--track-mem) variants
+ */
+#define TRACK_MEM_SOFT_DIRTY 0 /* Soft-dirty bits, reset via clear_refs */
+#define TRACK_MEM_UFFD_WP    1 /* Userfaultfd asynchronous write-protection */
+
 /*
  * Cgroup management options.
  */
@@ -140,6 +146,9 @@ struct cr_options {
 	int link_remap_ok;
 	int log_file_per_pid;
 	int pre_dump_mode;
+	unsigned int pre_dump_iters;
+	unsigned int downtime;	   /* ms */
+	unsigned int pre_dump_bw; /* MB/s */
 	bool swrk_restore;
 	char *output;
 	char *root;
@@ -155,8 +164,18 @@ struct cr_options {
 	char *addr;
 	int ps_socket;
 	int track_mem;
+	int track_mem_mode;
 	char *img_parent;
 	int auto_dedup;
+	unsigned int dump_workers;
+	unsigned int collect_workers;
+	int compress;
+	int dedup_pages;
+	int skip_zero_pages;
+	int io_uring;
+	int prefetch_pages;
+	unsigned int io_uring_depth;
+	unsigned int ps_streams;
 	unsigned int cpu_cap;
 	int force_irmap;
 	char **exec_cmd;
@@ -184,6 +203,10 @@ struct cr_options {
 	unsigned int empty_ns;
 	int tcp_skip_in_flight;
 	bool lazy_pages;
+	int lazy_xfer;
+	unsigned int lazy_workers;
+	char *images_file;
+	int lazy_push;
 	char *work_dir;
 	int network_lock_method;
 	int skip_file_rwx_check;
@@ -200,6 +223,7 @@ struct cr_options {
 	int status_fd;
 	bool orphan_pts_master;
 	int stream;
+	int stream_mux;
 	pid_t tree_id;
 	int log_level;
 	char *imgs_dir;
@@ -0,0 +1,21 @@
+#ifndef __CR_DIRTY_TRACK_H__
+#define __CR_DIRTY_TRACK_H__
+
+#include <stdbool.h>
+
+/*
+ * Tracking of the memory changes with the userfaultfd asynchronous
+ * write-protection, see --track-mem-mode.
+ */
+
+struct pstree_item;
+struct vm_area_list;
+struct parasite_ctl;
+
+extern bool dirty_track_wp(void);
+extern int dirty_track_prepare(struct pstree_item *item, struct vm_area_list *vmas, struct parasite_ctl *ctl);
+extern int dirty_track_send(int sk);
+extern int dirty_track_recv(int sk);
+extern void dirty_track_fini(void);
+
+#endif /* __CR_DIRTY_TRACK_H__ */
@@ -0,0 +1,15 @@
+#ifndef __CR_DUMP_WORKERS_H__
+#define __CR_DUMP_WORKERS_H__
+
+#include <stdbool.h>
+
+#define DUMP_WORKERS_MAX 64
+
+typedef int (*dump_worker_fn)(void *arg);
+
+extern int dump_workers_nr(void);
+extern bool dump_workers_enabled(void);
+extern int dump_worker_run(dump_worker_fn fn, void *arg);
+extern int dump_workers_wait(void);
+
+#endif /* __CR_DUMP_WORKERS_H__ */
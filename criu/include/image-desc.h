@@ -78,6 +78,7 @@ enum {
 	CR_FD_BINFMT_MISC,
 	CR_FD_BINFMT_MISC_OLD,
 	CR_FD_PAGES,
+	CR_FD_PAGES_STORE,
 
 	CR_FD_SIGACT,
 	CR_FD_VMAS,
@@ -136,12 +136,16 @@ static inline bool lazy_image(struct cr_img *img)
 
 extern int open_image_lazy(struct cr_img *img);
 
+extern int img_file_raw(struct cr_img *img);
+
 static inline int img_raw_fd(struct cr_img *img)
 {
 	if (!img)
 		return -1;
 	if (lazy_image(img) && open_image_lazy(img))
 		return -1;
+	if (img->_x.window && img_file_raw(img))
+		return -1;
 
 	BUG_ON(bfd_buffered(&img->_x));
 	return img->_x.fd;
@@ -149,8 +153,47 @@ static inline int img_raw_fd(struct cr_img *img)
 
 extern off_t img_raw_size(struct cr_img *img);
 
+extern off_t img_file_next(struct cr_img *img, off_t off);
+extern int img_file_reserve(struct cr_img *img, size_t len, off_t *off);
+
+/*
+ * The offset of the image data in the file behind img_raw_fd(), it's
+ * not zero only for the images in the --images-file.
+ */
+static inline off_t img_raw_off(struct cr_img *img)
+{
+	return img->_x.base;
+}
+
+/*
+ * A pages image in the --images-file may consist of several extents,
+ * so the data following the one that ends at @off may be elsewhere.
+ * The pagemap entries never cross the extents, so it's only checked
+ * where an entry starts.
+ */
+static inline off_t img_raw_next(struct cr_img *img, off_t off)
+{
+	if (!img || !img->_x.idx)
+		return off;
+	return img_file_next(img, off);
+}
+
+/*
+ * Makes room for the next @len bytes of a pages image, which are then
+ * written at the file position or at @off. Only the pages written into
+ * the --images-file need it, each pagemap entry gets its room at once.
+ */
+static inline int img_raw_reserve(struct cr_img *img, size_t len, off_t *off)
+{
+	if (!img->_x.slot)
+		return 0;
+	return img_file_reserve(img, len, off);
+}
+
 extern int open_image_dir(char *dir, int mode);
 extern void close_image_dir(void);
+extern int open_image_subdir(char *name);
+extern int relink_image_parent(char *parent);
 /*
  * Return -1 -- parent symlink points to invalid target
  * Return 0 && pfd < 0 -- parent symlink does not exist
@@ -176,5 +219,6 @@ extern int read_img_buf(struct cr_img *, void *ptr, int size);
 extern int read_img_str(struct cr_img *, char **pstr, int size);
 
 extern void close_image(struct cr_img *);
+extern int flush_image(struct cr_img *);
 
 #endif /* __CR_IMAGE_H__ */
@@ -0,0 +1,28 @@
+#ifndef __CR_IMG_FILE_H__
+#define __CR_IMG_FILE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * All the images in a single file, see --images-file.
+ */
+
+struct cr_img;
+struct bfd;
+
+extern bool img_file_enabled(void);
+extern int img_file_create(void);
+extern int img_file_finish(void);
+extern int img_file_open(void);
+extern void img_file_close(void);
+extern bool img_file_takes(int flags);
+extern int img_file_open_image(struct bfd *b, int type, int flags, const char *name);
+extern int img_file_set_window(struct cr_img *img, int type);
+extern int img_file_keep(struct cr_img *img);
+extern void img_file_close_image(struct cr_img *img);
+extern void img_file_drop(struct cr_img *img);
+extern off_t img_file_size(struct cr_img *img);
+extern int img_file_raw(struct cr_img *img);
+
+#endif /* __CR_IMG_FILE_H__ */
@@ -136,14 +136,31 @@ struct uffdio_api {
 	 * UFFD_FEATURE_MISSING_SHMEM works the same as
 	 * UFFD_FEATURE_MISSING_HUGETLBFS, but it applies to shmem
 	 * (i.e. tmpfs and other shmem based APIs).
+	 *
+	 * UFFD_FEATURE_WP_UNPOPULATED makes the none ptes of anonymous
+	 * ranges registered with UFFDIO_REGISTER_MODE_WP write-protected
+	 * as well.
+	 *
+	 * UFFD_FEATURE_WP_ASYNC resolves the write-protect faults in the
+	 * kernel without reporting them, the written pages are then told
+	 * by the PAGE_IS_WRITTEN category of PAGEMAP_SCAN.
 	 */
-#define UFFD_FEATURE_PAGEFAULT_FLAG_WP (1 << 0)
-#define UFFD_FEATURE_EVENT_FORK	       (1 << 1)
-#define UFFD_FEATURE_EVENT_REMAP       (1 << 2)
-#define UFFD_FEATURE_EVENT_REMOVE      (1 << 3)
-#define UFFD_FEATURE_MISSING_HUGETLBFS (1 << 4)
-#define UFFD_FEATURE_MISSING_SHMEM     (1 << 5)
-#define UFFD_FEATURE_EVENT_UNMAP       (1 << 6)
+#define UFFD_FEATURE_PAGEFAULT_FLAG_WP	(1 << 0)
+#define UFFD_FEATURE_EVENT_FORK		(1 << 1)
+#define UFFD_FEATURE_EVENT_REMAP	(1 << 2)
+#define UFFD_FEATURE_EVENT_REMOVE	(1 << 3)
+#define UFFD_FEATURE_MISSING_HUGETLBFS	(1 << 4)
+#define UFFD_FEATURE_MISSING_SHMEM	(1 << 5)
+#define UFFD_FEATURE_EVENT_UNMAP	(1 << 6)
+#define UFFD_FEATURE_SIGBUS		(1 << 7)
+#define UFFD_FEATURE_THREAD_ID		(1 << 8)
+#define UFFD_FEATURE_MINOR_HUGETLBFS	(1 << 9)
+#define UFFD_FEATURE_MINOR_SHMEM	(1 << 10)
+#define UFFD_FEATURE_EXACT_ADDRESS	(1 << 11)
+#define UFFD_FEATURE_WP_HUGETLBFS_SHMEM	(1 << 12)
+#define UFFD_FEATURE_WP_UNPOPULATED	(1 << 13)
+#define UFFD_FEATURE_POISON		(1 << 14)
+#define UFFD_FEATURE_WP_ASYNC		(1 << 15)
 	__u64 features;
 
 	__u64 ioctls;
@@ -199,4 +216,14 @@ struct uffdio_zeropage {
 	__s64 zeropage;
 };
 
+/*
+ * Flags for the userfaultfd(2) system call itself.
+ */
+
+/*
+ * Create a userfaultfd that can only handle user mode faults, it's
+ * allowed without privileges even if vm.unprivileged_userfaultfd is 0.
+ */
+#define UFFD_USER_MODE_ONLY 1
+
 #endif /* _LINUX_USERFAULTFD_H */
@@ -96,6 +96,8 @@ struct page_pipe_buf {
 	unsigned int pages_in;	/* how many pages are there */
 	unsigned int nr_segs;	/* how many iov-s are busy */
 #define PPB_LAZY (1 << 0)
+#define PPB_ANON (1 << 1) /* zero pages needn't be written (--skip-zero-pages) */
+#define PPB_HOT  (1 << 2) /* lazy pages that were recently used */
 	unsigned int flags;
 	struct iovec *iov;  /* vaddr:len map */
 	struct list_head l; /* links into page_pipe->bufs */
@@ -136,7 +138,9 @@ struct page_pipe {
 struct page_pipe *create_page_pipe(unsigned int nr_segs, struct iovec *iovs, unsigned flags);
 extern void destroy_page_pipe(struct page_pipe *p);
 extern int page_pipe_add_page(struct page_pipe *p, unsigned long addr, unsigned int flags);
+extern int page_pipe_add_pages(struct page_pipe *pp, unsigned long addr, unsigned long *nr, unsigned int flags);
 extern int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr, unsigned int flags);
+extern int page_pipe_add_holes(struct page_pipe *pp, unsigned long addr, unsigned long nr, unsigned int flags);
 
 extern void debug_show_page_pipe(struct page_pipe *pp);
 void page_pipe_reinit(struct page_pipe *pp);
@@ -0,0 +1,18 @@
+#ifndef __CR_PAGE_PREFETCH_H__
+#define __CR_PAGE_PREFETCH_H__
+
+#include <stdbool.h>
+
+/*
+ * Reading the pages images of the tasks into the page cache while the
+ * tree is being forked, see --prefetch-pages.
+ */
+
+/* Pages images are read ahead by this much per step */
+#define PREFETCH_CHUNK (4 << 20)
+
+extern bool page_prefetch_enabled(void);
+extern int page_prefetch_step(void);
+extern void page_prefetch_fini(void);
+
+#endif /* __CR_PAGE_PREFETCH_H__ */
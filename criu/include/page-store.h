@@ -0,0 +1,17 @@
+#ifndef __CR_PAGE_STORE_H__
+#define __CR_PAGE_STORE_H__
+
+#include <stdbool.h>
+
+#include "int.h"
+
+/*
+ * Pages store keeps the unique pages of all the pagemaps of a dump,
+ * see --dedup-pages. Entries refer to the pages in it by index.
+ */
+
+extern bool page_store_enabled(void);
+extern int page_store_add(void *pages, unsigned int nr, u32 *idx);
+extern void page_store_close(void);
+
+#endif /* __CR_PAGE_STORE_H__ */
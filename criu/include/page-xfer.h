@@ -9,6 +9,9 @@ struct ps_info {
 
 extern int cr_page_server(bool daemon_mode, bool lazy_dump, int cfd);
 
+/* Maximum number of connections pages are sent to page server over */
+#define PS_STREAMS_MAX 16
+
 /* User buffer for read-mode pre-dump*/
 #define PIPE_MAX_BUFFER_SIZE (PIPE_MAX_SIZE << PAGE_SHIFT)
 
@@ -37,18 +40,28 @@ struct page_xfer {
 		struct /* local */ {
 			struct cr_img *pmi; /* pagemaps */
 			struct cr_img *pi;  /* pages */
+			u32 pages_id;
+			bool uring;	    /* pages are spliced with io_uring */
+			off_t pages_off;    /* at this offset, see --io-uring */
 		};
 
 		struct /* page-server */ {
 			int sk;
 			u64 dst_id;
+			u64 data_off; /* offset in pages image, see --ps-streams */
 		};
 	};
 
 	struct page_read *parent;
+
+	/* set when pages are written in compressed frames (--compress) */
+	struct page_xfer_compress *compress;
+	/* set when pages are put into pages store (--dedup-pages) */
+	struct page_xfer_dedup *dedup;
 };
 
 extern int open_page_xfer(struct page_xfer *xfer, int fd_type, unsigned long id);
+extern int page_xfer_flush(struct page_xfer *xfer);
 struct page_pipe;
 extern int page_xfer_dump_pages(struct page_xfer *, struct page_pipe *);
 extern int page_xfer_predump_pages(int pid, struct page_xfer *, struct page_pipe *);
@@ -66,12 +79,23 @@ extern int check_parent_page_xfer(int fd_type, unsigned long id);
      pid) or PS_IOV_ADD(0, 0, 0) if it failed to locate the required
      pages
  * - dump-side page server sends the raw page data
+ * - several requests may go together as PS_IOV_GETV(nr) followed by
+     nr PS_IOV_GET-s, they are answered one by one
+ * - with --lazy-push lazy-pages sends PS_IOV_PUSH(nr_pages) and the
+     page server sends PS_IOV_PUSH(nr_pages, vaddr, pid) followed by
+     the page data by itself in between the answers, till it sends
+     PS_IOV_PUSH(0, 0, 0)
  */
 
 /* async request/receive of remote pages */
 extern int request_remote_pages(unsigned long img_id, unsigned long addr, int nr_pages);
+extern int flush_remote_pages(void);
 
 typedef int (*ps_async_read_complete)(unsigned long img_id, unsigned long vaddr, int nr_pages, void *);
 extern int page_server_start_read(void *buf, int nr_pages, ps_async_read_complete complete, void *priv, unsigned flags);
 
+/* the pages pushed by the page server with --lazy-push */
+extern int page_server_start_push(ps_async_read_complete complete);
+extern bool page_server_pushing(void);
+
 #endif /* __CR_PAGE_XFER__H__ */
@@ -26,6 +26,9 @@ typedef struct {
 	size_t regs_len;	  /* actual length of regs */
 	size_t regs_max_len;	  /* maximum length of regs */
 	size_t regs_idx;	  /* current index in the regs array */
+
+	bool wp;   /* reset the write-protection of the scanned pages */
+	u64 dirty; /* category of the changed pages, 0 if all are */
 } pmc_t;
 
 #define PMC_INIT \
@@ -38,4 +41,10 @@ extern int pmc_get_map(pmc_t *pmc, const struct vma_area *vma);
 extern void pmc_fini(pmc_t *pmc);
 extern int pmc_fill(pmc_t *pmc, u64 start, u64 end);
 
+/* Whether the pages of the @cat category have changed since the last dump */
+static inline bool pmc_page_dirty(pmc_t *pmc, u64 cat)
+{
+	return !pmc->dirty || (cat & pmc->dirty);
+}
+
 #endif /* __CR_PAGEMAP_H__ */
@@ -78,6 +78,12 @@ struct page_read {
 	int curr_pme;
 
 	struct list_head async;
+
+	/* Data offsets and frames cache for compressed pages images */
+	struct page_read_frames *frames;
+
+	/* Pages store the PE_DEDUP entries refer to */
+	struct cr_img *store;
 };
 
 /* flags for ->read_pages */
@@ -111,6 +117,7 @@ int pagemap_render_iovec(struct list_head *from, struct task_restore_args *ta);
  * maintains its own set of references to those structures.
  */
 extern void dup_page_read(struct page_read *src, struct page_read *dst);
+extern void pagemap_unadvance(struct page_read *pr);
 
 extern int dedup_one_iovec(struct page_read *pr, unsigned long base, unsigned long len);
 
@@ -125,9 +132,13 @@ static inline bool page_read_has_parent(struct page_read *pr)
 }
 
 /* Pagemap flags */
-#define PE_PARENT  (1 << 0) /* pages are in parent snapshot */
-#define PE_LAZY	   (1 << 1) /* pages can be lazily restored */
-#define PE_PRESENT (1 << 2) /* pages are present in pages*img */
+#define PE_PARENT     (1 << 0) /* pages are in parent snapshot */
+#define PE_LAZY	      (1 << 1) /* pages can be lazily restored */
+#define PE_PRESENT    (1 << 2) /* pages are present in pages*img */
+#define PE_COMPRESSED (1 << 3) /* pages are stored in compressed frames */
+#define PE_DEDUP      (1 << 4) /* pages are in pages-store.img */
+#define PE_ZERO	      (1 << 5) /* pages are zero, nothing is stored */
+#define PE_HOT	      (1 << 6) /* lazy pages were recently used, transfer them first */
 
 static inline bool pagemap_in_parent(PagemapEntry *pe)
 {
@@ -144,4 +155,24 @@ static inline bool pagemap_present(PagemapEntry *pe)
 	return !!(pe->flags & PE_PRESENT);
 }
 
+static inline bool pagemap_compressed(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_COMPRESSED);
+}
+
+static inline bool pagemap_dedup(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_DEDUP);
+}
+
+static inline bool pagemap_zero(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_ZERO);
+}
+
+static inline bool pagemap_hot(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_HOT);
+}
+
 #endif /* __CR_PAGE_READ_H__ */
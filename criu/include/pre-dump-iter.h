@@ -0,0 +1,15 @@
+#ifndef __CR_PRE_DUMP_ITER_H__
+#define __CR_PRE_DUMP_ITER_H__
+
+#include <sys/types.h>
+
+/*
+ * Pre-dumps run by criu dump itself before the final dump, see
+ * --pre-dump-iters. Each one goes into its own directory inside the
+ * images one, the final dump refers to the last of them as the parent.
+ */
+#define PRE_DUMP_DIR "pre-dump-%u"
+
+extern int cr_pre_dump_iterate(pid_t pid);
+
+#endif /* __CR_PRE_DUMP_ITER_H__ */
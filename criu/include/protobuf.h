@@ -35,6 +35,11 @@ struct collect_image_info {
 #define COLLECT_SHARED	 0x1 /* use shared memory for obj-s */
 #define COLLECT_NOFREE	 0x2 /* don't free entry after callback */
 #define COLLECT_HAPPENED 0x4 /* image was opened and collected */
+#define COLLECT_IMG_DATA 0x8 /* entries are followed by data read by ->collect */
+#define COLLECT_ARENA	 0x10 /* entries are kept intact, unpack them into an arena */
+
+/* Threads unpacking the entries, see --collect-workers */
+#define COLLECT_WORKERS_MAX 64
 
 extern int collect_image(struct collect_image_info *);
 extern int collect_entry(ProtobufCMessage *base, struct collect_image_info *cinfo);
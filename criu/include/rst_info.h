@@ -15,8 +15,34 @@ struct task_entries {
 	atomic_t cr_err;
 	mutex_t userns_sync_lock;
 	mutex_t last_pid_mutex;
+
+	/* pages read from images by all the tasks, see account_pages_read() */
+	u64 read_bytes;
+	u64 read_start, read_end; /* CLOCK_MONOTONIC, ns */
 };
 
+/*
+ * Pages are read by criu and by the restorer blob of every task at
+ * the same time, so the read bandwidth is the total amount of data
+ * over the time from the first read to the last one.
+ */
+static inline void account_pages_read(struct task_entries *te, u64 bytes, u64 start, u64 end)
+{
+	u64 old;
+
+	__atomic_fetch_add(&te->read_bytes, bytes, __ATOMIC_RELAXED);
+
+	old = __atomic_load_n(&te->read_start, __ATOMIC_RELAXED);
+	while ((!old || start < old) &&
+	       !__atomic_compare_exchange_n(&te->read_start, &old, start, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	old = __atomic_load_n(&te->read_end, __ATOMIC_RELAXED);
+	while (end > old &&
+	       !__atomic_compare_exchange_n(&te->read_end, &old, end, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
 struct fdt {
 	int nr;	   /* How many tasks share this fd table */
 	pid_t pid; /* Who should restore this fd table */
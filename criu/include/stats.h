@@ -33,6 +33,12 @@ enum {
 	CNT_SHPAGES_SKIPPED_PARENT,
 	CNT_SHPAGES_WRITTEN,
 
+	CNT_PAGES_COMPRESSED,
+	CNT_COMPRESSED_BYTES,
+
+	CNT_PAGES_DEDUPED,
+	CNT_PAGES_ZERO,
+
 	DUMP_CNT_NR_STATS,
 };
 
@@ -40,12 +46,17 @@ enum {
 	CNT_PAGES_COMPARED,
 	CNT_PAGES_SKIPPED_COW,
 	CNT_PAGES_RESTORED,
+	CNT_PAGES_READ,
+	CNT_PAGES_READ_TIME,
+	CNT_PAGES_PREFETCHED,
 
 	RESTORE_CNT_NR_STATS,
 };
 
 extern void cnt_add(int c, unsigned long val);
 extern void cnt_sub(int c, unsigned long val);
+extern unsigned long dump_cnt(int c);
+extern void stats_set_dump_worker(int id);
 
 #define DUMP_STATS    1
 #define RESTORE_STATS 2
@@ -0,0 +1,63 @@
+#ifndef __CR_UFFD_XFER_H__
+#define __CR_UFFD_XFER_H__
+
+#include <stdbool.h>
+
+#include "int.h"
+
+/*
+ * Background transfer control of the lazy-pages daemon, see
+ * --lazy-xfer. The controller decides how many bytes each background
+ * request asks for and how many of them may be in flight at once.
+ */
+
+/*
+ * The default xfer length is arbitrary set to 64Kbytes
+ * The limit of 4Mbytes matches the maximal chunk size we can have in
+ * a pipe in the page-server
+ */
+#define DEFAULT_XFER_LEN (64 << 10)
+#define MAX_XFER_LEN	 (4 << 20)
+#define MAX_XFER_DEPTH	 8
+
+enum {
+	XFER_CTL_ADAPTIVE,
+	XFER_CTL_FIXED,
+};
+
+struct xfer_ctl {
+	const struct xfer_ctl_ops *ops;
+
+	unsigned long len;  /* bytes per background request */
+	unsigned int depth; /* background requests in flight */
+
+	/* Estimates, times are in ns */
+	u64 last_fault;
+	u64 fault_gap; /* between page faults */
+	u64 rtt;       /* of a single page request */
+	u64 rtt_min;
+	u64 bw;	       /* background transfer bandwidth, bytes/s */
+
+	/* Metrics for the summary */
+	unsigned long nr_faults;
+	unsigned long nr_fault_lat; /* faults with the pages arrived */
+	unsigned long nr_batches;
+	unsigned long batch_bytes;
+	u64 fault_lat_sum;
+	u64 fault_lat_max;
+};
+
+struct xfer_ctl_ops {
+	const char *name;
+	void (*fault)(struct xfer_ctl *c, u64 now);
+	void (*issue)(struct xfer_ctl *c);
+	void (*done)(struct xfer_ctl *c, u64 now);
+};
+
+extern int xfer_ctl_parse(const char *name);
+extern void xfer_ctl_init(struct xfer_ctl *c);
+extern void xfer_ctl_fault(struct xfer_ctl *c, u64 now);
+extern void xfer_ctl_issue(struct xfer_ctl *c);
+extern void xfer_ctl_done(struct xfer_ctl *c, bool pf, unsigned long bytes, u64 issued, u64 now);
+
+#endif /* __CR_UFFD_XFER_H__ */
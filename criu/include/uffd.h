@@ -3,8 +3,11 @@
 
 struct task_restore_args;
 
+#define LAZY_WORKERS_MAX 64
+
 extern int uffd_open(int flags, unsigned long *features, int *err);
 extern bool uffd_noncooperative(void);
+extern bool uffd_wp_async(void);
 extern int setup_uffd(int pid, struct task_restore_args *task_args);
 extern int lazy_pages_setup_zombie(int pid);
 extern int prepare_lazy_pages_socket(void);
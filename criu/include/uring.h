@@ -0,0 +1,29 @@
+#ifndef __CR_URING_H__
+#define __CR_URING_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Asynchronous image I/O via io_uring (--io-uring). Requests are
+ * submitted in batches and at most --io-uring-depth of them are in
+ * flight, a request that doesn't fit waits for some to complete.
+ */
+#define URING_DEPTH	64
+#define URING_DEPTH_MAX 4096
+
+/* Big reads are split to keep the queue deep on contiguous pages */
+#define URING_READ_CHUNK (512 << 10)
+
+typedef void (*uring_done_fn)(void *arg, int err);
+
+extern bool uring_enabled(void);
+extern bool uring_probe(void);
+extern int uring_splice(int pipe, int fd, off_t off, unsigned long len);
+extern int uring_write(int fd, void *buf, unsigned long len, off_t off, uring_done_fn done, void *arg);
+extern int uring_read(int fd, void *buf, unsigned long len, off_t off);
+extern int uring_wait_fd(int fd);
+extern void *uring_fixed_bufs(unsigned long size, unsigned int *nr);
+extern void uring_close(void);
+
+#endif /* __CR_URING_H__ */
@@ -48,6 +48,18 @@ struct vma_area {
 			bool file_borrowed;
 			struct stat *vmst;
 			int mnt_id;
+
+			/*
+			 * The uffd_wp is set for VMAs with the "uw" flag, i.e.
+			 * registered for userfaultfd write-protection. With
+			 * --track-mem-mode uffd-wp the wp_track is set when
+			 * criu tracks the writes to the VMA, and wp_written
+			 * when the written pages since the last iteration are
+			 * known, see dirty-track.c
+			 */
+			bool uffd_wp;
+			bool wp_track;
+			bool wp_written;
 		};
 
 		struct /* for restore */ {
@@ -127,4 +139,10 @@ static inline bool vma_entry_can_be_lazy(VmaEntry *e)
 		!(vma_entry_is(e, VMA_AREA_VSYSCALL)) && !(e->flags & MAP_HUGETLB));
 }
 
+/* The VMA had the transparent huge pages enabled with madvise() */
+static inline bool vma_entry_has_thp(VmaEntry *e)
+{
+	return e->has_madv && (e->madv & (1ul << MADV_HUGEPAGE));
+}
+
 #endif /* __CR_VMA_H__ */
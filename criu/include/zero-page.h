@@ -0,0 +1,9 @@
+#ifndef __CR_ZERO_PAGE_H__
+#define __CR_ZERO_PAGE_H__
+
+#include <stdbool.h>
+
+/* Checks whether the page at @page contains only zeroes */
+extern bool is_zero_page(const void *page);
+
+#endif /* __CR_ZERO_PAGE_H__ */
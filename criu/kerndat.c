@@ -55,6 +55,7 @@
 #include "mount-v2.h"
 #include "util-caps.h"
 #include "pagemap_scan.h"
+#include "uring.h"
 
 struct kerndat_s kdat = {};
 volatile int dummy_var;
@@ -1697,6 +1698,12 @@ static int kerndat_has_membarrier_get_registrations(void)
 	return 0;
 }
 
+static int kerndat_has_io_uring(void)
+{
+	kdat.has_io_uring = uring_probe();
+	return 0;
+}
+
 /*
  * Some features depend on resource that can be dynamically changed
  * at the OS runtime. There are cases that we cannot determine the
@@ -1954,6 +1961,10 @@ int kerndat_init(void)
 		pr_err("kerndat_has_shstk failed when initializing kerndat.\n");
 		ret = -1;
 	}
+	if (!ret && kerndat_has_io_uring()) {
+		pr_err("kerndat_has_io_uring failed when initializing kerndat.\n");
+		ret = -1;
+	}
 
 	kerndat_lsm();
 	kerndat_mmap_min_addr();
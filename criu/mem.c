@@ -31,6 +31,8 @@
 #include "prctl.h"
 #include "compel/infect-util.h"
 #include "pidfd-store.h"
+#include "dump-workers.h"
+#include "dirty-track.h"
 
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
@@ -39,7 +41,8 @@ static int task_reset_dirty_track(int pid)
 {
 	int ret;
 
-	if (!opts.track_mem)
+	/* The write-protection is reset by the pagemap scan itself */
+	if (!opts.track_mem || dirty_track_wp())
 		return 0;
 
 	BUG_ON(!kdat.has_dirty_track);
@@ -113,6 +116,33 @@ static bool should_dump_entire_vma(VmaEntry *vmae)
 	return false;
 }
 
+/*
+ * Zero pages of private anonymous memory needn't be written, as such
+ * memory is zero-filled anyway when it's mapped anew on restore.
+ */
+static unsigned int vma_ppb_flags(struct vma_area *vma)
+{
+	if (!opts.skip_zero_pages || !vma_area_is(vma, VMA_ANON_PRIVATE))
+		return 0;
+	if (should_dump_entire_vma(vma->e) || vma_area_is(vma, VMA_AREA_SHSTK) || (vma->e->flags & MAP_HUGETLB))
+		return 0;
+
+	return PPB_ANON;
+}
+
+/*
+ * The lazy pages are transferred in the background hot ones first, see
+ * PE_HOT. The pages that the kernel has swapped out are cold, and with
+ * --track-mem so are the ones not written since the last pre-dump.
+ */
+static unsigned int lazy_ppb_flags(bool softdirty, bool swapped)
+{
+	if (swapped || (opts.track_mem && !softdirty))
+		return PPB_LAZY;
+
+	return PPB_LAZY | PPB_HOT;
+}
+
 /*
  * should_dump_page returns vaddr if an addressed page has to be dumped.
  * Otherwise, it returns an address that has to be inspected next.
@@ -133,7 +163,7 @@ u64 should_dump_page(pmc_t *pmc, VmaEntry *vmae, u64 vaddr, bool *softdirty)
 		if (vaddr < pmc->regs[pmc->regs_idx].start)
 			return pmc->regs[pmc->regs_idx].start;
 		if (softdirty)
-			*softdirty = pmc->regs[pmc->regs_idx].categories & PAGE_IS_SOFT_DIRTY;
+			*softdirty = pmc_page_dirty(pmc, pmc->regs[pmc->regs_idx].categories);
 		return vaddr;
 	} else {
 		u64 pme = pmc->map[PAGE_PFN(vaddr - pmc->start)];
@@ -171,13 +201,135 @@ static bool is_stack(struct pstree_item *item, unsigned long vaddr)
 	for (i = 0; i < item->nr_threads; i++) {
 		uint64_t sp = dmpi(item)->thread_sp[i];
 
-		if (!((sp ^ vaddr) & ~PAGE_MASK))
+		if (!((sp ^ vaddr) & PAGE_MASK))
 			return true;
 	}
 
 	return false;
 }
 
+/*
+ * With PAGEMAP_SCAN the pages to dump come in regions, so they are
+ * taken as a whole. Finds the range of pages to dump starting from
+ * *@start or after it and puts it into [*@start, *@end), the region
+ * categories go into *@cat. Returns 1 when there are no more pages to
+ * dump in the VMA.
+ */
+static int next_dump_range(pmc_t *pmc, VmaEntry *vmae, u64 *start, u64 *end, u64 *cat)
+{
+	u64 vaddr = *start;
+
+	while (vaddr < vmae->end) {
+		struct page_region *r;
+
+		if (vaddr >= pmc->end && pmc_fill(pmc, vaddr, vmae->end))
+			return -1;
+
+		while (pmc->regs_idx < pmc->regs_len && vaddr >= pmc->regs[pmc->regs_idx].end)
+			pmc->regs_idx++;
+
+		if (pmc->regs_idx == pmc->regs_len) {
+			vaddr = pmc->end;
+			continue;
+		}
+
+		r = &pmc->regs[pmc->regs_idx];
+		if (r->start >= vmae->end)
+			break;
+
+		*start = max(vaddr, r->start);
+		*end = min(r->end, vmae->end);
+		*cat = r->categories;
+		return 0;
+	}
+
+	*start = vmae->end;
+	return 1;
+}
+
+/* The lowest stack page in [@start, @end) or @end */
+static unsigned long next_stack_page(struct pstree_item *item, unsigned long start, unsigned long end)
+{
+	int i;
+
+	for (i = 0; i < item->nr_threads; i++) {
+		unsigned long sp = dmpi(item)->thread_sp[i] & PAGE_MASK;
+
+		if (sp >= start && sp < end)
+			end = sp;
+	}
+
+	return end;
+}
+
+static int generate_iovs_regs(struct pstree_item *item, struct vma_area *vma, struct page_pipe *pp, pmc_t *pmc,
+			      u64 *pvaddr, bool has_parent)
+{
+	unsigned long pages[3] = {};
+	u64 vaddr = *pvaddr, start, end;
+	unsigned int vma_flags = vma_ppb_flags(vma);
+	bool lazy = vma_entry_can_be_lazy(vma->e);
+	bool softdirty;
+	int ret = 0;
+	u64 cat;
+
+	start = vaddr;
+	while ((ret = next_dump_range(pmc, vma->e, &start, &end, &cat)) == 0) {
+		softdirty = pmc_page_dirty(pmc, cat);
+
+		/* See generate_iovs() for the rules */
+		if (has_parent && page_in_parent(softdirty)) {
+			ret = page_pipe_add_holes(pp, start, (end - start) / PAGE_SIZE, PP_HOLE_PARENT);
+			if (ret)
+				break;
+			pages[0] += (end - start) / PAGE_SIZE;
+			start = end;
+			continue;
+		}
+
+		while (start < end) {
+			unsigned long stack = lazy ? next_stack_page(item, start, end) : end;
+			unsigned int ppb_flags = vma_flags;
+			unsigned long nr;
+			int st;
+
+			if (stack == start) {
+				/* The stack page itself is never lazy */
+				pr_debug("Stack page %" PRIx64 " isn't lazy\n", start);
+				nr = 1;
+			} else {
+				nr = (stack - start) / PAGE_SIZE;
+				if (lazy)
+					ppb_flags |= lazy_ppb_flags(softdirty, cat & PAGE_IS_SWAPPED);
+			}
+
+			st = (ppb_flags & PPB_LAZY && opts.lazy_pages) ? 1 : 2;
+			ret = page_pipe_add_pages(pp, start, &nr, ppb_flags);
+			pages[st] += nr;
+			start += nr * PAGE_SIZE;
+			if (ret) {
+				pr_debug("Pagemap full\n");
+				break;
+			}
+		}
+
+		if (ret)
+			break;
+	}
+
+	if (ret > 0)
+		ret = 0;
+
+	*pvaddr = start;
+	cnt_add(CNT_PAGES_SCANNED, (start - vaddr) / PAGE_SIZE);
+	cnt_add(CNT_PAGES_SKIPPED_PARENT, pages[0]);
+	cnt_add(CNT_PAGES_LAZY, pages[1]);
+	cnt_add(CNT_PAGES_WRITTEN, pages[2]);
+
+	pr_info("Pagemap generated: %lu pages (%lu lazy) %lu holes\n", pages[2] + pages[1], pages[1], pages[0]);
+	return ret;
+}
+
 /*
  * This routine finds out what memory regions to grab from the
  * dumpee. The iovs generated are then fed into vmsplice to
@@ -193,14 +345,18 @@ static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct
 	unsigned long nr_scanned;
 	unsigned long pages[3] = {};
 	unsigned long vaddr;
+	unsigned int vma_flags;
 	bool dump_all_pages;
 	int ret = 0;
 
 	dump_all_pages = should_dump_entire_vma(vma->e);
+	if (pmc->regs && !dump_all_pages)
+		return generate_iovs_regs(item, vma, pp, pmc, pvaddr, has_parent);
 
+	vma_flags = vma_ppb_flags(vma);
 	nr_scanned = 0;
 	for (vaddr = *pvaddr; vaddr < vma->e->end; vaddr += PAGE_SIZE, nr_scanned++) {
-		unsigned int ppb_flags = 0;
+		unsigned int ppb_flags = vma_flags;
 		bool softdirty = false;
 		u64 next;
 		int st;
@@ -212,8 +368,14 @@ static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct
 			continue;
 		}
 
-		if (vma_entry_can_be_lazy(vma->e) && !is_stack(item, vaddr))
-			ppb_flags |= PPB_LAZY;
+		if (vma_entry_can_be_lazy(vma->e)) {
+			u64 pme = pmc->regs ? 0 : pmc->map[PAGE_PFN(vaddr - pmc->start)];
+
+			if (is_stack(item, vaddr))
+				pr_debug("Stack page %lx isn't lazy\n", vaddr);
+			else
+				ppb_flags |= lazy_ppb_flags(softdirty, pme & PME_SWAP);
+		}
 
 		/*
 		 * If we're doing incremental dump (parent images
@@ -339,6 +501,66 @@ static int xfer_pages(struct page_pipe *pp, struct page_xfer *xfer)
 	return ret;
 }
 
+struct xfer_pages_job {
+	pid_t pid;
+	struct page_pipe *pp;
+	struct page_xfer *xfer;
+	bool predump_read;
+};
+
+static int xfer_pages_job(void *arg)
+{
+	struct xfer_pages_job *job = arg;
+	int ret;
+
+	if (job->predump_read)
+		ret = page_xfer_predump_pages(job->pid, job->xfer, job->pp);
+	else
+		ret = xfer_pages(job->pp, job->xfer);
+
+	/*
+	 * The worker writes the pagemap entries into its own copy
+	 * of the image buffer, so it must be flushed here.
+	 */
+	if (dump_workers_enabled())
+		job->xfer->close(job->xfer);
+
+	return ret;
+}
+
+/*
+ * Write the pages drained into @pp into the @item's images. With
+ * dump workers enabled this is done in a forked worker and we return
+ * as soon as it is started, so the caller can go on with the next
+ * task. The caller still owns the @pp and should destroy it.
+ */
+int xfer_task_pages(struct pstree_item *item, struct page_pipe *pp, bool predump_read)
+{
+	struct page_xfer xfer;
+	struct xfer_pages_job job = {
+		.pid = item->pid->real,
+		.pp = pp,
+		.xfer = &xfer,
+		.predump_read = predump_read,
+	};
+	int ret;
+
+	ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, vpid(item));
+	if (ret < 0)
+		return -1;
+
+	if (dump_workers_enabled() && page_xfer_flush(&xfer)) {
+		xfer.close(&xfer);
+		return -1;
+	}
+
+	ret = dump_worker_run(xfer_pages_job, &job);
+	if (ret == 1 || !dump_workers_enabled())
+		xfer.close(&xfer);
+
+	return ret < 0 ? -1 : 0;
+}
+
 static int detect_pid_reuse(struct pstree_item *item, struct proc_pid_stat *pps, InventoryEntry *parent_ie)
 {
 	unsigned long long dump_ticks;
@@ -493,6 +715,11 @@ static int __parasite_dump_pages_seized(struct pstree_item *item, struct parasit
 	int possible_pid_reuse = 0;
 	bool has_parent;
 	int parent_predump_mode = -1;
+	/*
+	 * With dump workers the pages are written after the task is
+	 * done with, so the pp is not chunked and xfer is opened later.
+	 */
+	bool deferred = !(mdc->pre_dump || mdc->lazy) && dump_workers_enabled();
 
 	pr_info("\n");
 	pr_info("Dumping pages (type: %d pid: %d)\n", CR_FD_PAGES, item->pid->real);
@@ -510,18 +737,23 @@ static int __parasite_dump_pages_seized(struct pstree_item *item, struct parasit
 	if (pmc_init(&pmc, item->pid->real, &vma_area_list->h, pmc_size * PAGE_SIZE))
 		return -1;
 
-	if (!(mdc->pre_dump || mdc->lazy))
+	if (!(mdc->pre_dump || mdc->lazy || deferred))
 		/*
 		 * Chunk mode pushes pages portion by portion. This mode
 		 * only works when we don't need to keep pp for later
 		 * use, i.e. on non-lazy non-predump.
 		 */
 		cpp_flags |= PP_CHUNK_MODE;
-	pp = create_page_pipe(vma_area_list->nr_priv_pages, mdc->lazy ? NULL : pargs_iovs(args), cpp_flags);
+	/*
+	 * The args area is reused for other parasite commands, so
+	 * the pp that outlives this call keeps its own iovs.
+	 */
+	pp = create_page_pipe(vma_area_list->nr_priv_pages, (mdc->lazy || deferred) ? NULL : pargs_iovs(args),
+			      cpp_flags);
 	if (!pp)
 		goto out;
 
-	if (!mdc->pre_dump) {
+	if (!(mdc->pre_dump || deferred)) {
 		/*
 		 * Regular dump -- create xfer object and send pages to it
 		 * right here. For pre-dumps the pp will be taken by the
@@ -562,7 +794,7 @@ static int __parasite_dump_pages_seized(struct pstree_item *item, struct parasit
 			goto out_xfer;
 	}
 
-	if (mdc->lazy)
+	if (mdc->lazy || deferred)
 		memcpy(pargs_iovs(args), pp->iovs, sizeof(struct iovec) * pp->nr_iovs);
 
 	/*
@@ -576,7 +808,9 @@ static int __parasite_dump_pages_seized(struct pstree_item *item, struct parasit
 	else
 		ret = drain_pages(pp, ctl, args);
 
-	if (!ret && !mdc->pre_dump)
+	if (!ret && deferred)
+		ret = xfer_task_pages(item, pp, false);
+	else if (!ret && !mdc->pre_dump)
 		ret = xfer_pages(pp, &xfer);
 	if (ret)
 		goto out_xfer;
@@ -592,7 +826,7 @@ static int __parasite_dump_pages_seized(struct pstree_item *item, struct parasit
 		goto out_xfer;
 	exit_code = 0;
 out_xfer:
-	if (!mdc->pre_dump)
+	if (!(mdc->pre_dump || deferred))
 		xfer.close(&xfer);
 out_pp:
 	if (ret || !(mdc->pre_dump || mdc->lazy))
@@ -611,6 +845,10 @@ int parasite_dump_pages_seized(struct pstree_item *item, struct vm_area_list *vm
 	int ret;
 	struct parasite_dump_pages_args *pargs;
 
+	/* It calls the parasite too, so goes before the args are filled */
+	if (dirty_track_wp() && dirty_track_prepare(item, vma_area_list, ctl))
+		return -1;
+
 	pargs = prep_dump_pages_args(ctl, vma_area_list, mdc->pre_dump);
 
 	/*
@@ -1022,6 +1260,12 @@ static int premap_priv_vmas(struct pstree_item *t, struct vm_area_list *vmas, vo
 	unsigned long pstart = 0;
 	int ret = 0;
 	LIST_HEAD(empty);
+	/*
+	 * With --io-uring all the pages are read here, by a helper that
+	 * takes the io_uring workers away with it (see process_async_reads),
+	 * rather than in the restorer.
+	 */
+	bool pieok = pr->pieok && !(opts.io_uring && kdat.has_io_uring && !opts.auto_dedup);
 
 	filemap_ctx_init(true);
 
@@ -1047,7 +1291,7 @@ static int premap_priv_vmas(struct pstree_item *t, struct vm_area_list *vmas, vo
 		if (vma->e->status & VMA_EXT_PLUGIN)
 			continue;
 
-		if (vma->pvma == NULL && pr->pieok && !vma_force_premap(vma, &vmas->h)) {
+		if (vma->pvma == NULL && pieok && !vma_force_premap(vma, &vmas->h)) {
 			/*
 			 * VMA in question is not shared with anyone. We'll
 			 * restore it with its contents in restorer.
@@ -1089,6 +1333,7 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 	unsigned int nr_compared = 0;
 	unsigned int nr_enqueued = 0;
 	unsigned int nr_lazy = 0;
+	unsigned int nr_zero = 0;
 	unsigned long va;
 
 	vma = list_first_entry(vmas, struct vma_area, list);
@@ -1145,6 +1390,27 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 				goto err_addr;
 			}
 
+			if (pagemap_zero(pr->pe)) {
+				unsigned long len = min_t(unsigned long, (nr_pages - i) * PAGE_SIZE, vma->e->end - va);
+
+				/*
+				 * Anonymous memory is either mapped anew or the
+				 * pages inherited and not restored are dropped
+				 * below, so there's nothing to do.
+				 */
+				if (!vma_area_is(vma, VMA_ANON_PRIVATE)) {
+					pr_err("Zero pages for non-anonymous VMA\n");
+					goto err_addr;
+				}
+
+				pr->skip_pages(pr, len);
+				va += len;
+				len >>= PAGE_SHIFT;
+				nr_zero += len;
+				i += len - 1;
+				continue;
+			}
+
 			if (!vma_area_is(vma, VMA_PREMMAPED)) {
 				unsigned long len = min_t(unsigned long, (nr_pages - i) * PAGE_SIZE, vma->e->end - va);
 
@@ -1263,6 +1529,7 @@ err_read:
 	pr_info("nr_dropped_pages:  %d\n", nr_dropped);
 	pr_info("nr_enqueued:       %d\n", nr_enqueued);
 	pr_info("nr_lazy:           %d\n", nr_lazy);
+	pr_info("nr_zero:           %d\n", nr_zero);
 
 	return 0;
 
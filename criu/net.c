@@ -28,6 +28,7 @@
 #include "../soccr/soccr.h"
 
 #include "imgset.h"
+#include "img-file.h"
 #include "namespaces.h"
 #include "net.h"
 #include "libnetlink.h"
@@ -2026,7 +2027,10 @@ static inline int dump_rule(struct cr_imgset *fds)
 
 	if (run_ip_tool("rule", "save", NULL, NULL, -1, img_raw_fd(img), CRS_CAN_FAIL)) {
 		pr_warn("Check if \"ip rule save\" is supported!\n");
-		unlinkat(get_service_fd(IMG_FD_OFF), path, 0);
+		if (img_file_enabled())
+			img_file_drop(img);
+		else
+			unlinkat(get_service_fd(IMG_FD_OFF), path, 0);
 	}
 
 	free(path);
@@ -296,6 +296,67 @@ int page_pipe_add_page(struct page_pipe *pp, unsigned long addr, unsigned int fl
 	return ret;
 }
 
+static inline int try_add_pages_to(struct page_pipe *pp, struct page_pipe_buf *ppb, unsigned long addr,
+				   unsigned long nr, unsigned int flags, unsigned long *added)
+{
+	struct iovec *iov;
+	unsigned long len;
+
+	if (ppb->flags != flags)
+		return 1;
+
+	if (ppb_resize_pipe(ppb) == 1)
+		return 1;
+
+	nr = min_t(unsigned long, nr, ppb->pipe_size - ppb->pipe_off - ppb->pages_in);
+	len = nr * PAGE_SIZE;
+
+	iov = ppb->nr_segs ? &ppb->iov[ppb->nr_segs - 1] : NULL;
+	if (iov && (unsigned long)iov->iov_base + iov->iov_len == addr) {
+		iov->iov_len += len;
+	} else {
+		pr_debug("Add iov to page pipe (%u iovs, %u/%u total)\n", ppb->nr_segs, pp->free_iov, pp->nr_iovs);
+		iov = &ppb->iov[ppb->nr_segs++];
+		iov->iov_base = (void *)addr;
+		iov->iov_len = len;
+		pp->free_iov++;
+		BUG_ON(pp->free_iov > pp->nr_iovs);
+	}
+
+	ppb->pages_in += nr;
+	*added = nr;
+	return 0;
+}
+
+/*
+ * Adds @nr pages starting from @addr at once. On error the number of
+ * pages that have been added is put into @nr, so that the caller can
+ * go on from there after the pipe is drained (-EAGAIN in chunk mode).
+ */
+int page_pipe_add_pages(struct page_pipe *pp, unsigned long addr, unsigned long *nr, unsigned int flags)
+{
+	unsigned long todo = *nr, added;
+	int ret = 0;
+
+	while (todo) {
+		BUG_ON(list_empty(&pp->bufs));
+		ret = try_add_pages_to(pp, list_entry(pp->bufs.prev, struct page_pipe_buf, l), addr, todo, flags,
+				       &added);
+		if (ret > 0) {
+			ret = page_pipe_grow(pp, flags);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		addr += added * PAGE_SIZE;
+		todo -= added;
+	}
+
+	*nr -= todo;
+	return ret;
+}
+
 #define PP_HOLES_BATCH 32
 
 int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr, unsigned int flags)
@@ -324,6 +385,22 @@ out:
 	return 0;
 }
 
+int page_pipe_add_holes(struct page_pipe *pp, unsigned long addr, unsigned long nr, unsigned int flags)
+{
+	struct iovec *hole;
+
+	if (!nr)
+		return 0;
+
+	if (page_pipe_add_hole(pp, addr, flags))
+		return -1;
+
+	/* The hole with the first page is the last one */
+	hole = &pp->holes[pp->free_hole - 1];
+	hole->iov_len += (nr - 1) * PAGE_SIZE;
+	return 0;
+}
+
 /*
  * Get ppb and iov that contain addr and count amount of data between
  * beginning of the pipe belonging to the ppb and addr
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "cr_options.h"
+#include "image.h"
+#include "page.h"
+#include "pagemap.h"
+#include "page-prefetch.h"
+#include "pstree.h"
+#include "stats.h"
+#include "util.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "prefetch: "
+
+/*
+ * The tasks read their premapped memory before forking the kids, and
+ * the rest of it is read by the restorers only after the whole tree
+ * has forked. So while the tree is being forked the disk is mostly
+ * idle, and then all the tasks read their pages at once.
+ *
+ * To get the disk busy earlier criu, that otherwise just waits for the
+ * tasks, walks the pagemaps in the order the tasks are forked and
+ * reads their pages images ahead into the page cache, one chunk per
+ * step. Then both the premapped memory and the restorers' reads come
+ * from the page cache.
+ *
+ * Only half of the available memory is filled this way, not to evict
+ * the pages that are read ahead before they are used.
+ */
+
+static struct page_prefetch {
+	struct pstree_item *item; /* task, whose pages are read ahead */
+	struct page_read pr;
+	bool opened;
+	bool started;
+	bool done;
+	off_t off;		/* offset of the current pagemap entry */
+	off_t start, end;	/* range to be read ahead next */
+	unsigned long budget;
+	unsigned long bytes;
+} pf;
+
+bool page_prefetch_enabled(void)
+{
+	/* Images from the streamer can only be read once */
+	return opts.prefetch_pages && !opts.stream;
+}
+
+static unsigned long prefetch_budget(void)
+{
+	unsigned long avail = 0;
+	char buf[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f) {
+		pr_perror("Can't open meminfo");
+		return 0;
+	}
+
+	while (fgets(buf, sizeof(buf), f))
+		if (sscanf(buf, "MemAvailable: %lu kB", &avail) == 1)
+			break;
+
+	fclose(f);
+	return (avail << 10) / 2;
+}
+
+static void prefetch_close(void)
+{
+	if (!pf.opened)
+		return;
+
+	pf.pr.close(&pf.pr);
+	pf.opened = false;
+}
+
+/* Opens the pagemap of the next alive task in the forking order */
+static int prefetch_next_task(void)
+{
+	int ret;
+
+	while (1) {
+		pf.item = pf.item ? pstree_item_next(pf.item) : root_item;
+		if (!pf.item)
+			return 0;
+		if (!task_alive(pf.item))
+			continue;
+
+		ret = open_page_read(vpid(pf.item), &pf.pr, PR_TASK);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			continue;
+
+		/* The offsets of such data can't be told from the pagemap */
+		if (pf.pr.frames || pf.pr.store) {
+			pf.pr.close(&pf.pr);
+			continue;
+		}
+
+		pr_debug("Reading ahead pages of %d\n", vpid(pf.item));
+		pf.opened = true;
+		pf.off = img_raw_off(pf.pr.pi);
+		return 1;
+	}
+}
+
+/*
+ * Collects the next range of the pages image to be read, the adjacent
+ * entries are merged. Entries in parent images and lazy pages are not
+ * read ahead.
+ */
+static int prefetch_next_range(void)
+{
+	PagemapEntry *pe;
+	int ret;
+
+	pf.start = pf.end = 0;
+	while (1) {
+		if (!pf.opened || !pf.pr.advance(&pf.pr)) {
+			if (pf.end)
+				return 1;
+
+			/* All the pages of the task are read ahead */
+			prefetch_close();
+			ret = prefetch_next_task();
+			if (ret <= 0)
+				return ret;
+			continue;
+		}
+
+		pe = pf.pr.pe;
+		if (!pagemap_present(pe))
+			continue;
+
+		pf.off = img_raw_next(pf.pr.pi, pf.off);
+		if (!(opts.lazy_pages && pagemap_lazy(pe))) {
+			if (pf.end && pf.end != pf.off) {
+				/* Get back to this entry next time */
+				pagemap_unadvance(&pf.pr);
+				return 1;
+			}
+
+			if (!pf.end)
+				pf.start = pf.off;
+			pf.end = pf.off + pagemap_len(pe);
+		}
+
+		pf.off += pagemap_len(pe);
+	}
+}
+
+/*
+ * Reads ahead the next chunk of pages. Returns 1 if there's more to
+ * read, 0 if all the pages are read ahead or the budget is exhausted.
+ */
+int page_prefetch_step(void)
+{
+	unsigned long len;
+	int ret;
+
+	if (pf.done || !page_prefetch_enabled())
+		return 0;
+
+	if (!pf.started) {
+		pf.started = true;
+		pf.budget = prefetch_budget();
+		pr_info("Reading ahead up to %lu bytes of pages\n", pf.budget);
+	}
+
+	if (pf.start == pf.end) {
+		ret = prefetch_next_range();
+		if (ret <= 0)
+			goto done;
+	}
+
+	len = min_t(unsigned long, pf.end - pf.start, PREFETCH_CHUNK);
+	len = min(len, pf.budget - pf.bytes);
+	if (!len)
+		goto done;
+
+	/*
+	 * WILLNEED only starts the reads, but blocks when the disk queue
+	 * is full, so the chunks are small not to delay the stages.
+	 */
+	ret = posix_fadvise(img_raw_fd(pf.pr.pi), pf.start, len, POSIX_FADV_WILLNEED);
+	if (ret) {
+		errno = ret;
+		pr_perror("Can't read ahead pages of %d", vpid(pf.item));
+		goto done;
+	}
+
+	pf.start += len;
+	pf.bytes += len;
+	return 1;
+
+done:
+	pf.done = true;
+	prefetch_close();
+	return 0;
+}
+
+void page_prefetch_fini(void)
+{
+	if (!pf.started)
+		return;
+
+	pr_info("Read ahead %lu bytes of pages\n", pf.bytes);
+	cnt_add(CNT_PAGES_PREFETCHED, pf.bytes >> PAGE_SHIFT);
+
+	pf.started = false;
+	pf.done = true;
+	prefetch_close();
+}
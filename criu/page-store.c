@@ -0,0 +1,267 @@
+#include <unistd.h>
+#include <string.h>
+
+#include "cr_options.h"
+#include "image.h"
+#include "page.h"
+#include "page-store.h"
+#include "util.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "page-store: "
+
+/*
+ * The unique pages are appended to the pages-store.img, and are found
+ * by the XXH64 hash of their contents in an open-addressing table. The
+ * hash is only a hint -- a page is considered a duplicate only after
+ * its contents is compared with the stored one.
+ *
+ * The index lives in the criu memory, so it can only be used by the
+ * process that has created it (the dump workers are off with the store).
+ */
+
+#define PAGE_STORE_MIN_SLOTS 1024
+
+struct page_store_slot {
+	u64 hash;
+	u32 idx;
+	u32 busy;
+};
+
+static struct page_store {
+	struct cr_img *img;
+	pid_t owner;
+	u32 nr_pages;	  /* pages in the store */
+	unsigned long nr_slots;
+	struct page_store_slot *slots;
+	void *page;	  /* buffer to compare the stored pages */
+} store;
+
+bool page_store_enabled(void)
+{
+	return opts.dedup_pages;
+}
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+
+static inline u64 rotl64(u64 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 xxh64_round(u64 acc, u64 input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline u64 xxh64_merge(u64 acc, u64 val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* XXH64 with zero seed, the page size is a multiple of the 32-byte stripe */
+static u64 page_hash(const void *page)
+{
+	const u64 *p = page, *end = page + PAGE_SIZE;
+	u64 v1 = PRIME64_1 + PRIME64_2, v2 = PRIME64_2, v3 = 0, v4 = -PRIME64_1;
+	u64 h;
+
+	for (; p < end; p += 4) {
+		v1 = xxh64_round(v1, p[0]);
+		v2 = xxh64_round(v2, p[1]);
+		v3 = xxh64_round(v3, p[2]);
+		v4 = xxh64_round(v4, p[3]);
+	}
+
+	h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+	h = xxh64_merge(h, v1);
+	h = xxh64_merge(h, v2);
+	h = xxh64_merge(h, v3);
+	h = xxh64_merge(h, v4);
+	h += PAGE_SIZE;
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static struct page_store_slot *find_slot(struct page_store_slot *slots, unsigned long nr_slots, u64 hash,
+					 unsigned long *pos)
+{
+	unsigned long i = *pos;
+
+	if (i == ~0UL)
+		i = hash & (nr_slots - 1);
+	else
+		i = (i + 1) & (nr_slots - 1);
+
+	for (; slots[i].busy; i = (i + 1) & (nr_slots - 1)) {
+		if (slots[i].hash == hash) {
+			*pos = i;
+			return &slots[i];
+		}
+	}
+
+	*pos = i;
+	return NULL;
+}
+
+static int grow_slots(void)
+{
+	unsigned long nr_slots = store.nr_slots ? store.nr_slots * 2 : PAGE_STORE_MIN_SLOTS;
+	struct page_store_slot *slots;
+	unsigned long i;
+
+	slots = xzalloc(nr_slots * sizeof(*slots));
+	if (!slots)
+		return -1;
+
+	for (i = 0; i < store.nr_slots; i++) {
+		unsigned long pos = ~0UL;
+
+		if (!store.slots[i].busy)
+			continue;
+
+		while (find_slot(slots, nr_slots, store.slots[i].hash, &pos))
+			;
+		slots[pos] = store.slots[i];
+	}
+
+	xfree(store.slots);
+	store.slots = slots;
+	store.nr_slots = nr_slots;
+	return 0;
+}
+
+static int page_store_open(void)
+{
+	if (store.img) {
+		if (store.owner != getpid()) {
+			pr_err("Pages store is used by %d, not by %d\n", store.owner, getpid());
+			return -1;
+		}
+		return 0;
+	}
+
+	store.img = open_image(CR_FD_PAGES_STORE, O_DUMP);
+	if (!store.img)
+		return -1;
+
+	store.page = xmalloc(PAGE_SIZE);
+	if (!store.page || grow_slots())
+		return -1;
+
+	store.owner = getpid();
+	pr_info("Opened pages store\n");
+	return 0;
+}
+
+/*
+ * The stored page @idx is either in the @pending pages starting at
+ * @base index, that are not yet written, or is read from the image.
+ */
+static int same_page(const void *page, u32 idx, void *pending, u32 base)
+{
+	const void *stored;
+
+	if (idx >= base) {
+		stored = pending + (unsigned long)(idx - base) * PAGE_SIZE;
+	} else {
+		if (pread(img_raw_fd(store.img), store.page, PAGE_SIZE, (off_t)idx * PAGE_SIZE) != PAGE_SIZE) {
+			pr_perror("Can't read stored page %u", idx);
+			return -1;
+		}
+		stored = store.page;
+	}
+
+	return memcmp(page, stored, PAGE_SIZE) == 0;
+}
+
+/*
+ * Puts @nr @pages into the store and fills their indices in @idx.
+ * The unique pages are moved to the beginning of @pages and are
+ * written with one call. Returns the number of deduplicated pages.
+ */
+int page_store_add(void *pages, unsigned int nr, u32 *idx)
+{
+	unsigned int i, nr_unique = 0;
+	u32 base;
+
+	if (page_store_open())
+		return -1;
+
+	base = store.nr_pages;
+	for (i = 0; i < nr; i++) {
+		void *page = pages + (unsigned long)i * PAGE_SIZE;
+		unsigned long pos = ~0UL;
+		struct page_store_slot *s;
+		u64 hash;
+		int ret;
+
+		hash = page_hash(page);
+		while ((s = find_slot(store.slots, store.nr_slots, hash, &pos)) != NULL) {
+			ret = same_page(page, s->idx, pages, base);
+			if (ret < 0)
+				return -1;
+			if (ret)
+				break;
+		}
+
+		if (s) {
+			idx[i] = s->idx;
+			continue;
+		}
+
+		if (store.nr_pages == UINT32_MAX) {
+			pr_err("Too many pages in the store\n");
+			return -1;
+		}
+
+		if (nr_unique != i)
+			memcpy(pages + (unsigned long)nr_unique * PAGE_SIZE, page, PAGE_SIZE);
+		nr_unique++;
+
+		idx[i] = store.nr_pages++;
+		store.slots[pos].hash = hash;
+		store.slots[pos].idx = idx[i];
+		store.slots[pos].busy = 1;
+
+		if (2 * (unsigned long)store.nr_pages >= store.nr_slots && grow_slots())
+			return -1;
+	}
+
+	if (nr_unique) {
+		size_t len = (size_t)nr_unique * PAGE_SIZE;
+
+		if (write_all(img_raw_fd(store.img), pages, len) != len) {
+			pr_perror("Can't write %u pages into store", nr_unique);
+			return -1;
+		}
+	}
+
+	return nr - nr_unique;
+}
+
+void page_store_close(void)
+{
+	if (!store.img)
+		return;
+
+	pr_info("Pages store has %u unique pages\n", store.nr_pages);
+
+	close_image(store.img);
+	xfree(store.slots);
+	xfree(store.page);
+	memset(&store, 0, sizeof(store));
+}
@@ -8,6 +8,10 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/random.h>
 
 #undef LOG_PREFIX
 #define LOG_PREFIX "page-xfer: "
@@ -27,9 +31,18 @@
 #include "rst_info.h"
 #include "stats.h"
 #include "tls.h"
+#include "compress.h"
+#include "page-store.h"
+#include "zero-page.h"
+#include "uring.h"
+#include "common/lock.h"
 
 static int page_server_sk = -1;
 
+/* Connections the pages are sent over with --ps-streams */
+static int ps_data_sk[PS_STREAMS_MAX];
+static int nr_ps_data_sk;
+
 struct page_server_iov {
 	u32 cmd;
 	u32 nr_pages;
@@ -37,19 +50,38 @@ struct page_server_iov {
 	u64 dst_id;
 };
 
+/*
+ * With --ps-streams the main connection only carries the commands, and
+ * the pages of the PS_IOV_ADD_S entries go over the data streams with
+ * this header. The header has the offset in the pages image the pages
+ * go to, so the page server writes them in any order they come in.
+ */
+struct page_server_data {
+	u32 cmd;
+	u32 len;
+	u64 off;
+	u64 dst_id;
+};
+
 static void psi2iovec(struct page_server_iov *ps, struct iovec *iov)
 {
 	iov->iov_base = decode_pointer(ps->vaddr);
 	iov->iov_len = ps->nr_pages * PAGE_SIZE;
 }
 
-#define PS_IOV_ADD    1
-#define PS_IOV_HOLE   2
-#define PS_IOV_OPEN   3
-#define PS_IOV_OPEN2  4
-#define PS_IOV_PARENT 5
-#define PS_IOV_ADD_F  6
-#define PS_IOV_GET    7
+#define PS_IOV_ADD     1
+#define PS_IOV_HOLE    2
+#define PS_IOV_OPEN    3
+#define PS_IOV_OPEN2   4
+#define PS_IOV_PARENT  5
+#define PS_IOV_ADD_F   6
+#define PS_IOV_GET     7
+#define PS_IOV_STREAMS 8
+#define PS_IOV_STREAM  9
+#define PS_IOV_ADD_S   10
+#define PS_IOV_DATA    11
+#define PS_IOV_PUSH    12
+#define PS_IOV_GETV    13
 
 #define PS_IOV_CLOSE	   0x1023
 #define PS_IOV_FORCE_CLOSE 0x1024
@@ -158,6 +190,307 @@ static inline int send_psi(int sk, struct page_server_iov *pi)
 	return send_psi_flags(sk, pi, 0);
 }
 
+static int send_all(int sk, const void *buf, size_t len)
+{
+	while (len > 0) {
+		int ret;
+
+		ret = __send(sk, buf, len, 0);
+		if (ret <= 0) {
+			pr_perror("Can't send %zu bytes to socket", len);
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int recv_all(int sk, void *buf, size_t len)
+{
+	while (len > 0) {
+		int ret;
+
+		ret = __recv(sk, buf, len, MSG_WAITALL);
+		if (ret <= 0) {
+			pr_perror("Can't receive %zu bytes from socket", len);
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Compressing xfer. The pages of a present pagemap entry are collected
+ * from the pipe into chunks of COMPRESS_CHUNK_PAGES, every chunk is
+ * compressed frame by frame and is written with its own pagemap entry,
+ * that carries the frames sizes, by the backend's ->write_frames.
+ */
+typedef int (*write_frames_fn)(struct page_xfer *xfer, struct iovec *iov, u32 flags, u32 *frames,
+			       unsigned int nr_frames, void *data, size_t len);
+
+struct page_xfer_compress {
+	struct iovec iov;     /* entry being written */
+	u32 flags;
+	unsigned long done;   /* bytes of the entry already written */
+	unsigned long filled; /* bytes collected in the raw buffer */
+	void *raw;
+	void *data;
+	u32 frames[COMPRESS_CHUNK_FRAMES];
+	write_frames_fn write_frames;
+};
+
+static int page_xfer_compress_init(struct page_xfer *xfer, write_frames_fn write_frames)
+{
+	struct page_xfer_compress *c;
+
+	xfer->compress = NULL;
+	if (!opts.compress)
+		return 0;
+
+	c = xzalloc(sizeof(*c));
+	if (!c)
+		return -1;
+
+	c->raw = xmalloc(COMPRESS_CHUNK_PAGES * PAGE_SIZE);
+	c->data = xmalloc(COMPRESS_CHUNK_PAGES * PAGE_SIZE);
+	c->write_frames = write_frames;
+	xfer->compress = c;
+
+	return c->raw && c->data ? 0 : -1;
+}
+
+static void page_xfer_compress_fini(struct page_xfer *xfer)
+{
+	struct page_xfer_compress *c = xfer->compress;
+
+	if (!c)
+		return;
+
+	if (c->iov.iov_len)
+		pr_warn("Pages of %p/%zu were not written\n", c->iov.iov_base, c->iov.iov_len);
+
+	xfree(c->raw);
+	xfree(c->data);
+	xfree(c);
+	xfer->compress = NULL;
+}
+
+static int compress_pagemap(struct page_xfer *xfer, struct iovec *iov, u32 flags)
+{
+	struct page_xfer_compress *c = xfer->compress;
+
+	if (c->iov.iov_len) {
+		pr_err("Pages of %p/%zu were not written\n", c->iov.iov_base, c->iov.iov_len);
+		return -1;
+	}
+
+	c->iov = *iov;
+	c->flags = flags | PE_COMPRESSED;
+	c->done = 0;
+
+	return 0;
+}
+
+static int compress_chunk(struct page_xfer *xfer)
+{
+	struct page_xfer_compress *c = xfer->compress;
+	unsigned long off = 0;
+	unsigned int nr = 0;
+	struct iovec iov;
+	size_t len = 0;
+
+	while (off < c->filled) {
+		size_t raw_len = min_t(unsigned long, c->filled - off, COMPRESS_FRAME_PAGES * PAGE_SIZE);
+		ssize_t ret;
+
+		ret = compress_frame(c->data + len, raw_len, c->raw + off, raw_len);
+		if (ret < 0)
+			return -1;
+		/* Incompressible frames are stored as is */
+		if (ret == raw_len)
+			memcpy(c->data + len, c->raw + off, raw_len);
+
+		c->frames[nr++] = ret;
+		len += ret;
+		off += raw_len;
+	}
+
+	iov.iov_base = c->iov.iov_base + c->done;
+	iov.iov_len = c->filled;
+	pr_debug("\tc %p [%u] -> %zu bytes\n", iov.iov_base, (unsigned int)(iov.iov_len / PAGE_SIZE), len);
+
+	if (c->write_frames(xfer, &iov, c->flags, c->frames, nr, c->data, len))
+		return -1;
+
+	cnt_add(CNT_PAGES_COMPRESSED, c->filled / PAGE_SIZE);
+	cnt_add(CNT_COMPRESSED_BYTES, len);
+
+	c->done += c->filled;
+	c->filled = 0;
+	if (c->done == c->iov.iov_len)
+		c->iov.iov_len = 0;
+
+	return 0;
+}
+
+static int compress_pages(struct page_xfer *xfer, int p, unsigned long len)
+{
+	struct page_xfer_compress *c = xfer->compress;
+
+	if (c->done + c->filled + len > c->iov.iov_len) {
+		pr_err("Unexpected %lu bytes of pages for %p/%zu\n", len, c->iov.iov_base, c->iov.iov_len);
+		return -1;
+	}
+
+	while (len > 0) {
+		unsigned long n = min(len, COMPRESS_CHUNK_PAGES * PAGE_SIZE - c->filled);
+
+		if (read_all(p, c->raw + c->filled, n) != n) {
+			pr_perror("Can't read pages from pipe");
+			return -1;
+		}
+
+		c->filled += n;
+		len -= n;
+
+		if (c->filled == COMPRESS_CHUNK_PAGES * PAGE_SIZE || c->done + c->filled == c->iov.iov_len)
+			if (compress_chunk(xfer))
+				return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Deduplicating xfer. The pages of a present entry are put into the
+ * pages store chunk by chunk and the entry is written once all of them
+ * got their indices in the store.
+ */
+#define DEDUP_CHUNK_PAGES 64
+
+struct page_xfer_dedup {
+	struct iovec iov; /* entry being written */
+	u32 flags;
+	unsigned long done; /* bytes of the entry already stored */
+	u32 *idx;
+	unsigned long nr_idx;
+	void *buf;
+};
+
+static int write_pagemap_entry(struct page_xfer *xfer, struct iovec *iov, PagemapEntry *pe);
+
+static int page_xfer_dedup_init(struct page_xfer *xfer)
+{
+	struct page_xfer_dedup *d;
+
+	xfer->dedup = NULL;
+	if (!page_store_enabled())
+		return 0;
+
+	d = xzalloc(sizeof(*d));
+	if (!d)
+		return -1;
+
+	d->buf = xmalloc(DEDUP_CHUNK_PAGES * PAGE_SIZE);
+	xfer->dedup = d;
+
+	return d->buf ? 0 : -1;
+}
+
+static void page_xfer_dedup_fini(struct page_xfer *xfer)
+{
+	struct page_xfer_dedup *d = xfer->dedup;
+
+	if (!d)
+		return;
+
+	if (d->iov.iov_len)
+		pr_warn("Pages of %p/%zu were not stored\n", d->iov.iov_base, d->iov.iov_len);
+
+	xfree(d->idx);
+	xfree(d->buf);
+	xfree(d);
+	xfer->dedup = NULL;
+}
+
+static int dedup_pagemap(struct page_xfer *xfer, struct iovec *iov, u32 flags)
+{
+	struct page_xfer_dedup *d = xfer->dedup;
+	unsigned long nr_pages = iov->iov_len / PAGE_SIZE;
+
+	if (d->iov.iov_len) {
+		pr_err("Pages of %p/%zu were not stored\n", d->iov.iov_base, d->iov.iov_len);
+		return -1;
+	}
+
+	if (nr_pages > d->nr_idx) {
+		u32 *idx;
+
+		idx = xrealloc(d->idx, nr_pages * sizeof(*idx));
+		if (!idx)
+			return -1;
+		d->idx = idx;
+		d->nr_idx = nr_pages;
+	}
+
+	d->iov = *iov;
+	d->flags = flags | PE_DEDUP;
+	d->done = 0;
+
+	return 0;
+}
+
+static int dedup_pages(struct page_xfer *xfer, int p, unsigned long len)
+{
+	struct page_xfer_dedup *d = xfer->dedup;
+
+	if (d->done + len > d->iov.iov_len) {
+		pr_err("Unexpected %lu bytes of pages for %p/%zu\n", len, d->iov.iov_base, d->iov.iov_len);
+		return -1;
+	}
+
+	while (len > 0) {
+		unsigned long n = min(len, DEDUP_CHUNK_PAGES * PAGE_SIZE);
+		int ret;
+
+		if (read_all(p, d->buf, n) != n) {
+			pr_perror("Can't read pages from pipe");
+			return -1;
+		}
+
+		ret = page_store_add(d->buf, n / PAGE_SIZE, d->idx + d->done / PAGE_SIZE);
+		if (ret < 0)
+			return -1;
+		cnt_add(CNT_PAGES_DEDUPED, ret);
+
+		d->done += n;
+		len -= n;
+	}
+
+	if (d->done == d->iov.iov_len) {
+		PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+		struct iovec iov = d->iov;
+
+		pe.vaddr = encode_pointer(iov.iov_base);
+		pe.nr_pages = iov.iov_len / PAGE_SIZE;
+		pe.has_flags = true;
+		pe.flags = d->flags;
+		pe.n_store = pe.nr_pages;
+		pe.store = d->idx;
+
+		d->iov.iov_len = 0;
+		if (write_pagemap_entry(xfer, &iov, &pe))
+			return -1;
+	}
+
+	return 0;
+}
+
 static void tcp_cork(int sk, bool on)
 {
 	int val = on ? 1 : 0;
@@ -173,7 +506,7 @@ static void tcp_nodelay(int sk, bool on)
 }
 
 /* page-server xfer */
-static int write_pages_to_server(struct page_xfer *xfer, int p, unsigned long len)
+static int send_pages(int sk, int p, unsigned long len)
 {
 	ssize_t ret, left = len;
 
@@ -186,7 +519,7 @@ static int write_pages_to_server(struct page_xfer *xfer, int p, unsigned long le
 		pr_debug("Splicing %lu bytes / %lu pages into socket\n", len, len / PAGE_SIZE);
 
 		while (left > 0) {
-			ret = splice(p, NULL, xfer->sk, NULL, left, SPLICE_F_MOVE);
+			ret = splice(p, NULL, sk, NULL, left, SPLICE_F_MOVE);
 			if (ret < 0) {
 				pr_perror("Can't write pages to socket");
 				return -1;
@@ -200,20 +533,124 @@ static int write_pages_to_server(struct page_xfer *xfer, int p, unsigned long le
 	return 0;
 }
 
+/*
+ * The data streams are picked by the amount of data not yet sent
+ * out of them, so that all the streams stay busy.
+ */
+static int ps_data_stream(void)
+{
+	int i, best = 0, min_queued = INT_MAX;
+
+	for (i = 0; i < nr_ps_data_sk; i++) {
+		int queued;
+
+		if (ioctl(ps_data_sk[i], SIOCOUTQ, &queued)) {
+			pr_perror("Can't get the send queue size");
+			return ps_data_sk[0];
+		}
+
+		if (queued < min_queued) {
+			min_queued = queued;
+			best = i;
+		}
+	}
+
+	return ps_data_sk[best];
+}
+
+static int send_stream_pages(struct page_xfer *xfer, int p, void *buf, unsigned long len)
+{
+	struct page_server_data pd = {
+		.cmd = PS_IOV_DATA,
+		.len = len,
+		.off = xfer->data_off,
+		.dst_id = xfer->dst_id,
+	};
+	int sk, ret;
+
+	BUG_ON(len > UINT_MAX);
+
+	sk = ps_data_stream();
+	pr_debug("Sending %lu bytes at %" PRIx64 " into stream %d\n", len, pd.off, sk);
+
+	if (send_all(sk, &pd, sizeof(pd)))
+		return -1;
+
+	if (buf)
+		ret = send_all(sk, buf, len);
+	else
+		ret = send_pages(sk, p, len);
+	if (ret)
+		return -1;
+
+	xfer->data_off += len;
+	return 0;
+}
+
+static int write_pages_to_server(struct page_xfer *xfer, int p, unsigned long len)
+{
+	if (xfer->compress)
+		return compress_pages(xfer, p, len);
+
+	if (nr_ps_data_sk)
+		return send_stream_pages(xfer, p, NULL, len);
+
+	return send_pages(xfer->sk, p, len);
+}
+
+static inline u32 ps_add_cmd(u32 flags)
+{
+	if (nr_ps_data_sk && (flags & PE_PRESENT))
+		return encode_ps_cmd(PS_IOV_ADD_S, flags);
+
+	return encode_ps_cmd(PS_IOV_ADD_F, flags);
+}
+
 static int write_pagemap_to_server(struct page_xfer *xfer, struct iovec *iov, u32 flags)
 {
 	struct page_server_iov pi = {
-		.cmd = encode_ps_cmd(PS_IOV_ADD_F, flags),
+		.cmd = ps_add_cmd(flags),
 		.nr_pages = iov->iov_len / PAGE_SIZE,
 		.vaddr = encode_pointer(iov->iov_base),
 		.dst_id = xfer->dst_id,
 	};
 
+	if (xfer->compress && (flags & PE_PRESENT))
+		return compress_pagemap(xfer, iov, flags);
+
 	return send_psi(xfer->sk, &pi);
 }
 
+/*
+ * Compressed entry goes as PS_IOV_ADD_F with PE_COMPRESSED flag,
+ * followed by the frames sizes and the frames themselves, or as
+ * PS_IOV_ADD_S with the frames themselves sent via a data stream.
+ */
+static int write_frames_to_server(struct page_xfer *xfer, struct iovec *iov, u32 flags, u32 *frames,
+				  unsigned int nr_frames, void *data, size_t len)
+{
+	struct page_server_iov pi = {
+		.cmd = ps_add_cmd(flags),
+		.nr_pages = iov->iov_len / PAGE_SIZE,
+		.vaddr = encode_pointer(iov->iov_base),
+		.dst_id = xfer->dst_id,
+	};
+
+	if (send_psi(xfer->sk, &pi))
+		return -1;
+
+	if (send_all(xfer->sk, frames, nr_frames * sizeof(*frames)))
+		return -1;
+
+	if (nr_ps_data_sk)
+		return send_stream_pages(xfer, -1, data, len);
+
+	return send_all(xfer->sk, data, len);
+}
+
 static void close_server_xfer(struct page_xfer *xfer)
 {
+	page_xfer_compress_fini(xfer);
 	xfer->sk = -1;
 }
 
@@ -229,7 +666,9 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, unsigned l
 	xfer->write_pages = write_pages_to_server;
 	xfer->close = close_server_xfer;
 	xfer->dst_id = encode_pm(fd_type, img_id);
+	xfer->data_off = 0;
 	xfer->parent = NULL;
+	xfer->dedup = NULL;
 
 	pi.dst_id = xfer->dst_id;
 	if (send_psi(xfer->sk, &pi)) {
@@ -248,7 +687,7 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, unsigned l
 	if (has_parent)
 		xfer->parent = (void *)1; /* This is required for generate_iovs() */
 
-	return 0;
+	return page_xfer_compress_init(xfer, write_frames_to_server);
 }
 
 /* local xfer */
@@ -257,8 +696,23 @@ static int write_pages_loc(struct page_xfer *xfer, int p, unsigned long len)
 	ssize_t ret;
 	ssize_t curr = 0;
 
+	if (xfer->compress)
+		return compress_pages(xfer, p, len);
+	if (xfer->dedup)
+		return dedup_pages(xfer, p, len);
+
+	if (xfer->uring && uring_enabled()) {
+		if (uring_splice(p, img_raw_fd(xfer->pi), xfer->pages_off, len))
+			return -1;
+		xfer->pages_off += len;
+		return 0;
+	}
+
 	while (1) {
-		ret = splice(p, NULL, img_raw_fd(xfer->pi), NULL, len - curr, SPLICE_F_MOVE);
+		if (xfer->uring)
+			ret = splice(p, NULL, img_raw_fd(xfer->pi), &xfer->pages_off, len - curr, SPLICE_F_MOVE);
+		else
+			ret = splice(p, NULL, img_raw_fd(xfer->pi), NULL, len - curr, SPLICE_F_MOVE);
 		if (ret == -1) {
 			pr_perror("Unable to spice data");
 			return -1;
@@ -317,25 +771,19 @@ static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 	}
 }
 
-static int write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flags)
+static int write_pagemap_entry(struct page_xfer *xfer, struct iovec *iov, PagemapEntry *pe)
 {
 	int ret;
-	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
-
-	pe.vaddr = encode_pointer(iov->iov_base);
-	pe.nr_pages = iov->iov_len / PAGE_SIZE;
-	pe.has_flags = true;
-	pe.flags = flags;
 
-	if (flags & PE_PRESENT) {
+	if (pe->flags & (PE_PRESENT | PE_ZERO)) {
 		if (opts.auto_dedup && xfer->parent != NULL) {
-			ret = dedup_one_iovec(xfer->parent, pe.vaddr, pagemap_len(&pe));
+			ret = dedup_one_iovec(xfer->parent, pe->vaddr, pagemap_len(pe));
 			if (ret == -1) {
 				pr_perror("Auto-deduplication failed");
 				return ret;
 			}
 		}
-	} else if (flags & PE_PARENT) {
+	} else if (pe->flags & PE_PARENT) {
 		if (xfer->parent != NULL) {
 			ret = check_pagehole_in_parent(xfer->parent, iov);
 			if (ret) {
@@ -345,49 +793,116 @@ static int write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flag
 		}
 	}
 
-	if (pb_write_one(xfer->pmi, &pe, PB_PAGEMAP) < 0)
+	if (pb_write_one(xfer->pmi, pe, PB_PAGEMAP) < 0)
 		return -1;
 
 	return 0;
 }
 
-static void close_page_xfer(struct page_xfer *xfer)
+static int __write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flags, u32 *frames,
+			       unsigned int nr_frames)
 {
-	if (xfer->parent != NULL) {
-		xfer->parent->close(xfer->parent);
-		xfree(xfer->parent);
-		xfer->parent = NULL;
-	}
-	close_image(xfer->pi);
-	close_image(xfer->pmi);
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+
+	pe.vaddr = encode_pointer(iov->iov_base);
+	pe.nr_pages = iov->iov_len / PAGE_SIZE;
+	pe.has_flags = true;
+	pe.flags = flags;
+	pe.n_frames = nr_frames;
+	pe.frames = frames;
+
+	return write_pagemap_entry(xfer, iov, &pe);
 }
 
-static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, unsigned long img_id)
+static int write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flags)
 {
-	u32 pages_id;
+	if (xfer->compress && (flags & PE_PRESENT))
+		return compress_pagemap(xfer, iov, flags);
+	if (xfer->dedup && (flags & PE_PRESENT))
+		return dedup_pagemap(xfer, iov, flags);
 
-	xfer->pmi = open_image(fd_type, O_DUMP, img_id);
-	if (!xfer->pmi)
+	/* The pages of the entry are written next to each other */
+	if ((flags & PE_PRESENT) && img_raw_reserve(xfer->pi, iov->iov_len, &xfer->pages_off))
 		return -1;
 
-	xfer->pi = open_pages_image(O_DUMP, xfer->pmi, &pages_id);
-	if (!xfer->pi)
-		goto err_pmi;
+	return __write_pagemap_loc(xfer, iov, flags, NULL, 0);
+}
 
-	/*
-	 * Open page-read for parent images (if it exists). It will
-	 * be used for two things:
-	 * 1) when writing a page, those from parent will be dedup-ed
-	 * 2) when writing a hole, the respective place would be checked
-	 *    to exist in parent (either pagemap or hole)
-	 */
-	xfer->parent = NULL;
-	if (fd_type == CR_FD_PAGEMAP || fd_type == CR_FD_SHMEM_PAGEMAP) {
-		int ret;
-		int pfd;
-		int pr_flags = (fd_type == CR_FD_PAGEMAP) ? PR_TASK : PR_SHMEM;
+static int write_frames_loc(struct page_xfer *xfer, struct iovec *iov, u32 flags, u32 *frames, unsigned int nr_frames,
+			    void *data, size_t len)
+{
+	if (xfer->dedup) {
+		pr_err("Compressed pages can't be put into pages store\n");
+		return -1;
+	}
 
-		/* Image streaming lacks support for incremental images */
+	if (img_raw_reserve(xfer->pi, len, &xfer->pages_off))
+		return -1;
+
+	if (write_all(img_raw_fd(xfer->pi), data, len) != len) {
+		pr_perror("Unable to write compressed pages");
+		return -1;
+	}
+
+	return __write_pagemap_loc(xfer, iov, flags, frames, nr_frames);
+}
+
+/*
+ * Waits for the pages spliced with io_uring, after that the pipes
+ * they were taken from can be reused or closed.
+ */
+static int page_xfer_wait(struct page_xfer *xfer)
+{
+	if (xfer->write_pages != write_pages_loc || !xfer->uring)
+		return 0;
+
+	if (uring_wait_fd(img_raw_fd(xfer->pi))) {
+		pr_err("Unable to write pages\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void close_page_xfer(struct page_xfer *xfer)
+{
+	page_xfer_wait(xfer);
+	page_xfer_compress_fini(xfer);
+	page_xfer_dedup_fini(xfer);
+
+	if (xfer->parent != NULL) {
+		xfer->parent->close(xfer->parent);
+		xfree(xfer->parent);
+		xfer->parent = NULL;
+	}
+	close_image(xfer->pi);
+	close_image(xfer->pmi);
+}
+
+static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, unsigned long img_id)
+{
+	xfer->pmi = open_image(fd_type, O_DUMP, img_id);
+	if (!xfer->pmi)
+		return -1;
+
+	xfer->pi = open_pages_image(O_DUMP, xfer->pmi, &xfer->pages_id);
+	if (!xfer->pi)
+		goto err_pmi;
+
+	/*
+	 * Open page-read for parent images (if it exists). It will
+	 * be used for two things:
+	 * 1) when writing a page, those from parent will be dedup-ed
+	 * 2) when writing a hole, the respective place would be checked
+	 *    to exist in parent (either pagemap or hole)
+	 */
+	xfer->parent = NULL;
+	if (fd_type == CR_FD_PAGEMAP || fd_type == CR_FD_SHMEM_PAGEMAP) {
+		int ret;
+		int pfd;
+		int pr_flags = (fd_type == CR_FD_PAGEMAP) ? PR_TASK : PR_SHMEM;
+
+		/* Image streaming lacks support for incremental images */
 		if (opts.stream)
 			goto out;
 
@@ -417,6 +932,18 @@ out:
 	xfer->write_pagemap = write_pagemap_loc;
 	xfer->write_pages = write_pages_loc;
 	xfer->close = close_page_xfer;
+	xfer->dedup = NULL;
+	xfer->uring = false;
+	if (page_xfer_compress_init(xfer, write_frames_loc) || page_xfer_dedup_init(xfer)) {
+		close_page_xfer(xfer);
+		return -1;
+	}
+
+	/* Compressed and deduplicated pages are written synchronously */
+	if (!opts.stream && !xfer->compress && !xfer->dedup && uring_enabled()) {
+		xfer->pages_off = lseek(img_raw_fd(xfer->pi), 0, SEEK_CUR);
+		xfer->uring = xfer->pages_off >= 0;
+	}
 	return 0;
 
 err_pi:
@@ -437,6 +964,31 @@ int open_page_xfer(struct page_xfer *xfer, int fd_type, unsigned long img_id)
 		return open_page_local_xfer(xfer, fd_type, img_id);
 }
 
+/*
+ * Prepare the xfer to be handed over to a forked dump worker. The
+ * headers written on open sit in the images' buffers and would be
+ * flushed twice otherwise -- by the worker and by the parent.
+ */
+int page_xfer_flush(struct page_xfer *xfer)
+{
+	if (xfer->write_pagemap != write_pagemap_loc)
+		return 0;
+
+	if (flush_image(xfer->pmi) || flush_image(xfer->pi))
+		return -1;
+
+	if (xfer->uring) {
+		if (page_xfer_wait(xfer))
+			return -1;
+		if (lseek(img_raw_fd(xfer->pi), xfer->pages_off, SEEK_SET) < 0) {
+			pr_perror("Can't set pages image position");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int page_xfer_dump_hole(struct page_xfer *xfer, struct iovec *hole, u32 flags)
 {
 	BUG_ON(hole->iov_base < (void *)xfer->offset);
@@ -489,11 +1041,152 @@ static inline u32 ppb_xfer_flags(struct page_xfer *xfer, struct page_pipe_buf *p
 		 * In the case we actually transfer them into image mark them
 		 * as present as well.
 		 */
-		return (xfer->transfer_lazy ? PE_PRESENT : 0) | PE_LAZY;
+		return (xfer->transfer_lazy ? PE_PRESENT : 0) | PE_LAZY | (ppb->flags & PPB_HOT ? PE_HOT : 0);
 	else
 		return PE_PRESENT;
 }
 
+/*
+ * With --skip-zero-pages the pages of anonymous memory are read from
+ * the page pipe, the zero ones go into pagemap as PE_ZERO entries and
+ * the rest are put into another pipe to be written as usual.
+ */
+struct zero_pages {
+	void *buf;
+	unsigned long buf_len;
+	int p[2];
+	unsigned long pipe_len;
+};
+
+static void zero_pages_init(struct zero_pages *zp)
+{
+	zp->buf = NULL;
+	zp->buf_len = 0;
+	zp->p[0] = zp->p[1] = -1;
+}
+
+static void zero_pages_fini(struct zero_pages *zp)
+{
+	if (zp->buf)
+		munmap(zp->buf, zp->buf_len);
+	close_safe(&zp->p[0]);
+	close_safe(&zp->p[1]);
+}
+
+static int zero_pages_prepare(struct zero_pages *zp, unsigned long len)
+{
+	void *buf;
+	int size;
+
+	if (zp->p[0] < 0) {
+		if (pipe(zp->p)) {
+			pr_perror("Can't make pipe for non-zero pages");
+			return -1;
+		}
+
+		size = fcntl(zp->p[0], F_GETPIPE_SZ);
+		if (size < 0) {
+			pr_perror("Can't get pipe size");
+			return -1;
+		}
+		zp->pipe_len = size;
+	}
+
+	if (len <= zp->buf_len)
+		return 0;
+
+	/* The buffer is page-aligned for the vector loads in is_zero_page */
+	if (zp->buf)
+		buf = mremap(zp->buf, zp->buf_len, len, MREMAP_MAYMOVE);
+	else
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (buf == MAP_FAILED) {
+		pr_perror("Unable to map a buffer for pages");
+		return -1;
+	}
+
+	zp->buf = buf;
+	zp->buf_len = len;
+	return 0;
+}
+
+static int write_nonzero_pages(struct page_xfer *xfer, struct zero_pages *zp, void *buf, unsigned long len)
+{
+	while (len) {
+		unsigned long n = min(len, zp->pipe_len);
+
+		if (write_all(zp->p[1], buf, n) != n) {
+			pr_perror("Can't put pages into pipe");
+			return -1;
+		}
+
+		if (xfer->write_pages(xfer, zp->p[0], n))
+			return -1;
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int skip_zero_pages(struct page_xfer *xfer, struct zero_pages *zp, int p, struct iovec *iov, u32 flags)
+{
+	unsigned long off = 0, len = iov->iov_len;
+
+	if (zero_pages_prepare(zp, len))
+		return -1;
+
+	if (read_all(p, zp->buf, len) != len) {
+		pr_perror("Can't read pages from pipe");
+		return -1;
+	}
+
+	while (off < len) {
+		bool zero = is_zero_page(zp->buf + off);
+		unsigned long end = off + PAGE_SIZE;
+		struct iovec run;
+
+		while (end < len && is_zero_page(zp->buf + end) == zero)
+			end += PAGE_SIZE;
+
+		run.iov_base = iov->iov_base + off;
+		run.iov_len = end - off;
+
+		if (zero) {
+			if (xfer->write_pagemap(xfer, &run, PE_ZERO))
+				return -1;
+			cnt_add(CNT_PAGES_ZERO, run.iov_len / PAGE_SIZE);
+		} else {
+			if (xfer->write_pagemap(xfer, &run, flags))
+				return -1;
+			if (write_nonzero_pages(xfer, zp, zp->buf + off, run.iov_len))
+				return -1;
+		}
+
+		off = end;
+	}
+
+	return 0;
+}
+
+static int dump_pages_iov(struct page_xfer *xfer, struct zero_pages *zp, struct page_pipe_buf *ppb,
+			  struct iovec *iov)
+{
+	u32 flags = ppb_xfer_flags(xfer, ppb);
+
+	/* Lazy pages are not read from the pipe, so are not checked */
+	if ((ppb->flags & PPB_ANON) && flags == PE_PRESENT)
+		return skip_zero_pages(xfer, zp, ppb->p[0], iov, flags);
+
+	if (xfer->write_pagemap(xfer, iov, flags))
+		return -1;
+	if ((flags & PE_PRESENT) && xfer->write_pages(xfer, ppb->p[0], iov->iov_len))
+		return -1;
+
+	return 0;
+}
+
 /*
  * Optimized pre-dump algorithm
  * ==============================
@@ -783,7 +1476,9 @@ int page_xfer_predump_pages(int pid, struct page_xfer *xfer, struct page_pipe *p
 	struct iovec *aux_iov;
 	unsigned long aux_len;
 	void *userbuf;
+	struct zero_pages zp;
 
+	zero_pages_init(&zp);
 	userbuf_len = PIPE_MAX_BUFFER_SIZE;
 	userbuf = mmap(NULL, userbuf_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 	if (userbuf == MAP_FAILED) {
@@ -821,6 +1516,7 @@ int page_xfer_predump_pages(int pid, struct page_xfer *xfer, struct page_pipe *p
 			timing_stop(TIME_MEMDUMP);
 			munmap(userbuf, userbuf_len);
 			xfree(aux_iov);
+			zero_pages_fini(&zp);
 			return 0;
 		}
 		if (bytes_read < 0)
@@ -841,7 +1537,6 @@ int page_xfer_predump_pages(int pid, struct page_xfer *xfer, struct page_pipe *p
 		/* generating pagemap */
 		for (i = 0; i < aux_len; i++) {
 			struct iovec iov = aux_iov[i];
-			u32 flags;
 
 			ret = dump_holes(xfer, pp, &cur_hole, iov.iov_base);
 			if (ret)
@@ -851,26 +1546,28 @@ int page_xfer_predump_pages(int pid, struct page_xfer *xfer, struct page_pipe *p
 			iov.iov_base -= xfer->offset;
 			pr_debug("\t p %p [%u]\n", iov.iov_base, (unsigned int)(iov.iov_len / PAGE_SIZE));
 
-			flags = ppb_xfer_flags(xfer, ppb);
-
-			if (xfer->write_pagemap(xfer, &iov, flags))
-				goto err;
-
-			if (xfer->write_pages(xfer, ppb->p[0], iov.iov_len))
+			if (dump_pages_iov(xfer, &zp, ppb, &iov))
 				goto err;
 		}
 
+		/* The userbuf pages are gifted to the pipe and are reused */
+		if (page_xfer_wait(xfer))
+			goto err;
+
 		timing_stop(TIME_MEMWRITE);
 	}
 
 	munmap(userbuf, userbuf_len);
 	xfree(aux_iov);
+	zero_pages_fini(&zp);
 	timing_start(TIME_MEMWRITE);
 
 	return dump_holes(xfer, pp, &cur_hole, NULL);
 err:
+	page_xfer_wait(xfer);
 	munmap(userbuf, userbuf_len);
 	xfree(aux_iov);
+	zero_pages_fini(&zp);
 	return -1;
 }
 
@@ -878,10 +1575,12 @@ int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp)
 {
 	struct page_pipe_buf *ppb;
 	unsigned int cur_hole = 0;
+	struct zero_pages zp;
 	int ret;
 
 	pr_debug("Transferring pages:\n");
 
+	zero_pages_init(&zp);
 	list_for_each_entry(ppb, &pp->bufs, l) {
 		unsigned int i;
 
@@ -889,26 +1588,28 @@ int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp)
 
 		for (i = 0; i < ppb->nr_segs; i++) {
 			struct iovec iov = ppb->iov[i];
-			u32 flags;
 
 			ret = dump_holes(xfer, pp, &cur_hole, iov.iov_base);
 			if (ret)
-				return ret;
+				goto out;
 
 			BUG_ON(iov.iov_base < (void *)xfer->offset);
 			iov.iov_base -= xfer->offset;
 			pr_debug("\tp %p [%u]\n", iov.iov_base, (unsigned int)(iov.iov_len / PAGE_SIZE));
 
-			flags = ppb_xfer_flags(xfer, ppb);
-
-			if (xfer->write_pagemap(xfer, &iov, flags))
-				return -1;
-			if ((flags & PE_PRESENT) && xfer->write_pages(xfer, ppb->p[0], iov.iov_len))
-				return -1;
+			ret = dump_pages_iov(xfer, &zp, ppb, &iov);
+			if (ret)
+				goto out;
 		}
 	}
 
-	return dump_holes(xfer, pp, &cur_hole, NULL);
+	ret = dump_holes(xfer, pp, &cur_hole, NULL);
+out:
+	/* The page pipe can be reused after return, see PP_CHUNK_MODE */
+	if (page_xfer_wait(xfer))
+		ret = -1;
+	zero_pages_fini(&zp);
+	return ret;
 }
 
 /*
@@ -1012,6 +1713,313 @@ static struct pipe_read_dest pipe_read_dest = {
 	.sink_fd = -1,
 };
 
+/*
+ * With --ps-streams the dump side asks for N more connections with the
+ * PS_IOV_STREAMS command. They are accepted on the listening socket and
+ * every one gets its own receiver process, that writes the pages right
+ * into the pages image at the offsets from the data headers. Receivers
+ * are processes and not threads for the same reason the dump workers
+ * are -- neither logging, nor images are thread-safe.
+ *
+ * The main connection keeps the pagemap order. Before an image is closed
+ * (on the next open and on close) the page server waits for the receivers
+ * to write all the pages of the PS_IOV_ADD_S entries it has seen.
+ *
+ * The PS_IOV_STREAMS carries a random cookie in the vaddr, every data
+ * connection has to come from the same host as the main one and repeat
+ * the cookie in its PS_IOV_STREAM, otherwise it is refused.
+ */
+struct ps_streams {
+	futex_t done;	/* data messages written by the receivers */
+	futex_t opened; /* bumped by the page_server_open() */
+	u64 dst_id;
+	u32 pages_id;
+};
+
+static int ps_listen_sk = -1;
+static struct ps_streams *ps_streams;
+static pid_t ps_stream_pids[PS_STREAMS_MAX];
+static int nr_ps_streams;
+static unsigned int ps_streams_expected;
+
+static int page_server_stream_open(struct page_server_data *hdr, struct cr_img **img)
+{
+	uint32_t opened;
+
+	while (1) {
+		opened = futex_get(&ps_streams->opened);
+		if (opened & FUTEX_ABORT_FLAG)
+			return -1;
+		if (ps_streams->dst_id == hdr->dst_id)
+			break;
+		/* The main connection hasn't yet got to this image */
+		futex_wait_while_eq(&ps_streams->opened, opened);
+	}
+
+	if (*img)
+		close_image(*img);
+
+	*img = open_image_at(get_service_fd(IMG_FD_OFF), CR_FD_PAGES, O_RDWR, ps_streams->pages_id);
+	if (!*img)
+		return -1;
+	if (empty_image(*img)) {
+		pr_err("No pages image %u for stream\n", ps_streams->pages_id);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int page_server_stream_write(int sk, int p[2], unsigned int pipe_size, int fd, struct page_server_data *hdr)
+{
+	loff_t off = hdr->off;
+	size_t len = hdr->len;
+
+	while (len > 0) {
+		ssize_t chunk, ret;
+
+		chunk = splice(sk, NULL, p[1], NULL, min_t(size_t, len, pipe_size), SPLICE_F_MOVE);
+		if (chunk < 0) {
+			pr_perror("Can't read pages from stream");
+			return -1;
+		}
+		if (chunk == 0) {
+			pr_err("A stream was closed unexpectedly\n");
+			return -1;
+		}
+		len -= chunk;
+
+		while (chunk > 0) {
+			ret = splice(p[0], NULL, fd, &off, chunk, SPLICE_F_MOVE);
+			if (ret <= 0) {
+				pr_perror("Can't write pages from stream");
+				return -1;
+			}
+			chunk -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int page_server_stream_serve(int sk)
+{
+	struct cr_img *img = NULL;
+	unsigned int pipe_size;
+	int p[2], ret = -1;
+
+	if (pipe(p)) {
+		pr_perror("Can't make pipe for stream");
+		return -1;
+	}
+	pipe_size = fcntl(p[0], F_GETPIPE_SZ, 0);
+
+	while (1) {
+		struct page_server_data hdr;
+
+		ret = recv(sk, &hdr, sizeof(hdr), MSG_WAITALL);
+		if (ret == 0)
+			break;
+		if (ret != sizeof(hdr)) {
+			pr_perror("Can't read data header from stream");
+			ret = -1;
+			break;
+		}
+
+		ret = -1;
+		if (hdr.cmd != PS_IOV_DATA || hdr.len % PAGE_SIZE) {
+			pr_err("Bad data header %u/%u on stream\n", hdr.cmd, hdr.len);
+			break;
+		}
+
+		if ((!img || ps_streams->dst_id != hdr.dst_id) && page_server_stream_open(&hdr, &img))
+			break;
+
+		if (page_server_stream_write(sk, p, pipe_size, img_raw_fd(img), &hdr))
+			break;
+
+		futex_inc_and_wake(&ps_streams->done);
+		ret = 0;
+	}
+
+	if (ret)
+		futex_abort_and_wake(&ps_streams->done);
+	if (img)
+		close_image(img);
+	close(p[0]);
+	close(p[1]);
+	return ret;
+}
+
+static bool ps_stream_same_peer(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return false;
+
+	if (a->ss_family == AF_INET)
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr;
+	if (a->ss_family == AF_INET6)
+		return !memcmp(&((struct sockaddr_in6 *)a)->sin6_addr, &((struct sockaddr_in6 *)b)->sin6_addr,
+			       sizeof(struct in6_addr));
+
+	return false;
+}
+
+static int page_server_streams(int main_sk, struct page_server_iov *pi)
+{
+	struct sockaddr_storage main_addr;
+	socklen_t alen = sizeof(main_addr);
+	unsigned int i;
+
+	if (opts.lazy_pages || page_store_enabled() || ps_listen_sk < 0 || nr_ps_streams) {
+		pr_err("Page server can't accept data streams\n");
+		return -1;
+	}
+
+	/* The stream receivers write the pages as they come */
+	if (opts.compress) {
+		pr_err("Page server can't compress data streams, don't use --ps-streams with it\n");
+		return -1;
+	}
+
+	if (pi->nr_pages < 2 || pi->nr_pages > PS_STREAMS_MAX) {
+		pr_err("Bad number of data streams %u\n", pi->nr_pages);
+		return -1;
+	}
+
+	if (getpeername(main_sk, (struct sockaddr *)&main_addr, &alen)) {
+		pr_perror("Can't get the page server peer");
+		return -1;
+	}
+
+	ps_streams = mmap(NULL, sizeof(*ps_streams), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ps_streams == MAP_FAILED) {
+		pr_perror("Can't map streams state");
+		ps_streams = NULL;
+		return -1;
+	}
+	ps_streams->dst_id = cxfer.dst_id;
+	ps_streams->pages_id = cxfer.loc_xfer.pages_id;
+
+	for (i = 0; i < pi->nr_pages; i++) {
+		struct page_server_iov hello;
+		struct sockaddr_storage addr;
+		int sk, ret;
+		pid_t pid;
+
+		alen = sizeof(addr);
+		sk = accept(ps_listen_sk, (struct sockaddr *)&addr, &alen);
+		if (sk < 0) {
+			pr_perror("Can't accept data stream");
+			return -1;
+		}
+
+		if (!ps_stream_same_peer(&main_addr, &addr)) {
+			pr_err("Data stream comes from another host\n");
+			close(sk);
+			return -1;
+		}
+
+		ret = recv(sk, &hello, sizeof(hello), MSG_WAITALL);
+		if (ret != sizeof(hello) || hello.cmd != PS_IOV_STREAM || hello.vaddr != pi->vaddr) {
+			pr_err("Bad data stream hello (%d)\n", ret);
+			close(sk);
+			return -1;
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			pr_perror("Can't fork stream receiver");
+			close(sk);
+			return -1;
+		}
+
+		if (pid == 0) {
+			close_safe(&ps_listen_sk);
+			exit(page_server_stream_serve(sk) ? 1 : 0);
+		}
+
+		pr_debug("Stream %u is received by %d\n", hello.nr_pages, pid);
+		ps_stream_pids[nr_ps_streams++] = pid;
+		close(sk);
+	}
+
+	close_safe(&ps_listen_sk);
+	pr_info("Receiving pages over %d streams\n", nr_ps_streams);
+	return 0;
+}
+
+/* Wait for the receivers to write all the pages sent so far */
+static int page_server_streams_sync(void)
+{
+	int i;
+
+	if (!nr_ps_streams)
+		return 0;
+
+	while (1) {
+		struct timespec to = { .tv_sec = 1 };
+		uint32_t done;
+
+		done = futex_get(&ps_streams->done);
+		if (done & FUTEX_ABORT_FLAG) {
+			pr_err("Stream receiver failed\n");
+			return -1;
+		}
+		if (done == ps_streams_expected)
+			break;
+
+		/* Receivers abort the futex on errors, but can also be killed */
+		for (i = 0; i < nr_ps_streams; i++) {
+			if (ps_stream_pids[i] && waitpid(ps_stream_pids[i], NULL, WNOHANG) == ps_stream_pids[i]) {
+				pr_err("Stream receiver %d exited prematurely\n", ps_stream_pids[i]);
+				ps_stream_pids[i] = 0;
+				return -1;
+			}
+		}
+
+		sys_futex((uint32_t *)&ps_streams->done.raw.counter, FUTEX_WAIT, done, &to, NULL, 0);
+	}
+
+	futex_set(&ps_streams->done, 0);
+	ps_streams_expected = 0;
+	return 0;
+}
+
+static int page_server_streams_fini(int ret)
+{
+	int i, status;
+
+	if (!nr_ps_streams)
+		return ret;
+
+	for (i = 0; i < nr_ps_streams; i++) {
+		pid_t pid = ps_stream_pids[i];
+
+		if (!pid)
+			continue;
+
+		if (ret)
+			kill(pid, SIGKILL);
+
+		if (waitpid(pid, &status, 0) != pid) {
+			pr_perror("Can't wait for stream receiver %d", pid);
+			ret = -1;
+			continue;
+		}
+
+		if (!ret && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+			pr_err("Stream receiver %d failed (status 0x%x)\n", pid, status);
+			ret = -1;
+		}
+	}
+
+	munmap(ps_streams, sizeof(*ps_streams));
+	ps_streams = NULL;
+	nr_ps_streams = 0;
+	return ret;
+}
+
 static void page_server_close(void)
 {
 	if (cxfer.dst_id != ~0)
@@ -1036,6 +2044,9 @@ static int page_server_open(int sk, struct page_server_iov *pi)
 
 	pr_info("Opening %d/%lu\n", type, id);
 
+	if (page_server_streams_sync())
+		return -1;
+
 	page_server_close();
 
 	if (open_page_local_xfer(&cxfer.loc_xfer, type, id))
@@ -1043,6 +2054,12 @@ static int page_server_open(int sk, struct page_server_iov *pi)
 
 	cxfer.dst_id = pi->dst_id;
 
+	if (ps_streams) {
+		ps_streams->pages_id = cxfer.loc_xfer.pages_id;
+		ps_streams->dst_id = pi->dst_id;
+		futex_inc_and_wake(&ps_streams->opened);
+	}
+
 	if (sk >= 0) {
 		char has_parent = !!cxfer.loc_xfer.parent;
 		if (__send(sk, &has_parent, 1, 0) != 1) {
@@ -1064,6 +2081,93 @@ static int prep_loc_xfer(struct page_server_iov *pi)
 		return 0;
 }
 
+/* Receives the frames sizes of a compressed entry, returns their number */
+static int page_server_recv_frames(int sk, struct iovec *iov, u32 *frames, size_t *len)
+{
+	unsigned long nr_pages = iov->iov_len / PAGE_SIZE;
+	unsigned int nr_frames, i;
+
+	nr_frames = DIV_ROUND_UP(nr_pages, COMPRESS_FRAME_PAGES);
+	if (!nr_frames || nr_frames > COMPRESS_CHUNK_FRAMES) {
+		pr_err("Bad compressed entry %p/%lu\n", iov->iov_base, nr_pages);
+		return -1;
+	}
+
+	if (recv_all(sk, frames, nr_frames * sizeof(*frames)))
+		return -1;
+
+	*len = 0;
+	for (i = 0; i < nr_frames; i++) {
+		unsigned long raw_len = min_t(unsigned long, COMPRESS_FRAME_PAGES, nr_pages - i * COMPRESS_FRAME_PAGES);
+
+		if (!frames[i] || frames[i] > raw_len * PAGE_SIZE) {
+			pr_err("Bad frame %u size %u for %p\n", i, frames[i], iov->iov_base);
+			return -1;
+		}
+		*len += frames[i];
+	}
+
+	return nr_frames;
+}
+
+static int page_server_add_frames(int sk, struct page_xfer *lxfer, struct iovec *iov, u32 flags)
+{
+	u32 frames[COMPRESS_CHUNK_FRAMES];
+	int nr_frames, ret;
+	size_t len;
+	void *data;
+
+	nr_frames = page_server_recv_frames(sk, iov, frames, &len);
+	if (nr_frames < 0)
+		return -1;
+
+	data = xmalloc(len);
+	if (!data)
+		return -1;
+
+	ret = recv_all(sk, data, len);
+	if (!ret)
+		ret = write_frames_loc(lxfer, iov, flags, frames, nr_frames, data, len);
+
+	xfree(data);
+	return ret;
+}
+
+/*
+ * The pages of this entry come over one of the data streams and are
+ * written by the receiver, here only the pagemap entry is written.
+ */
+static int page_server_add_stream(int sk, struct page_server_iov *pi, u32 flags)
+{
+	u32 frames[COMPRESS_CHUNK_FRAMES];
+	int nr_frames = 0;
+	struct iovec iov;
+	size_t len;
+
+	pr_debug("Adding %" PRIx64 "/%u from stream\n", pi->vaddr, pi->nr_pages);
+
+	if (!nr_ps_streams || !(flags & PE_PRESENT)) {
+		pr_err("Unexpected streamed entry %" PRIx64 "\n", pi->vaddr);
+		return -1;
+	}
+
+	if (prep_loc_xfer(pi))
+		return -1;
+
+	psi2iovec(pi, &iov);
+	if (flags & PE_COMPRESSED) {
+		nr_frames = page_server_recv_frames(sk, &iov, frames, &len);
+		if (nr_frames < 0)
+			return -1;
+	}
+
+	if (__write_pagemap_loc(&cxfer.loc_xfer, &iov, flags, nr_frames ? frames : NULL, nr_frames))
+		return -1;
+
+	ps_streams_expected++;
+	return 0;
+}
+
 static int page_server_add(int sk, struct page_server_iov *pi, u32 flags)
 {
 	size_t len;
@@ -1076,6 +2180,9 @@ static int page_server_add(int sk, struct page_server_iov *pi, u32 flags)
 		return -1;
 
 	psi2iovec(pi, &iov);
+	if (flags & PE_COMPRESSED)
+		return page_server_add_frames(sk, lxfer, &iov, flags);
+
 	if (lxfer->write_pagemap(lxfer, &iov, flags))
 		return -1;
 
@@ -1131,46 +2238,297 @@ static int page_server_add(int sk, struct page_server_iov *pi, u32 flags)
 	return 0;
 }
 
-static int page_server_get_pages(int sk, struct page_server_iov *pi)
+static int page_server_send_pages(int sk, struct page_server_iov *pi, u32 cmd)
+{
+	struct pstree_item *item;
+	struct page_pipe *pp;
+	unsigned long len;
+	int ret;
+
+	item = pstree_item_by_virt(pi->dst_id);
+	pp = dmpi(item)->mem_pp;
+
+	ret = page_pipe_read(pp, &pipe_read_dest, pi->vaddr, &pi->nr_pages, PPB_LAZY);
+	if (ret)
+		return ret;
+
+	/*
+	 * The pi is reused for send_psi here, so .nr_pages, .vaddr and
+	 * .dst_id all remain intact.
+	 */
+
+	if (pi->nr_pages == 0) {
+		pr_debug("no iovs found, zero pages\n");
+		return -1;
+	}
+
+	pi->cmd = cmd;
+	if (send_psi(sk, pi))
+		return -1;
+
+	len = pi->nr_pages * PAGE_SIZE;
+
+	if (opts.tls) {
+		if (tls_send_data_from_fd(pipe_read_dest.p[0], len))
+			return -1;
+	} else {
+		ret = splice(pipe_read_dest.p[0], NULL, sk, NULL, len, SPLICE_F_MOVE);
+		if (ret != len)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * With --lazy-push the lazy-pages daemon asks the page server with
+ * PS_IOV_PUSH to send all the lazy pages by itself, so that the link
+ * doesn't stay idle between the page faults. The pages are pushed in
+ * chunks of up to the number of pages the daemon has asked with, the
+ * recently used ones (PPB_HOT) of all the tasks first. The PS_IOV_GET
+ * requests preempt the push in between the chunks. The push ends with
+ * PS_IOV_PUSH without pages, either when all the pages are sent or when
+ * the daemon asks to stop it with the same.
+ *
+ * The ranges to push are collected on the first request of either kind
+ * and the pages sent for the PS_IOV_GET-s are cut out of them, so that
+ * nothing is sent twice. Once the push is over they are not tracked.
+ */
+struct ps_push_iov {
+	unsigned long id;
+	unsigned long vaddr;
+	unsigned long len;
+};
+
+static struct ps_push_iov *ps_push_iovs;
+static unsigned int ps_push_nr, ps_push_cur;
+static unsigned int ps_push_pages;
+static bool ps_push_tracked, ps_push_ended;
+static bool ps_push_on;
+
+static int page_server_push_add(struct pstree_item *item, struct page_pipe *pp, bool hot)
+{
+	struct page_pipe_buf *ppb;
+	unsigned int i;
+
+	list_for_each_entry(ppb, &pp->bufs, l) {
+		if (!(ppb->flags & PPB_LAZY) || !!(ppb->flags & PPB_HOT) != hot)
+			continue;
+
+		for (i = 0; i < ppb->nr_segs; i++) {
+			struct ps_push_iov *pv;
+
+			if (xrealloc_safe(&ps_push_iovs, (ps_push_nr + 1) * sizeof(*ps_push_iovs)))
+				return -1;
+
+			pv = &ps_push_iovs[ps_push_nr++];
+			pv->id = vpid(item);
+			pv->vaddr = (unsigned long)ppb->iov[i].iov_base;
+			pv->len = ppb->iov[i].iov_len;
+		}
+	}
+
+	return 0;
+}
+
+static int page_server_push_track(void)
+{
+	struct pstree_item *item;
+	int hot;
+
+	if (ps_push_tracked || ps_push_ended)
+		return 0;
+	ps_push_tracked = true;
+
+	for (hot = 1; hot >= 0; hot--) {
+		for_each_pstree_item(item) {
+			if (!task_alive(item) || !dmpi(item)->mem_pp)
+				continue;
+			if (page_server_push_add(item, dmpi(item)->mem_pp, hot))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Cuts the pages just sent for a request out of the ranges to push */
+static int page_server_push_exclude(struct page_server_iov *pi)
+{
+	unsigned long start = pi->vaddr, end = start + pi->nr_pages * PAGE_SIZE;
+	unsigned int i;
+
+	if (page_server_push_track())
+		return -1;
+
+	for (i = ps_push_cur; i < ps_push_nr; i++) {
+		struct ps_push_iov *pv = &ps_push_iovs[i];
+		unsigned long pv_end = pv->vaddr + pv->len;
+
+		if (pv->id != pi->dst_id || pv_end <= start || pv->vaddr >= end)
+			continue;
+
+		if (pv->vaddr >= start) {
+			pv->len = pv_end > end ? pv_end - end : 0;
+			pv->vaddr = end;
+		} else if (pv_end <= end) {
+			pv->len = start - pv->vaddr;
+		} else {
+			/* the tail is pushed right after the head */
+			if (xrealloc_safe(&ps_push_iovs, (ps_push_nr + 1) * sizeof(*ps_push_iovs)))
+				return -1;
+			pv = &ps_push_iovs[i];
+			memmove(pv + 2, pv + 1, (ps_push_nr - i - 1) * sizeof(*pv));
+			ps_push_nr++;
+
+			pv[1].id = pv->id;
+			pv[1].vaddr = end;
+			pv[1].len = pv_end - end;
+			pv->len = start - pv->vaddr;
+			i++;
+		}
+	}
+
+	return 0;
+}
+
+static int page_server_get_pages(int sk, struct page_server_iov *pi)
+{
+	if (page_server_send_pages(sk, pi, encode_ps_cmd(PS_IOV_ADD_F, PE_PRESENT)) || page_server_push_exclude(pi))
+		return -1;
+
+	tcp_nodelay(sk, true);
+
+	return 0;
+}
+
+/*
+ * PS_IOV_GETV carries the number of PS_IOV_GET requests that follow it,
+ * they are answered one by one in the same order.
+ */
+#define PS_GETV_MAX 64
+
+static int page_server_get_pagesv(int sk, struct page_server_iov *pi)
+{
+	struct page_server_iov reqs[PS_GETV_MAX];
+	unsigned int i, nr = pi->nr_pages;
+
+	if (!nr || nr > PS_GETV_MAX) {
+		pr_err("Bad number of page requests %u\n", nr);
+		return -1;
+	}
+
+	if (recv_all(sk, reqs, nr * sizeof(reqs[0])))
+		return -1;
+
+	pr_debug("Serving %u batched page requests\n", nr);
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].cmd != PS_IOV_GET) {
+			pr_err("Unexpected command %u in page requests\n", reqs[i].cmd);
+			return -1;
+		}
+
+		if (page_server_send_pages(sk, &reqs[i], encode_ps_cmd(PS_IOV_ADD_F, PE_PRESENT)) ||
+		    page_server_push_exclude(&reqs[i]))
+			return -1;
+	}
+
+	tcp_nodelay(sk, true);
+
+	return 0;
+}
+
+static int page_server_push_end(int sk)
+{
+	struct page_server_iov pi = {
+		.cmd = PS_IOV_PUSH,
+	};
+
+	xfree(ps_push_iovs);
+	ps_push_iovs = NULL;
+	ps_push_nr = ps_push_cur = 0;
+	ps_push_on = false;
+	ps_push_ended = true;
+
+	if (send_psi(sk, &pi))
+		return -1;
+
+	tcp_nodelay(sk, true);
+	return 0;
+}
+
+/* Skips the ranges that have been sent completely for the requests */
+static bool page_server_push_next(void)
 {
-	struct pstree_item *item;
-	struct page_pipe *pp;
-	unsigned long len;
-	int ret;
+	while (ps_push_cur < ps_push_nr && !ps_push_iovs[ps_push_cur].len)
+		ps_push_cur++;
 
-	item = pstree_item_by_virt(pi->dst_id);
-	pp = dmpi(item)->mem_pp;
+	return ps_push_cur < ps_push_nr;
+}
 
-	ret = page_pipe_read(pp, &pipe_read_dest, pi->vaddr, &pi->nr_pages, PPB_LAZY);
-	if (ret)
-		return ret;
+static int page_server_push_start(int sk, struct page_server_iov *pi)
+{
+	unsigned long nr = 0;
+	unsigned int i, nr_ranges = 0;
 
-	/*
-	 * The pi is reused for send_psi here, so .nr_pages, .vaddr and
-	 * .dst_id all remain intact.
-	 */
+	if (!pi->nr_pages) {
+		pr_info("Push is stopped by the lazy-pages daemon\n");
+		return ps_push_on ? page_server_push_end(sk) : 0;
+	}
 
-	if (pi->nr_pages == 0) {
-		pr_debug("no iovs found, zero pages\n");
+	if (ps_push_on)
+		return 0;
+	if (ps_push_ended)
+		return page_server_push_end(sk);
+	ps_push_on = true;
+	ps_push_pages = pi->nr_pages;
+
+	if (page_server_push_track())
 		return -1;
+
+	for (i = ps_push_cur; i < ps_push_nr; i++) {
+		if (!ps_push_iovs[i].len)
+			continue;
+		nr += ps_push_iovs[i].len / PAGE_SIZE;
+		nr_ranges++;
 	}
+	pr_info("Pushing %lu pages in %u ranges\n", nr, nr_ranges);
 
-	pi->cmd = encode_ps_cmd(PS_IOV_ADD_F, PE_PRESENT);
-	if (send_psi(sk, pi))
-		return -1;
+	if (!page_server_push_next())
+		return page_server_push_end(sk);
 
-	len = pi->nr_pages * PAGE_SIZE;
+	return 0;
+}
 
-	if (opts.tls) {
-		if (tls_send_data_from_fd(pipe_read_dest.p[0], len))
-			return -1;
-	} else {
-		ret = splice(pipe_read_dest.p[0], NULL, sk, NULL, len, SPLICE_F_MOVE);
-		if (ret != len)
-			return -1;
-	}
+/* The push only goes on while no requests are waiting */
+static bool page_server_push_pending(int sk)
+{
+	struct pollfd pfd = {
+		.fd = sk,
+		.events = POLLIN,
+	};
 
-	tcp_nodelay(sk, true);
+	return ps_push_on && poll(&pfd, 1, 0) == 0;
+}
+
+static int page_server_push(int sk)
+{
+	struct ps_push_iov *pv = &ps_push_iovs[ps_push_cur];
+	struct page_server_iov pi = {
+		.nr_pages = min_t(unsigned long, pv->len / PAGE_SIZE, ps_push_pages),
+		.vaddr = pv->vaddr,
+		.dst_id = pv->id,
+	};
+
+	if (page_server_send_pages(sk, &pi, encode_ps_cmd(PS_IOV_PUSH, 0)))
+		return -1;
+
+	pv->vaddr += pi.nr_pages * PAGE_SIZE;
+	pv->len -= pi.nr_pages * PAGE_SIZE;
+	if (!page_server_push_next()) {
+		pr_info("All the lazy pages are pushed\n");
+		return page_server_push_end(sk);
+	}
 
 	return 0;
 }
@@ -1206,6 +2564,13 @@ static int page_server_serve(int sk)
 		struct page_server_iov pi;
 		u32 cmd;
 
+		if (page_server_push_pending(sk)) {
+			ret = page_server_push(sk);
+			if (ret)
+				break;
+			continue;
+		}
+
 		ret = __recv(sk, &pi, sizeof(pi), MSG_WAITALL);
 		if (!ret)
 			break;
@@ -1244,11 +2609,19 @@ static int page_server_serve(int sk)
 			ret = page_server_add(sk, &pi, flags);
 			break;
 		}
+		case PS_IOV_STREAMS:
+			ret = page_server_streams(sk, &pi);
+			break;
+		case PS_IOV_ADD_S:
+			ret = page_server_add_stream(sk, &pi, decode_ps_flags(pi.cmd));
+			break;
 		case PS_IOV_CLOSE:
 		case PS_IOV_FORCE_CLOSE: {
-			int32_t status = 0;
+			int32_t status;
 
-			ret = 0;
+			/* The streamed pages should be written before the answer */
+			ret = page_server_streams_sync();
+			status = ret;
 
 			/*
 			 * An answer must be sent back to inform another side,
@@ -1265,12 +2638,26 @@ static int page_server_serve(int sk)
 		case PS_IOV_GET:
 			ret = page_server_get_pages(sk, &pi);
 			break;
+		case PS_IOV_GETV:
+			ret = page_server_get_pagesv(sk, &pi);
+			break;
+		case PS_IOV_PUSH:
+			if (receiving_pages || opts.tls) {
+				pr_err("Can't push pages in this mode\n");
+				ret = -1;
+				break;
+			}
+			ret = page_server_push_start(sk, &pi);
+			break;
 		default:
 			pr_err("Unknown command %u\n", pi.cmd);
 			ret = -1;
 			break;
 		}
 
+		/* Data streams can only be requested right after the connection */
+		close_safe(&ps_listen_sk);
+
 		if (ret)
 			break;
 		if (pi.cmd == PS_IOV_CLOSE || pi.cmd == PS_IOV_FORCE_CLOSE)
@@ -1297,7 +2684,10 @@ static int page_server_serve(int sk)
 		}
 	}
 
+	xfree(ps_push_iovs);
 	page_server_close();
+	page_store_close();
+	ret = page_server_streams_fini(ret);
 
 	pr_info("Session over\n");
 
@@ -1305,9 +2695,57 @@ static int page_server_serve(int sk)
 	return ret;
 }
 
+#define FILL_BUF_PAGES 16
+
+/*
+ * Compressed and deduplicated pages can't be spliced right from the
+ * pages image, so they are read with the page_read and put into pipe.
+ */
+static int read_page_pipe_iov(struct page_read *pr, struct iovec *iov, int p, void *buf)
+{
+	unsigned long vaddr = (unsigned long)iov->iov_base;
+	unsigned long end = vaddr + iov->iov_len;
+
+	while (vaddr < end) {
+		unsigned long pe_end, nr;
+
+		if (pr->seek_pagemap(pr, vaddr) <= 0) {
+			pr_err("No pages at %lx\n", vaddr);
+			return -1;
+		}
+
+		pe_end = pr->pe->vaddr + pagemap_len(pr->pe);
+		nr = (min(pe_end, end) - vaddr) / PAGE_SIZE;
+		nr = min_t(unsigned long, nr, FILL_BUF_PAGES);
+
+		if (pr->read_pages(pr, vaddr, nr, buf, 0) < 0)
+			return -1;
+
+		if (write_all(p, buf, nr * PAGE_SIZE) != nr * PAGE_SIZE) {
+			pr_perror("Can't write pages into pipe");
+			return -1;
+		}
+
+		vaddr += nr * PAGE_SIZE;
+	}
+
+	return 0;
+}
+
+static unsigned int fill_ppb_flags(PagemapEntry *pe)
+{
+	if (!pagemap_lazy(pe))
+		return 0;
+
+	/* The hot pages are pushed first, see PS_IOV_PUSH */
+	return pagemap_hot(pe) ? PPB_LAZY | PPB_HOT : PPB_LAZY;
+}
+
 static int fill_page_pipe(struct page_read *pr, struct page_pipe *pp)
 {
 	struct page_pipe_buf *ppb;
+	void *buf = NULL;
+	loff_t off;
 	int i, ret;
 
 	pr->reset(pr);
@@ -1315,11 +2753,15 @@ static int fill_page_pipe(struct page_read *pr, struct page_pipe *pp)
 	while (pr->advance(pr)) {
 		unsigned long vaddr = pr->pe->vaddr;
 
+		/* Zero pages are not requested, uffd zero-fills them */
+		if (pagemap_zero(pr->pe))
+			continue;
+
 		for (i = 0; i < pr->pe->nr_pages; i++, vaddr += PAGE_SIZE) {
 			if (pagemap_in_parent(pr->pe))
 				ret = page_pipe_add_hole(pp, vaddr, PP_HOLE_PARENT);
 			else
-				ret = page_pipe_add_page(pp, vaddr, pagemap_lazy(pr->pe) ? PPB_LAZY : 0);
+				ret = page_pipe_add_page(pp, vaddr, fill_ppb_flags(pr->pe));
 			if (ret) {
 				pr_err("Failed adding page at %lx\n", vaddr);
 				return -1;
@@ -1327,11 +2769,27 @@ static int fill_page_pipe(struct page_read *pr, struct page_pipe *pp)
 		}
 	}
 
+	if (pr->frames || pr->store) {
+		buf = xmalloc(FILL_BUF_PAGES * PAGE_SIZE);
+		if (!buf)
+			return -1;
+		pr->reset(pr);
+	}
+
+	ret = 0;
+	off = img_raw_off(pr->pi);
 	list_for_each_entry(ppb, &pp->bufs, l) {
 		for (i = 0; i < ppb->nr_segs; i++) {
 			struct iovec iov = ppb->iov[i];
 
-			if (splice(img_raw_fd(pr->pi), NULL, ppb->p[1], NULL, iov.iov_len, SPLICE_F_MOVE) !=
+			if (buf) {
+				ret = read_page_pipe_iov(pr, &iov, ppb->p[1], buf);
+				if (ret)
+					goto out;
+				continue;
+			}
+
+			if (splice(img_raw_fd(pr->pi), &off, ppb->p[1], NULL, iov.iov_len, SPLICE_F_MOVE) !=
 			    iov.iov_len) {
 				pr_perror("Splice failed");
 				return -1;
@@ -1340,8 +2798,9 @@ static int fill_page_pipe(struct page_read *pr, struct page_pipe *pp)
 	}
 
 	debug_show_page_pipe(pp);
-
-	return 0;
+out:
+	xfree(buf);
+	return ret;
 }
 
 static int page_pipe_from_pagemap(struct page_pipe **pp, int pid)
@@ -1442,9 +2901,24 @@ no_server:
 		}
 	}
 
+	/*
+	 * Keep the listening socket for the data connections, the dump
+	 * side may ask for them with --ps-streams.
+	 */
+	if (sk >= 0 && !opts.lazy_pages && !opts.tls) {
+		ps_listen_sk = dup(sk);
+		if (ps_listen_sk < 0) {
+			pr_perror("Can't keep page server socket");
+			close(sk);
+			return -1;
+		}
+	}
+
 	ret = run_tcp_server(daemon_mode, &ask, cfd, sk);
-	if (ret != 0)
+	if (ret != 0) {
+		close_safe(&ps_listen_sk);
 		return ret > 0 ? 0 : -1;
+	}
 
 	if (tls_x509_init(ask, true)) {
 		close_safe(&sk);
@@ -1489,11 +2963,70 @@ out:
 	return 0;
 }
 
+/*
+ * With --ps-streams the main connection is followed by the data ones,
+ * each introducing itself with PS_IOV_STREAM. The page server accepts
+ * them on its listening socket once it gets PS_IOV_STREAMS.
+ */
+static int connect_page_server_streams(void)
+{
+	struct page_server_iov pi = {
+		.cmd = PS_IOV_STREAMS,
+		.nr_pages = opts.ps_streams,
+	};
+	int i;
+
+	if (opts.ps_streams <= 1)
+		return 0;
+
+	/* The data connections prove they belong to this one with it */
+	if (getrandom(&pi.vaddr, sizeof(pi.vaddr), 0) != sizeof(pi.vaddr)) {
+		pr_perror("Can't generate the streams cookie");
+		return -1;
+	}
+
+	if (send_psi(page_server_sk, &pi))
+		return -1;
+
+	for (i = 0; i < opts.ps_streams; i++) {
+		int sk;
+
+		sk = setup_tcp_client(opts.addr);
+		if (sk == -1)
+			return -1;
+		ps_data_sk[nr_ps_data_sk++] = sk;
+
+		pi.cmd = PS_IOV_STREAM;
+		pi.nr_pages = i;
+		if (send_psi(sk, &pi))
+			return -1;
+	}
+
+	pr_info("Sending pages over %d streams\n", nr_ps_data_sk);
+	return 0;
+}
+
+static void disconnect_page_server_streams(void)
+{
+	while (nr_ps_data_sk > 0)
+		close_safe(&ps_data_sk[--nr_ps_data_sk]);
+}
+
 int connect_to_page_server_to_send(void)
 {
-	return connect_to_page_server();
+	if (connect_to_page_server())
+		return -1;
+
+	if (opts.use_page_server && connect_page_server_streams()) {
+		disconnect_page_server_streams();
+		return -1;
+	}
+
+	return 0;
 }
 
+static int page_server_stop_push(void);
+
 int disconnect_from_page_server(void)
 {
 	struct page_server_iov pi = {};
@@ -1508,6 +3041,9 @@ int disconnect_from_page_server(void)
 
 	pr_info("Disconnect from the page server\n");
 
+	if (page_server_stop_push())
+		goto out;
+
 	if (opts.ps_socket != -1)
 		/*
 		 * The socket might not get closed (held by
@@ -1529,6 +3065,7 @@ int disconnect_from_page_server(void)
 	ret = 0;
 out:
 	tls_terminate_session(ret != 0);
+	disconnect_page_server_streams();
 	close_safe(&page_server_sk);
 
 	return ret ?: status;
@@ -1627,18 +3164,81 @@ static int page_server_read(struct ps_async_read *ar, int flags)
 	return ar->complete((int)ar->pi.dst_id, (unsigned long)ar->pi.vaddr, (int)ar->pi.nr_pages, ar->priv);
 }
 
+/*
+ * The pages pushed by the page server (see PS_IOV_PUSH) come in between
+ * the answers, so the header is read first to find out which read the
+ * pages that follow it belong to.
+ */
+#define PS_PUSH_PAGES 64
+
+static struct ps_async_read ps_push_ar;
+static bool ps_pushing;
+
+static struct page_server_iov ps_hdr;
+static unsigned long ps_hdr_rb;
+static struct ps_async_read *ps_cur_read;
+
+static int page_server_read_hdr(void)
+{
+	struct ps_async_read *ar;
+	int ret;
+
+	ret = __recv(page_server_sk, (void *)&ps_hdr + ps_hdr_rb, sizeof(ps_hdr) - ps_hdr_rb, MSG_DONTWAIT);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		pr_perror("Error reading data from page server");
+		return -1;
+	}
+
+	ps_hdr_rb += ret;
+	if (ps_hdr_rb < sizeof(ps_hdr))
+		return 0;
+	ps_hdr_rb = 0;
+
+	if (decode_ps_cmd(ps_hdr.cmd) != PS_IOV_PUSH) {
+		if (list_empty(&async_reads)) {
+			pr_err("Unexpected pages at %" PRIx64 " from page server\n", ps_hdr.vaddr);
+			return -1;
+		}
+		ar = list_first_entry(&async_reads, struct ps_async_read, l);
+	} else if (!ps_hdr.nr_pages) {
+		pr_info("Page server has finished the push\n");
+		ps_pushing = false;
+		return 0;
+	} else if (ps_hdr.nr_pages > PS_PUSH_PAGES) {
+		pr_err("Too many pages pushed (%u)\n", ps_hdr.nr_pages);
+		return -1;
+	} else {
+		ar = &ps_push_ar;
+		init_ps_async_read(ar, ar->pages, PS_PUSH_PAGES, ar->complete, ar->priv);
+	}
+
+	ar->pi = ps_hdr;
+	ar->rb = sizeof(ps_hdr);
+	ps_cur_read = ar;
+	return 0;
+}
+
 static int page_server_async_read(struct epoll_rfd *f)
 {
 	struct ps_async_read *ar;
 	int ret;
 
-	BUG_ON(list_empty(&async_reads));
-	ar = list_first_entry(&async_reads, struct ps_async_read, l);
+	if (!ps_cur_read) {
+		if (page_server_read_hdr())
+			return -1;
+		if (!ps_cur_read)
+			return 0;
+	}
+
+	ar = ps_cur_read;
 	ret = page_server_read(ar, MSG_DONTWAIT);
 
 	if (ret > 0)
 		return 0;
-	if (!ret) {
+	ps_cur_read = NULL;
+	if (!ret && ar != &ps_push_ar) {
 		list_del(&ar->l);
 		xfree(ar);
 	}
@@ -1666,28 +3266,181 @@ int connect_to_page_server_to_recv(int epfd)
 	return epoll_add_rfd(epfd, &ps_rfd);
 }
 
+/*
+ * The requests are queued and sent together by flush_remote_pages(),
+ * several of them with a single PS_IOV_GETV. The answers come in the
+ * same order, so the reads can be started right away.
+ */
+static struct page_server_iov ps_getv[PS_GETV_MAX + 1];
+static unsigned int nr_ps_getv;
+
+int flush_remote_pages(void)
+{
+	struct page_server_iov *pi = ps_getv;
+	size_t len;
+
+	if (!nr_ps_getv)
+		return 0;
+
+	if (nr_ps_getv == 1) {
+		pi = &ps_getv[1];
+		len = sizeof(*pi);
+	} else {
+		pi->cmd = PS_IOV_GETV;
+		pi->nr_pages = nr_ps_getv;
+		len = (nr_ps_getv + 1) * sizeof(*pi);
+	}
+
+	/* The batch may not fit into the socket buffer at once */
+	if (send_all(page_server_sk, pi, len)) {
+		pr_err("Can't send %u page requests to server\n", nr_ps_getv);
+		return -1;
+	}
+
+	nr_ps_getv = 0;
+	tcp_nodelay(page_server_sk, true);
+	return 0;
+}
+
 int request_remote_pages(unsigned long img_id, unsigned long addr, int nr_pages)
+{
+	struct page_server_iov *pi;
+
+	if (nr_ps_getv == PS_GETV_MAX && flush_remote_pages())
+		return -1;
+
+	pi = &ps_getv[++nr_ps_getv];
+	pi->cmd = PS_IOV_GET;
+	pi->nr_pages = nr_pages;
+	pi->vaddr = addr;
+	pi->dst_id = img_id;
+
+	return 0;
+}
+
+int page_server_start_push(ps_async_read_complete complete)
 {
 	struct page_server_iov pi = {
-		.cmd = PS_IOV_GET,
-		.nr_pages = nr_pages,
-		.vaddr = addr,
-		.dst_id = img_id,
+		.cmd = PS_IOV_PUSH,
+		.nr_pages = PS_PUSH_PAGES,
 	};
+	void *buf;
+
+	buf = xmalloc(PS_PUSH_PAGES * PAGE_SIZE);
+	if (!buf)
+		return -1;
+
+	init_ps_async_read(&ps_push_ar, buf, PS_PUSH_PAGES, complete, buf);
 
-	/* XXX: why MSG_DONTWAIT here? */
-	if (send_psi_flags(page_server_sk, &pi, MSG_DONTWAIT))
+	if (send_psi(page_server_sk, &pi)) {
+		xfree(buf);
 		return -1;
+	}
 
 	tcp_nodelay(page_server_sk, true);
+	ps_pushing = true;
+	return 0;
+}
+
+bool page_server_pushing(void)
+{
+	return ps_pushing;
+}
+
+static int page_server_skip(void *buf, unsigned long len)
+{
+	while (len) {
+		unsigned long chunk = min_t(unsigned long, len, PS_PUSH_PAGES * PAGE_SIZE);
+
+		if (recv_all(page_server_sk, buf, chunk))
+			return -1;
+		len -= chunk;
+	}
+
 	return 0;
 }
 
+/*
+ * Reads out the rest of the message the async reader has stopped in
+ * the middle of, so that the next one can be found. Nobody waits for
+ * these pages any longer.
+ */
+static int page_server_drain_cur(void *buf)
+{
+	struct ps_async_read *ar = ps_cur_read;
+	unsigned long len;
+
+	if (ps_hdr_rb) {
+		if (recv_all(page_server_sk, (void *)&ps_hdr + ps_hdr_rb, sizeof(ps_hdr) - ps_hdr_rb))
+			return -1;
+		ps_hdr_rb = 0;
+
+		if (decode_ps_cmd(ps_hdr.cmd) == PS_IOV_PUSH && !ps_hdr.nr_pages) {
+			pr_info("Page server has finished the push\n");
+			ps_pushing = false;
+			return 0;
+		}
+		len = ps_hdr.nr_pages * PAGE_SIZE;
+	} else if (ar) {
+		len = sizeof(ar->pi) + min_t(unsigned long, ar->pi.nr_pages, ar->nr_pages) * PAGE_SIZE - ar->rb;
+		ps_cur_read = NULL;
+		if (ar != &ps_push_ar) {
+			list_del(&ar->l);
+			xfree(ar);
+		}
+	} else
+		return 0;
+
+	return page_server_skip(buf, len);
+}
+
+/*
+ * Stops the push before the connection is closed, the pages pushed
+ * till the page server gets it are not needed any more.
+ */
+static int page_server_stop_push(void)
+{
+	struct page_server_iov pi = {
+		.cmd = PS_IOV_PUSH,
+	};
+	void *buf = ps_push_ar.pages;
+
+	if (!ps_pushing)
+		goto out;
+
+	if (page_server_drain_cur(buf))
+		goto out;
+	if (!ps_pushing)
+		goto out;
+
+	if (send_psi(page_server_sk, &pi))
+		goto out;
+	tcp_nodelay(page_server_sk, true);
+
+	while (1) {
+		if (recv_all(page_server_sk, &pi, sizeof(pi)))
+			goto out;
+		if (decode_ps_cmd(pi.cmd) == PS_IOV_PUSH && !pi.nr_pages)
+			break;
+		if (page_server_skip(buf, pi.nr_pages * PAGE_SIZE))
+			goto out;
+	}
+
+	ps_pushing = false;
+out:
+	xfree(buf);
+	ps_push_ar.pages = NULL;
+	return ps_pushing ? -1 : 0;
+}
+
 static int page_server_start_sync_read(void *buf, int nr, ps_async_read_complete complete, void *priv)
 {
 	struct ps_async_read ar;
 	int ret = 1;
 
+	if (flush_remote_pages())
+		return -1;
+
 	init_ps_async_read(&ar, buf, nr, complete, priv);
 	while (ret == 1)
 		ret = page_server_read(&ar, MSG_WAITALL);
@@ -12,6 +12,7 @@
 #include "mem.h"
 #include "kerndat.h"
 #include "fault-injection.h"
+#include "dirty-track.h"
 
 #undef LOG_PREFIX
 #define LOG_PREFIX "pagemap-cache: "
@@ -62,7 +63,8 @@ int pmc_init(pmc_t *pmc, pid_t pid, const struct list_head *vma_head, size_t siz
 	pmc->regs = NULL;
 	pmc->map = NULL;
 
-	if (kdat.has_pagemap_scan && !fault_injected(FI_DONT_USE_PAGEMAP_SCAN)) {
+	/* The write-protection is only reset by PAGEMAP_SCAN */
+	if (kdat.has_pagemap_scan && (dirty_track_wp() || !fault_injected(FI_DONT_USE_PAGEMAP_SCAN))) {
 		pmc->regs = xmalloc(pmc->regs_max_len * sizeof(struct page_region));
 		if (!pmc->regs)
 			goto err;
@@ -140,6 +142,12 @@ static int pmc_fill_cache(pmc_t *pmc, const struct vma_area *vma)
 			if (vma->e->start > high || vma->e->end > high)
 				break;
 
+			/* Don't reset the protection of the untracked ones and vice versa */
+			if (vma->wp_track != pmc->wp) {
+				high = vma->e->start;
+				break;
+			}
+
 			BUG_ON(vma->e->start < low);
 			size_cov += vma_area_len(vma);
 			nr_vmas++;
@@ -177,7 +185,7 @@ int pmc_fill(pmc_t *pmc, u64 start, u64 end)
 	if (pmc->regs) {
 		struct pm_scan_arg args = {
 			.size = sizeof(struct pm_scan_arg),
-			.flags = 0,
+			.flags = pmc->wp ? PM_SCAN_WP_MATCHING : 0,
 			.start = pmc->start,
 			.end = pmc->end,
 			.vec = (long)pmc->regs,
@@ -190,7 +198,8 @@ int pmc_fill(pmc_t *pmc, u64 start, u64 end)
 			.category_inverted = PAGE_IS_PFNZERO | PAGE_IS_FILE,
 			.category_mask = PAGE_IS_PFNZERO | PAGE_IS_FILE,
 			.category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED,
-			.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED | PAGE_IS_SOFT_DIRTY,
+			.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED |
+				       (pmc->wp ? PAGE_IS_WRITTEN : PAGE_IS_SOFT_DIRTY),
 		};
 		long ret;
 
@@ -216,6 +225,17 @@ int pmc_fill(pmc_t *pmc, u64 start, u64 end)
 
 int pmc_get_map(pmc_t *pmc, const struct vma_area *vma)
 {
+	/*
+	 * With the write-protection tracking the pages written since the
+	 * last scan are known only for the VMAs that the tracker has
+	 * registered before, all the others are dumped as a whole.
+	 */
+	pmc->wp = vma->wp_track;
+	if (!dirty_track_wp())
+		pmc->dirty = PAGE_IS_SOFT_DIRTY;
+	else
+		pmc->dirty = vma->wp_written ? PAGE_IS_WRITTEN : 0;
+
 	/* Hit */
 	if (likely(pmc->start <= vma->e->start && pmc->end >= vma->e->end))
 		return 0;
@@ -8,13 +8,17 @@
 #include "types.h"
 #include "image.h"
 #include "cr_options.h"
+#include "kerndat.h"
 #include "servicefd.h"
 #include "pagemap.h"
 #include "restorer.h"
 #include "rst-malloc.h"
 #include "page-xfer.h"
+#include "compress.h"
 
 #include "fault-injection.h"
+#include "rst_info.h"
+#include "uring.h"
 #include "xmalloc.h"
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
@@ -38,6 +42,21 @@ struct page_read_iov {
 	struct list_head l;
 };
 
+/*
+ * Compressed pages image can't be read at pi_off, since the frames
+ * sizes differ from the sizes of the pages they hold. Instead, the
+ * data offsets of all pagemap entries are calculated on open, and the
+ * last decompressed frame is kept, as pages are usually read in order.
+ */
+struct page_read_frames {
+	void *raw;   /* decompressed frame */
+	void *cdata; /* compressed frame */
+	int pme;     /* pagemap entry the frame belongs to */
+	unsigned int idx;
+	off_t off; /* offset of the frame in pi file */
+	off_t offs[];
+};
+
 static inline bool can_extend_bunch(struct iovec *bunch, unsigned long off, unsigned long len)
 {
 	return /* The next region is the continuation of the existing */
@@ -51,6 +70,16 @@ static int punch_hole(struct page_read *pr, unsigned long off, unsigned long len
 	int ret;
 	struct iovec *bunch = &pr->bunch;
 
+	if (pr->frames) {
+		pr_warn_once("Can't dedup compressed pages images\n");
+		return 0;
+	}
+
+	if (pr->store) {
+		pr_warn_once("Can't dedup pages store, the pages may be shared\n");
+		return 0;
+	}
+
 	if (!cleanup && can_extend_bunch(bunch, off, len)) {
 		pr_debug("pr%lu-%u:Extend bunch len from %zu to %lu\n", pr->img_id, pr->id, bunch->iov_len,
 			 bunch->iov_len + len);
@@ -96,7 +125,7 @@ int dedup_one_iovec(struct page_read *pr, unsigned long off, unsigned long len)
 		if (!pr->pe)
 			return -1;
 		piov_end = pr->pe->vaddr + pagemap_len(pr->pe);
-		if (!pagemap_in_parent(pr->pe)) {
+		if (!pagemap_in_parent(pr->pe) && !pagemap_zero(pr->pe)) {
 			ret = punch_hole(pr, pr->pi_off, min(piov_end, iov_end) - off, false);
 			if (ret == -1)
 				return ret;
@@ -129,10 +158,21 @@ static int advance(struct page_read *pr)
 
 	pr->pe = pr->pmes[pr->curr_pme];
 	pr->cvaddr = pr->pe->vaddr;
+	pr->pi_off = img_raw_next(pr->pi, pr->pi_off);
 
 	return 1;
 }
 
+/*
+ * Makes the next ->advance() return the current entry again, for the
+ * readers that look at an entry before deciding to take it.
+ */
+void pagemap_unadvance(struct page_read *pr)
+{
+	BUG_ON(pr->curr_pme < 0);
+	pr->curr_pme--;
+}
+
 static void skip_pagemap_pages(struct page_read *pr, unsigned long len)
 {
 	if (!len)
@@ -445,6 +485,141 @@ static int maybe_read_page_img_streamer(struct page_read *pr, unsigned long vadd
 	return ret;
 }
 
+static int pread_frame(int fd, void *buf, size_t len, off_t off)
+{
+	size_t curr = 0;
+	ssize_t ret;
+
+	while (curr < len) {
+		ret = pread(fd, buf + curr, len - curr, off + curr);
+		if (ret < 1) {
+			pr_perror("Can't read compressed pages %zd", ret);
+			return -1;
+		}
+		curr += ret;
+	}
+
+	return 0;
+}
+
+static void *read_frame(struct page_read *pr, unsigned int idx)
+{
+	struct page_read_frames *f = pr->frames;
+	PagemapEntry *pe = pr->pe;
+	unsigned int i = 0;
+	size_t len, raw_len;
+	off_t off;
+	void *buf;
+
+	if (f->pme == pr->curr_pme && f->idx == idx)
+		return f->raw;
+
+	off = f->offs[pr->curr_pme];
+	if (f->pme == pr->curr_pme && f->idx < idx) {
+		/* Continue from the cached frame, not from the entry start */
+		off = f->off;
+		i = f->idx;
+	}
+	for (; i < idx; i++)
+		off += pe->frames[i];
+
+	raw_len = min_t(unsigned long, COMPRESS_FRAME_PAGES, pe->nr_pages - idx * COMPRESS_FRAME_PAGES) * PAGE_SIZE;
+	len = pe->frames[idx];
+	buf = len == raw_len ? f->raw : f->cdata;
+
+	pr_debug("\tpr%lu-%u Read frame %u of %" PRIx64 " at %jx (%zu bytes)\n", pr->img_id, pr->id, idx, pe->vaddr,
+		 (intmax_t)off, len);
+
+	/* The cached frame is invalid from now on */
+	f->pme = -1;
+	if (pread_frame(img_raw_fd(pr->pi), buf, len, off))
+		return NULL;
+	if (buf != f->raw && decompress_frame(f->raw, raw_len, buf, len))
+		return NULL;
+
+	f->pme = pr->curr_pme;
+	f->idx = idx;
+	f->off = off;
+
+	return f->raw;
+}
+
+/*
+ * Reads pages from a pages image with compressed entries. All the
+ * reads are synchronous, since the data has to be decompressed
+ * before it gets into the buffer anyway.
+ */
+static int maybe_read_page_compressed(struct page_read *pr, unsigned long vaddr, int nr, void *buf, unsigned flags)
+{
+	PagemapEntry *pe = pr->pe;
+	unsigned long pg = (vaddr - pe->vaddr) / PAGE_SIZE;
+	unsigned long len = nr * PAGE_SIZE;
+	int ret = 0, left = nr;
+
+	if (!pagemap_compressed(pe)) {
+		if (pread_frame(img_raw_fd(pr->pi), buf, len, pr->frames->offs[pr->curr_pme] + pg * PAGE_SIZE))
+			return -1;
+		goto complete;
+	}
+
+	while (left) {
+		unsigned int in = pg % COMPRESS_FRAME_PAGES;
+		int n = min_t(int, left, COMPRESS_FRAME_PAGES - in);
+		void *frame;
+
+		frame = read_frame(pr, pg / COMPRESS_FRAME_PAGES);
+		if (!frame)
+			return -1;
+
+		memcpy(buf, frame + in * PAGE_SIZE, n * PAGE_SIZE);
+		buf += n * PAGE_SIZE;
+		pg += n;
+		left -= n;
+	}
+
+complete:
+	if (pr->io_complete)
+		ret = pr->io_complete(pr, vaddr, nr);
+
+	pr->pi_off += len;
+
+	return ret;
+}
+
+/*
+ * Reads pages of PE_DEDUP entries from the pages store. The pages
+ * that go one after another in the store are read with one call.
+ */
+static int maybe_read_page_store(struct page_read *pr, unsigned long vaddr, int nr, void *buf, unsigned flags)
+{
+	PagemapEntry *pe = pr->pe;
+	unsigned long pg = (vaddr - pe->vaddr) / PAGE_SIZE;
+	int ret = 0, left = nr;
+
+	while (left) {
+		int n = 1;
+
+		while (n < left && pe->store[pg + n] == pe->store[pg] + n)
+			n++;
+
+		pr_debug("\tpr%lu-%u Read %d pages from store at %u\n", pr->img_id, pr->id, n, pe->store[pg]);
+		if (pread_frame(img_raw_fd(pr->store), buf, n * PAGE_SIZE,
+				img_raw_off(pr->store) + (off_t)pe->store[pg] * PAGE_SIZE))
+			return -1;
+
+		buf += n * PAGE_SIZE;
+		pg += n;
+		left -= n;
+	}
+
+	if (pr->io_complete)
+		ret = pr->io_complete(pr, vaddr, nr);
+
+	pr->pi_off += nr * PAGE_SIZE;
+
+	return ret;
+}
+
 static int read_page_complete(unsigned long img_id, unsigned long vaddr, int nr_pages, void *priv)
 {
 	int ret = 0;
@@ -482,6 +657,8 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 	if (pagemap_in_parent(pr->pe)) {
 		if (read_parent_page(pr, vaddr, nr, buf, flags) < 0)
 			return -1;
+	} else if (pagemap_zero(pr->pe)) {
+		memset(buf, 0, nr * PAGE_SIZE);
 	} else {
 		if (pr->maybe_read_page(pr, vaddr, nr, buf, flags) < 0)
 			return -1;
@@ -527,12 +704,113 @@ static void advance_piov(struct page_read_iov *piov, ssize_t len)
 	pr_debug("Advanced iov %zu bytes, %d->%d iovs, %zu tail\n", olen, onr, piov->nr, len);
 }
 
+static u64 clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Reads all the async requests with io_uring, the big ones are split
+ * into URING_READ_CHUNK pieces to keep the queue deep.
+ */
+static int uring_async_reads(struct page_read *pr, int fd)
+{
+	struct page_read_iov *piov, *n;
+	int i, ret = 0;
+
+	list_for_each_entry(piov, &pr->async, l) {
+		off_t off = piov->from;
+
+		for (i = 0; i < piov->nr && !ret; i++) {
+			void *buf = piov->to[i].iov_base;
+			unsigned long len = piov->to[i].iov_len;
+
+			while (len) {
+				unsigned long chunk = min_t(unsigned long, len, URING_READ_CHUNK);
+
+				ret = uring_read(fd, buf, chunk, off);
+				if (ret)
+					break;
+
+				buf += chunk;
+				off += chunk;
+				len -= chunk;
+			}
+		}
+	}
+
+	/* Even on error, the buffers may be still read into */
+	if (uring_wait_fd(fd) || ret) {
+		pr_err("Can't read async pr pages\n");
+		return -1;
+	}
+
+	list_for_each_entry_safe(piov, n, &pr->async, l) {
+		list_del(&piov->l);
+		xfree(piov->to);
+		xfree(piov);
+	}
+
+	return 0;
+}
+
+/*
+ * The io_uring workers are threads of the task that has submitted the
+ * requests and stay there till it exits. Not to leave them in the
+ * restored tasks, the requests are submitted by a helper that shares
+ * the memory and the files with the task, and which exits when they
+ * are complete. If there's no ring, the requests stay queued.
+ */
+static int uring_async_reads_fn(void *arg)
+{
+	struct page_read *pr = arg;
+	int ret;
+
+	if (!uring_enabled())
+		return 0;
+
+	ret = uring_async_reads(pr, img_raw_fd(pr->pi));
+	uring_close();
+	return ret ? 1 : 0;
+}
+
+static int uring_async_reads_helper(struct page_read *pr)
+{
+	int ret;
+
+	/* The helper takes a pid, which other tasks may restore */
+	if (task_entries)
+		lock_last_pid();
+	ret = call_in_child_process(uring_async_reads_fn, pr);
+	if (task_entries)
+		unlock_last_pid();
+
+	return ret;
+}
+
 static int process_async_reads(struct page_read *pr)
 {
 	int fd, ret = 0;
 	struct page_read_iov *piov, *n;
+	u64 bytes = 0, start;
 
 	fd = img_raw_fd(pr->pi);
+
+	list_for_each_entry(piov, &pr->async, l)
+		bytes += piov->end - piov->from;
+	start = clock_ns();
+
+	/* Holes are punched after each read with --auto-dedup */
+	if (bytes && !opts.auto_dedup && opts.io_uring && kdat.has_io_uring) {
+		if (uring_async_reads_helper(pr))
+			return -1;
+		if (list_empty(&pr->async))
+			goto out;
+	}
+
 	list_for_each_entry_safe(piov, n, &pr->async, l) {
 		ssize_t ret;
 		struct iovec *iovs = piov->to;
@@ -583,6 +861,10 @@ static int process_async_reads(struct page_read *pr)
 		xfree(piov);
 	}
 
+out:
+	if (bytes && task_entries)
+		account_pages_read(task_entries, bytes, start, clock_ns());
+
 	if (pr->parent)
 		ret = process_async_reads(pr->parent);
 
@@ -615,12 +897,24 @@ static void close_page_read(struct page_read *pr)
 
 	if (pr->pmes)
 		free_pagemaps(pr);
+
+	if (pr->frames) {
+		xfree(pr->frames->raw);
+		xfree(pr->frames->cdata);
+		xfree(pr->frames);
+		pr->frames = NULL;
+	}
+
+	if (pr->store) {
+		close_image(pr->store);
+		pr->store = NULL;
+	}
 }
 
 static void reset_pagemap(struct page_read *pr)
 {
 	pr->cvaddr = 0;
-	pr->pi_off = 0;
+	pr->pi_off = img_raw_off(pr->pi);
 	pr->curr_pme = -1;
 	pr->pe = NULL;
 
@@ -753,6 +1047,121 @@ free_pagemaps:
 	return -1;
 }
 
+static int init_pagemap_frames(struct page_read *pr)
+{
+	struct page_read_frames *f;
+	off_t off = img_raw_off(pr->pi);
+	int i;
+
+	for (i = 0; i < pr->nr_pmes; i++)
+		if (pagemap_compressed(pr->pmes[i]))
+			break;
+	if (i == pr->nr_pmes)
+		return 0;
+
+	if (!compress_supported()) {
+		pr_err("Pages image %u is compressed, but CRIU is built without zstd\n", pr->pages_img_id);
+		return -1;
+	}
+
+	if (opts.stream) {
+		pr_err("Compressed pages image %u can't be streamed\n", pr->pages_img_id);
+		return -1;
+	}
+
+	f = xzalloc(sizeof(*f) + pr->nr_pmes * sizeof(f->offs[0]));
+	if (!f)
+		return -1;
+
+	f->pme = -1;
+	f->raw = xmalloc(COMPRESS_FRAME_PAGES * PAGE_SIZE);
+	f->cdata = xmalloc(COMPRESS_FRAME_PAGES * PAGE_SIZE);
+	pr->frames = f;
+	if (!f->raw || !f->cdata)
+		return -1;
+
+	for (i = 0; i < pr->nr_pmes; i++) {
+		PagemapEntry *pe = pr->pmes[i];
+		unsigned int j, raw_len;
+
+		off = img_raw_next(pr->pi, off);
+		f->offs[i] = off;
+		if (!pagemap_present(pe))
+			continue;
+
+		if (!pagemap_compressed(pe)) {
+			off += pagemap_len(pe);
+			continue;
+		}
+
+		if (pe->n_frames != DIV_ROUND_UP(pe->nr_pages, COMPRESS_FRAME_PAGES)) {
+			pr_err("Bad number of frames %zu for %" PRIx64 ":%u\n", pe->n_frames, pe->vaddr, pe->nr_pages);
+			return -1;
+		}
+
+		for (j = 0; j < pe->n_frames; j++) {
+			raw_len = min_t(unsigned int, COMPRESS_FRAME_PAGES, pe->nr_pages - j * COMPRESS_FRAME_PAGES);
+			if (!pe->frames[j] || pe->frames[j] > raw_len * PAGE_SIZE) {
+				pr_err("Bad frame %u size %u for %" PRIx64 "\n", j, pe->frames[j], pe->vaddr);
+				return -1;
+			}
+			off += pe->frames[j];
+		}
+	}
+
+	pr_info("Pages image %u is compressed, %jd bytes of data\n", pr->pages_img_id, (intmax_t)off);
+	return 0;
+}
+
+/*
+ * With --dedup-pages all the pages of an image are in the pages store,
+ * so the image either has no PE_DEDUP entries or has all of them.
+ */
+static int init_pagemap_store(int dfd, struct page_read *pr)
+{
+	int i, nr_dedup = 0, nr_present = 0;
+
+	for (i = 0; i < pr->nr_pmes; i++) {
+		PagemapEntry *pe = pr->pmes[i];
+
+		if (!pagemap_present(pe))
+			continue;
+
+		nr_present++;
+		if (!pagemap_dedup(pe))
+			continue;
+
+		nr_dedup++;
+		if (pe->n_store != pe->nr_pages || pagemap_compressed(pe)) {
+			pr_err("Bad stored entry %" PRIx64 ":%u (%zu pages)\n", pe->vaddr, pe->nr_pages, pe->n_store);
+			return -1;
+		}
+	}
+
+	if (!nr_dedup)
+		return 0;
+
+	if (nr_dedup != nr_present) {
+		pr_err("Pages image %u has both stored and own pages\n", pr->pages_img_id);
+		return -1;
+	}
+
+	if (opts.stream) {
+		pr_err("Pages store can't be streamed\n");
+		return -1;
+	}
+
+	pr->store = open_image_at(dfd, CR_FD_PAGES_STORE, O_RSTR);
+	if (!pr->store)
+		return -1;
+	if (empty_image(pr->store)) {
+		pr_err("No pages store for pages image %u\n", pr->pages_img_id);
+		return -1;
+	}
+
+	return 0;
+}
+
 int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int pr_flags)
 {
 	int flags, i_typ;
@@ -791,6 +1200,8 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 	pr->bunch.iov_len = 0;
 	pr->bunch.iov_base = NULL;
 	pr->pmes = NULL;
+	pr->frames = NULL;
+	pr->store = NULL;
 	pr->pieok = false;
 
 	pr->pmi = open_image_at(dfd, i_typ, O_RSTR, img_id);
@@ -812,8 +1223,10 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 		close_page_read(pr);
 		return -1;
 	}
+	pr->pi_off = img_raw_off(pr->pi);
 
-	if (init_pagemaps(pr)) {
+	/* The remote pages come from page server, the store is there as well */
+	if (init_pagemaps(pr) || init_pagemap_frames(pr) || (!remote && init_pagemap_store(dfd, pr))) {
 		close_page_read(pr);
 		return -1;
 	}
@@ -833,6 +1246,10 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 		pr->maybe_read_page = maybe_read_page_remote;
 	else if (opts.stream)
 		pr->maybe_read_page = maybe_read_page_img_streamer;
+	else if (pr->frames)
+		pr->maybe_read_page = maybe_read_page_compressed;
+	else if (pr->store)
+		pr->maybe_read_page = maybe_read_page_store;
 	else {
 		pr->maybe_read_page = maybe_read_page_local;
 		if (!pr->parent && !opts.lazy_pages)
@@ -8,6 +8,7 @@
 #include <sys/uio.h>
 
 #include "linux/rseq.h"
+#include "linux/userfaultfd.h"
 
 #include "common/config.h"
 #include "int.h"
@@ -651,6 +652,38 @@ static int parasite_get_proc_fd(void)
 	return ret;
 }
 
+/*
+ * Userfaultfd works on the memory of the process that creates it, so
+ * the one for tracking the task's memory is created here and handed
+ * over to criu, see dirty-track.c
+ */
+static int parasite_get_uffd(void)
+{
+	struct uffdio_api api = {
+		.api = UFFD_API,
+		.features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED,
+	};
+	int uffd, ret, tsock;
+
+	uffd = sys_userfaultfd(O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (uffd < 0) {
+		pr_err("Can't create userfaultfd (%d)\n", uffd);
+		return -1;
+	}
+
+	ret = sys_ioctl(uffd, UFFDIO_API, (unsigned long)&api);
+	if (ret < 0) {
+		pr_err("Can't enable userfaultfd write-protection (%d)\n", ret);
+		sys_close(uffd);
+		return -1;
+	}
+
+	tsock = parasite_get_rpc_sock();
+	ret = send_fd(tsock, NULL, 0, uffd);
+	sys_close(uffd);
+	return ret;
+}
+
 static inline int tty_ioctl(int fd, int cmd, int *arg)
 {
 	int ret;
@@ -893,6 +926,9 @@ int parasite_daemon_cmd(int cmd, void *args)
 	case PARASITE_CMD_DUMP_CGROUP:
 		ret = parasite_dump_cgroup(args);
 		break;
+	case PARASITE_CMD_GET_UFFD:
+		ret = parasite_get_uffd();
+		break;
 	default:
 		pr_err("Unknown command in parasite daemon thread leader: %d\n", cmd);
 		ret = -1;
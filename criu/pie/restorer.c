@@ -1525,6 +1525,31 @@ static ssize_t preadv_limited(int fd, struct iovec *iovs, int nr, off_t offs, si
 	return ret;
 }
 
+static u64 clock_ns(void)
+{
+	struct timespec ts;
+
+	if (sys_clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u64 vma_ios_size(struct task_restore_args *args)
+{
+	struct restore_vma_io *rio = args->vma_ios;
+	u64 size = 0;
+	int i, j;
+
+	for (i = 0; i < args->vma_ios_n; i++) {
+		for (j = 0; j < rio->nr_iovs; j++)
+			size += rio->iovs[j].iov_len;
+		rio = ((void *)rio) + RIO_SIZE(rio->nr_iovs);
+	}
+
+	return size;
+}
+
 /*
  * In the worst case buf size should be:
  *   sizeof(struct inotify_event) * 2 + PATH_MAX
@@ -1630,6 +1655,7 @@ __visible long __export_restore_task(struct task_restore_args *args)
 	pid_t my_pid = sys_getpid();
 	rt_sigaction_t act;
 	bool has_vdso_proxy;
+	u64 pages_read, read_start;
 
 	bootstrap_start = args->bootstrap_start;
 	bootstrap_len = args->bootstrap_len;
@@ -1801,10 +1827,34 @@ __visible long __export_restore_task(struct task_restore_args *args)
 		}
 	}
 
+	/*
+	 * The VMAs with the huge pages enabled get them before the contents
+	 * is read, so that the pages are put into the huge pages right away
+	 * rather than waiting for khugepaged. The premapped ones are moved
+	 * here from an area, that isn't aligned to the huge pages, so their
+	 * pages stay small. All the madvise bits are restored below.
+	 */
+	for (i = 0; i < args->vmas_n; i++) {
+		vma_entry = args->vmas + i;
+
+		if (!vma_entry_is(vma_entry, VMA_AREA_REGULAR) || vma_entry_is(vma_entry, VMA_PREMMAPED))
+			continue;
+
+		if (!vma_entry_has_thp(vma_entry))
+			continue;
+
+		ret = sys_madvise(vma_entry->start, vma_entry_len(vma_entry), MADV_HUGEPAGE);
+		if (ret)
+			pr_debug("Can't enable huge pages at %" PRIx64 " (%ld)\n", vma_entry->start, ret);
+	}
+
 	/*
 	 * Now read the contents (if any)
 	 */
 
+	pages_read = vma_ios_size(args);
+	read_start = clock_ns();
+
 	rio = args->vma_ios;
 	for (i = 0; i < args->vma_ios_n; i++) {
 		struct iovec *iovs = rio->iovs;
@@ -1854,6 +1904,9 @@ __visible long __export_restore_task(struct task_restore_args *args)
 		rio = ((void *)rio) + RIO_SIZE(rio->nr_iovs);
 	}
 
+	if (pages_read)
+		account_pages_read(task_entries_local, pages_read, read_start, clock_ns());
+
 	if (args->vma_ios_fd != -1)
 		sys_close(args->vma_ios_fd);
 
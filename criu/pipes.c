@@ -391,6 +391,7 @@ struct collect_image_info pipe_data_cinfo = {
 	.pb_type = PB_PIPE_DATA,
 	.priv_size = sizeof(struct pipe_data_rst),
 	.collect = collect_pipe_data,
+	.flags = COLLECT_IMG_DATA,
 };
 
 int dump_one_pipe_data(struct pipe_data_dump *pd, int lfd, const struct fd_parms *p)
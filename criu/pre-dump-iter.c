@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "cr_options.h"
+#include "crtools.h"
+#include "dirty-track.h"
+#include "image.h"
+#include "page.h"
+#include "pre-dump-iter.h"
+#include "stats.h"
+#include "util.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "pre-dump-iter: "
+
+/*
+ * With --pre-dump-iters criu dump pre-dumps the tasks several times
+ * before the final dump, each time writing only the memory changed
+ * since the previous one, and decides by itself when to stop.
+ *
+ * Every pre-dump runs in a child criu, the same way the RPC service
+ * runs them, since the tree is collected and seized from scratch each
+ * time. The child reports the number of pages it has written and hands
+ * the write-protection trackers (--track-mem-mode uffd-wp) back, so
+ * the next iteration and the final dump continue the tracking.
+ *
+ * The pages written by an iteration over the time since the previous
+ * one started give the dirty rate. The pages that the final dump would
+ * have to write are those dirtied while the last iteration ran, and
+ * their writing time is the expected downtime. The pre-dumps stop when
+ * it fits into --downtime, or when the iterations stop making the
+ * dirty set smaller, i.e. the tasks dirty the memory as fast as it's
+ * written.
+ */
+
+/* The dirty set should shrink by at least 1/10 per iteration */
+#define PRE_DUMP_SHRINK 10
+
+struct pre_dump_res {
+	unsigned long pages;
+};
+
+struct pre_dump_iter {
+	u64 start;	     /* of the previous iteration */
+	unsigned long pages; /* written by the previous iteration */
+	u64 bytes, time;     /* written by all iterations and how long */
+};
+
+static u64 clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int pre_dump_child(pid_t pid, unsigned int iter, int sk)
+{
+	struct pre_dump_res res;
+	char dir[32], parent[PATH_MAX];
+
+	opts.mode = CR_PRE_DUMP;
+
+	/* The parent paths are relative to the pre-dump's directory */
+	if (iter > 1) {
+		snprintf(parent, sizeof(parent), "../" PRE_DUMP_DIR, iter - 1);
+		SET_CHAR_OPTS(img_parent, parent);
+	} else if (opts.img_parent && opts.img_parent[0] != '/') {
+		snprintf(parent, sizeof(parent), "../%s", opts.img_parent);
+		SET_CHAR_OPTS(img_parent, parent);
+	}
+
+	snprintf(dir, sizeof(dir), PRE_DUMP_DIR, iter);
+	if (open_image_subdir(dir))
+		return -1;
+
+	if (cr_pre_dump_tasks(pid))
+		return -1;
+
+	res.pages = dump_cnt(CNT_PAGES_WRITTEN) + dump_cnt(CNT_SHPAGES_WRITTEN);
+	if (write(sk, &res, sizeof(res)) != sizeof(res)) {
+		pr_perror("Can't send pre-dump results");
+		return -1;
+	}
+
+	return dirty_track_send(sk);
+}
+
+static int pre_dump_once(pid_t pid, unsigned int iter, struct pre_dump_res *res)
+{
+	int sk[2], status, ret = -1;
+	pid_t child;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sk)) {
+		pr_perror("Can't create pre-dump socket");
+		return -1;
+	}
+
+	child = fork();
+	if (child < 0) {
+		pr_perror("Can't fork pre-dump");
+		close(sk[0]);
+		close(sk[1]);
+		return -1;
+	}
+
+	if (child == 0) {
+		close(sk[0]);
+		exit(pre_dump_child(pid, iter, sk[1]) ? 1 : 0);
+	}
+
+	close(sk[1]);
+	if (read(sk[0], res, sizeof(*res)) == sizeof(*res))
+		ret = dirty_track_recv(sk[0]);
+	close(sk[0]);
+
+	if (waitpid(child, &status, 0) != child) {
+		pr_perror("Unable to wait %d", child);
+		return -1;
+	}
+
+	if (status) {
+		pr_err("Pre-dump %u failed (%d)\n", iter, status);
+		return -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Returns true when there's no point in more pre-dumps after the one
+ * that ran from @start till @end and wrote @pages.
+ */
+static bool pre_dump_converged(struct pre_dump_iter *it, unsigned int iter, unsigned long pages, u64 start, u64 end)
+{
+	unsigned long expect;
+	u64 bw, downtime;
+	bool ret = false;
+
+	it->bytes += (u64)pages * PAGE_SIZE;
+	it->time += end - start;
+
+	if (opts.pre_dump_bw)
+		bw = (u64)opts.pre_dump_bw << 20;
+	else
+		bw = it->bytes * NSEC_PER_SEC / max_t(u64, it->time, 1);
+
+	/* The first one writes all the memory, the dirty rate is unknown */
+	if (iter == 1) {
+		pr_info("Pre-dump 1: %lu pages in %" PRIu64 " ms, %" PRIu64 " KB/s\n", pages,
+			(end - start) / NSEC_PER_MSEC, bw >> 10);
+		goto out;
+	}
+
+	expect = pages * (end - start) / max_t(u64, start - it->start, 1);
+	downtime = (u64)expect * PAGE_SIZE * MSEC_PER_SEC / max_t(u64, bw, 1);
+
+	pr_info("Pre-dump %u: %lu pages in %" PRIu64 " ms, %" PRIu64 " KB/s, final dump estimate %lu pages in %" PRIu64
+		" ms\n",
+		iter, pages, (end - start) / NSEC_PER_MSEC, bw >> 10, expect, downtime);
+
+	if (opts.downtime && downtime <= opts.downtime) {
+		pr_info("The final dump fits into %u ms\n", opts.downtime);
+		ret = true;
+	} else if (!pages) {
+		pr_info("No memory changes\n");
+		ret = true;
+	} else if (iter > 2 && pages * PRE_DUMP_SHRINK > it->pages * (PRE_DUMP_SHRINK - 1)) {
+		pr_info("The memory changes don't shrink (%lu -> %lu pages)\n", it->pages, pages);
+		ret = true;
+	}
+out:
+	it->start = start;
+	it->pages = pages;
+	return ret;
+}
+
+int cr_pre_dump_iterate(pid_t pid)
+{
+	struct pre_dump_iter it = {};
+	struct pre_dump_res res;
+	char parent[32];
+	unsigned int iter;
+	u64 start, end;
+
+	for (iter = 1; iter <= opts.pre_dump_iters; iter++) {
+		start = clock_ns();
+		if (pre_dump_once(pid, iter, &res))
+			goto err;
+		end = clock_ns();
+
+		if (pre_dump_converged(&it, iter, res.pages, start, end))
+			break;
+	}
+
+	if (iter > opts.pre_dump_iters)
+		iter = opts.pre_dump_iters;
+
+	pr_info("Dumping after %u pre-dumps\n", iter);
+	snprintf(parent, sizeof(parent), PRE_DUMP_DIR, iter);
+	return relink_image_parent(parent);
+
+err:
+	dirty_track_fini();
+	return -1;
+}
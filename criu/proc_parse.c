@@ -119,7 +119,7 @@ bool handle_vma_plugin(int *fd, struct stat *stat)
 }
 
 static void __parse_vmflags(char *buf, u32 *flags, u64 *madv, int *io_pf,
-			    int *shstk)
+			    int *shstk, int *uffd_wp)
 {
 	char *tok;
 
@@ -166,6 +166,9 @@ static void __parse_vmflags(char *buf, u32 *flags, u64 *madv, int *io_pf,
 		if (_vmflag_match(tok, "ss"))
 			*shstk = 1;
 
+		if (_vmflag_match(tok, "uw"))
+			*uffd_wp = 1;
+
 		/*
 		 * Anything else is just ignored.
 		 */
@@ -177,21 +180,25 @@ static void __parse_vmflags(char *buf, u32 *flags, u64 *madv, int *io_pf,
 void parse_vmflags(char *buf, u32 *flags, u64 *madv, int *io_pf)
 {
 	int shstk = 0;
+	int uffd_wp = 0;
 
-	__parse_vmflags(buf, flags, madv, io_pf, &shstk);
+	__parse_vmflags(buf, flags, madv, io_pf, &shstk, &uffd_wp);
 }
 
 static void parse_vma_vmflags(char *buf, struct vma_area *vma_area)
 {
 	int io_pf = 0;
 	int shstk = 0;
+	int uffd_wp = 0;
 
 	__parse_vmflags(buf, &vma_area->e->flags, &vma_area->e->madv, &io_pf,
-			&shstk);
+			&shstk, &uffd_wp);
 
 	if (shstk)
 		vma_area->e->status |= VMA_AREA_SHSTK;
 
+	vma_area->uffd_wp = uffd_wp;
+
 	/*
 	 * vmsplice doesn't work for VM_IO and VM_PFNMAP mappings, the
 	 * only exception is VVAR area that mapped by the kernel as
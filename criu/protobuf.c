@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <google/protobuf-c/protobuf-c.h>
 
@@ -46,7 +47,7 @@ static char *__image_name(struct cr_img *img, char *image_path, size_t image_pat
  * Don't forget to free memory granted to unpacked object in calling code if needed
  */
 
-int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
+static int pb_read_one_alloc(struct cr_img *img, void **pobj, int type, bool eof, ProtobufCAllocator *allocator)
 {
 	char img_name_buf[PATH_MAX];
 	u8 local[PB_PKOBJ_LOCAL_SIZE];
@@ -95,7 +96,7 @@ int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
 		goto err;
 	}
 
-	*pobj = cr_pb_descs[type].unpack(NULL, size, buf);
+	*pobj = cr_pb_descs[type].unpack(allocator, size, buf);
 	if (!*pobj) {
 		ret = -1;
 		pr_err("Failed unpacking object %p from %s\n", pobj, image_name(img, img_name_buf));
@@ -110,6 +111,11 @@ err:
 	return ret;
 }
 
+int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
+{
+	return pb_read_one_alloc(img, pobj, type, eof, NULL);
+}
+
 /*
  * Writes PB record (header + packed object pointed by @obj)
  * to file @fd, using @getpksize to get packed size and @pack
@@ -165,6 +171,90 @@ err:
 	return ret;
 }
 
+/*
+ * The entries of the images marked with COLLECT_ARENA are kept intact
+ * till criu exits, so instead of malloc-ing every message and all its
+ * fields and submessages one by one, they are unpacked into big chunks
+ * allocated one after another. Nothing is ever freed there, the free
+ * of the allocator does nothing and the messages must be freed (e.g.
+ * on errors) with the allocator they were unpacked with.
+ *
+ * There's an arena per collect worker (see below), the main thread
+ * uses the first one.
+ */
+#define PB_ARENA_CHUNK (1 << 20)
+#define PB_ARENA_ALIGN 16
+
+struct pb_arena {
+	ProtobufCAllocator alloc;
+	void *cur;
+	size_t left;
+	unsigned long nr_chunks;
+};
+
+/* Called from the collect workers too, so no logging here */
+static void *pb_arena_alloc(void *data, size_t size)
+{
+	struct pb_arena *a = data;
+	void *ptr;
+
+	size = round_up(size, PB_ARENA_ALIGN);
+	if (size > a->left) {
+		/* Big objects would waste the rest of the chunk */
+		if (size > PB_ARENA_CHUNK / 4)
+			return malloc(size);
+
+		a->cur = malloc(PB_ARENA_CHUNK);
+		if (!a->cur) {
+			a->left = 0;
+			return NULL;
+		}
+		a->left = PB_ARENA_CHUNK;
+		a->nr_chunks++;
+	}
+
+	ptr = a->cur;
+	a->cur += size;
+	a->left -= size;
+	return ptr;
+}
+
+static void pb_arena_free(void *data, void *ptr)
+{
+}
+
+static struct pb_arena collect_arenas[COLLECT_WORKERS_MAX];
+
+static ProtobufCAllocator *collect_arena(struct collect_image_info *cinfo, unsigned int worker)
+{
+	struct pb_arena *a = &collect_arenas[worker];
+
+	if (!(cinfo->flags & COLLECT_ARENA))
+		return NULL;
+
+	if (!a->alloc.alloc) {
+		a->alloc.alloc = pb_arena_alloc;
+		a->alloc.free = pb_arena_free;
+		a->alloc.allocator_data = a;
+	}
+
+	return &a->alloc;
+}
+
+static unsigned long collect_arena_chunks(void)
+{
+	unsigned long nr = 0;
+	int i;
+
+	for (i = 0; i < COLLECT_WORKERS_MAX; i++)
+		nr += collect_arenas[i].nr_chunks;
+
+	return nr;
+}
+
+/* The submessages of the image being collected are freed with it */
+static ProtobufCAllocator *collect_allocator;
+
 int collect_entry(ProtobufCMessage *msg, struct collect_image_info *cinfo)
 {
 	void *obj;
@@ -186,20 +276,229 @@ int collect_entry(ProtobufCMessage *msg, struct collect_image_info *cinfo)
 	cinfo->flags |= COLLECT_HAPPENED;
 	if (cinfo->collect(obj, msg, NULL) < 0) {
 		o_free(obj);
-		cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+		cr_pb_descs[cinfo->pb_type].free(msg, collect_allocator);
 		return -1;
 	}
 
 	if (!cinfo->priv_size && !(cinfo->flags & COLLECT_NOFREE))
-		cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+		cr_pb_descs[cinfo->pb_type].free(msg, collect_allocator);
 
 	return 0;
 }
 
+/*
+ * With --collect-workers the entries of the images collected at the
+ * restore start are unpacked by several threads. The image is read
+ * by criu as before, then the threads unpack the entries and only
+ * then the messages are handed over to ->collect one by one, in the
+ * order they are in the image, so the objects get into the lists and
+ * hashes in the very same order as without the threads.
+ *
+ * The threads only call the protobuf unpack, which needs nothing but
+ * malloc, all the rest (logging, images, shmalloc) is left to the
+ * main thread. They are all joined before the image is collected,
+ * so criu is single-threaded again by the time it forks the tasks.
+ */
+#define COLLECT_WORKER_MIN 256 /* entries per thread */
+
+struct collect_frame {
+	size_t off;
+	u32 size;
+	void *msg;
+};
+
+struct collect_worker {
+	pthread_t thread;
+	int pb_type;
+	ProtobufCAllocator *allocator;
+	void *buf;
+	struct collect_frame *frames;
+	unsigned long from, to;
+	bool started;
+};
+
+static void *collect_unpack(void *arg)
+{
+	struct collect_worker *w = arg;
+	unsigned long i;
+
+	for (i = w->from; i < w->to; i++) {
+		struct collect_frame *f = &w->frames[i];
+
+		f->msg = cr_pb_descs[w->pb_type].unpack(w->allocator, f->size, w->buf + f->off);
+		if (!f->msg)
+			break;
+	}
+
+	return NULL;
+}
+
+static int collect_read_frames(struct cr_img *img, void **pbuf, struct collect_frame **pframes, unsigned long *pnr)
+{
+	size_t len = 0, buf_size = 0;
+	unsigned long nr = 0, frames_nr = 0;
+	struct collect_frame *frames = NULL, *f;
+	void *buf = NULL;
+	u32 size;
+	int ret;
+
+	while (!empty_image(img)) {
+		ret = bread(&img->_x, &size, sizeof(size));
+		if (ret == 0)
+			break;
+		if (ret != sizeof(size)) {
+			pr_perror("Read %d bytes while %d expected", ret, (int)sizeof(size));
+			goto err;
+		}
+
+		if (nr == frames_nr) {
+			frames_nr = frames_nr ? frames_nr * 2 : 1024;
+			if (xrealloc_safe(&frames, frames_nr * sizeof(*frames)))
+				goto err;
+		}
+
+		if (len + size > buf_size) {
+			buf_size = max(buf_size * 2, len + size);
+			if (xrealloc_safe(&buf, buf_size))
+				goto err;
+		}
+
+		ret = bread(&img->_x, buf + len, size);
+		if (ret != size) {
+			pr_perror("Read %d bytes while %d expected", ret, size);
+			goto err;
+		}
+
+		f = &frames[nr++];
+		f->off = len;
+		f->size = size;
+		f->msg = NULL;
+		len += size;
+	}
+
+	*pbuf = buf;
+	*pframes = frames;
+	*pnr = nr;
+	return 0;
+
+err:
+	xfree(frames);
+	xfree(buf);
+	return -1;
+}
+
+static int collect_unpack_frames(struct collect_image_info *cinfo, void *buf, struct collect_frame *frames,
+				 unsigned long nr)
+{
+	struct collect_worker workers[COLLECT_WORKERS_MAX] = {};
+	unsigned int i, nr_workers;
+	unsigned long j;
+	int ret;
+
+	nr_workers = min_t(unsigned long, opts.collect_workers, nr / COLLECT_WORKER_MIN);
+	nr_workers = min_t(unsigned int, nr_workers, COLLECT_WORKERS_MAX);
+	if (!nr_workers)
+		nr_workers = 1;
+
+	for (i = 0; i < nr_workers; i++) {
+		struct collect_worker *w = &workers[i];
+
+		w->pb_type = cinfo->pb_type;
+		w->allocator = collect_arena(cinfo, i);
+		w->buf = buf;
+		w->frames = frames;
+		w->from = nr * i / nr_workers;
+		w->to = nr * (i + 1) / nr_workers;
+
+		/* The main thread takes the first part itself */
+		if (i == 0)
+			continue;
+
+		ret = pthread_create(&w->thread, NULL, collect_unpack, w);
+		if (ret) {
+			errno = ret;
+			pr_perror("Can't start collect worker, unpacking in place");
+			continue;
+		}
+		w->started = true;
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		if (!workers[i].started)
+			collect_unpack(&workers[i]);
+
+	for (i = 1; i < nr_workers; i++)
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+
+	pr_debug(" `- unpacked %lu entries with %u threads\n", nr, nr_workers);
+
+	for (j = 0; j < nr; j++)
+		if (!frames[j].msg) {
+			pr_err("Failed unpacking entry %lu\n", j);
+			return -1;
+		}
+
+	return 0;
+}
+
+static int collect_image_frames(struct cr_img *img, struct collect_image_info *cinfo)
+{
+	void *(*o_alloc)(size_t size) = malloc;
+	void (*o_free)(void *ptr) = free;
+	struct collect_frame *frames;
+	unsigned long nr, i;
+	void *buf, *obj;
+	int ret = -1;
+
+	if (cinfo->flags & COLLECT_SHARED) {
+		o_alloc = shmalloc;
+		o_free = shfree_last;
+	}
+
+	if (collect_read_frames(img, &buf, &frames, &nr))
+		return -1;
+
+	if (collect_unpack_frames(cinfo, buf, frames, nr))
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		ProtobufCMessage *msg = frames[i].msg;
+
+		if (cinfo->priv_size) {
+			obj = o_alloc(cinfo->priv_size);
+			if (!obj)
+				goto out;
+		} else
+			obj = NULL;
+
+		frames[i].msg = NULL;
+		cinfo->flags |= COLLECT_HAPPENED;
+		if (cinfo->collect(obj, msg, img) < 0) {
+			o_free(obj);
+			cr_pb_descs[cinfo->pb_type].free(msg, collect_allocator);
+			goto out;
+		}
+
+		if (!cinfo->priv_size && !(cinfo->flags & COLLECT_NOFREE))
+			cr_pb_descs[cinfo->pb_type].free(msg, collect_allocator);
+	}
+
+	ret = 0;
+out:
+	for (i = 0; i < nr; i++)
+		if (frames[i].msg)
+			cr_pb_descs[cinfo->pb_type].free(frames[i].msg, collect_allocator);
+	xfree(frames);
+	xfree(buf);
+	return ret;
+}
+
 int collect_image(struct collect_image_info *cinfo)
 {
 	int ret;
 	struct cr_img *img;
+	ProtobufCAllocator *prev_allocator = collect_allocator;
 	void *(*o_alloc)(size_t size) = malloc;
 	void (*o_free)(void *ptr) = free;
 
@@ -209,6 +508,13 @@ int collect_image(struct collect_image_info *cinfo)
 	if (!img)
 		return -1;
 
+	collect_allocator = collect_arena(cinfo, 0);
+
+	if (opts.collect_workers > 1 && !(cinfo->flags & COLLECT_IMG_DATA)) {
+		ret = collect_image_frames(img, cinfo);
+		goto out;
+	}
+
 	if (cinfo->flags & COLLECT_SHARED) {
 		o_alloc = shmalloc;
 		o_free = shfree_last;
@@ -226,7 +532,7 @@ int collect_image(struct collect_image_info *cinfo)
 		} else
 			obj = NULL;
 
-		ret = pb_read_one_eof(img, &msg, cinfo->pb_type);
+		ret = pb_read_one_alloc(img, (void **)&msg, cinfo->pb_type, true, collect_allocator);
 		if (ret <= 0) {
 			o_free(obj);
 			break;
@@ -236,15 +542,19 @@ int collect_image(struct collect_image_info *cinfo)
 		ret = cinfo->collect(obj, msg, img);
 		if (ret < 0) {
 			o_free(obj);
-			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+			cr_pb_descs[cinfo->pb_type].free(msg, collect_allocator);
 			break;
 		}
 
 		if (!cinfo->priv_size && !(cinfo->flags & COLLECT_NOFREE))
-			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+			cr_pb_descs[cinfo->pb_type].free(msg, collect_allocator);
 	}
 
+out:
+	collect_allocator = prev_allocator;
 	close_image(img);
+	if (cinfo->flags & COLLECT_ARENA)
+		pr_debug(" `- %lu arena chunks in use\n", collect_arena_chunks());
 	pr_debug(" `- ... done\n");
 	return ret;
 }
@@ -27,6 +27,7 @@
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
 #include "namespaces.h"
+#include "dump-workers.h"
 
 #ifndef SEEK_DATA
 #define SEEK_DATA 3
@@ -729,11 +730,10 @@ static int next_data_segment(int fd, unsigned long pfn, unsigned long *next_data
 	return 0;
 }
 
-static int do_dump_one_shmem(int fd, void *addr, struct shmem_info *si)
+static int dump_shmem_pages(int fd, void *addr, struct shmem_info *si, struct page_xfer *xfer)
 {
 	struct page_pipe *pp;
-	struct page_xfer xfer;
-	int err, ret = -1;
+	int ret = -1;
 	unsigned long pfn, nrpages, next_data_pnf = 0, next_hole_pfn = 0;
 	unsigned long pages[2] = {};
 
@@ -743,11 +743,7 @@ static int do_dump_one_shmem(int fd, void *addr, struct shmem_info *si)
 	if (!pp)
 		goto err;
 
-	err = open_page_xfer(&xfer, CR_FD_SHMEM_PAGEMAP, si->shmid);
-	if (err)
-		goto err_pp;
-
-	xfer.offset = (unsigned long)addr;
+	xfer->offset = (unsigned long)addr;
 
 	for (pfn = 0; pfn < nrpages; pfn++) {
 		unsigned int pgstate = PST_DIRTY;
@@ -756,7 +752,7 @@ static int do_dump_one_shmem(int fd, void *addr, struct shmem_info *si)
 		int st = -1;
 
 		if (fd >= 0 && pfn >= next_hole_pfn && next_data_segment(fd, pfn, &next_data_pnf, &next_hole_pfn))
-			goto err_xfer;
+			goto err_pp;
 
 		if (si->pstate_map && is_shmem_tracking_en()) {
 			pgstate = get_pstate(si->pstate_map, pfn);
@@ -774,7 +770,7 @@ static int do_dump_one_shmem(int fd, void *addr, struct shmem_info *si)
 	again:
 		if (pgstate == PST_ZERO)
 			ret = 0;
-		else if (xfer.parent && page_in_parent(pgstate == PST_DIRTY)) {
+		else if (xfer->parent && page_in_parent(pgstate == PST_DIRTY)) {
 			ret = page_pipe_add_hole(pp, pgaddr, PP_HOLE_PARENT);
 			st = 0;
 		} else {
@@ -783,13 +779,13 @@ static int do_dump_one_shmem(int fd, void *addr, struct shmem_info *si)
 		}
 
 		if (ret == -EAGAIN) {
-			ret = dump_pages(pp, &xfer);
+			ret = dump_pages(pp, xfer);
 			if (ret)
-				goto err_xfer;
+				goto err_pp;
 			page_pipe_reinit(pp);
 			goto again;
 		} else if (ret)
-			goto err_xfer;
+			goto err_pp;
 
 		if (st >= 0)
 			pages[st]++;
@@ -799,17 +795,28 @@ static int do_dump_one_shmem(int fd, void *addr, struct shmem_info *si)
 	cnt_add(CNT_SHPAGES_SKIPPED_PARENT, pages[0]);
 	cnt_add(CNT_SHPAGES_WRITTEN, pages[1]);
 
-	ret = dump_pages(pp, &xfer);
+	ret = dump_pages(pp, xfer);
 
-err_xfer:
-	xfer.close(&xfer);
 err_pp:
 	destroy_page_pipe(pp);
 err:
 	return ret;
 }
 
-static int dump_one_shmem(struct shmem_info *si)
+static int do_dump_one_shmem(int fd, void *addr, struct shmem_info *si)
+{
+	struct page_xfer xfer;
+	int ret;
+
+	if (open_page_xfer(&xfer, CR_FD_SHMEM_PAGEMAP, si->shmid))
+		return -1;
+
+	ret = dump_shmem_pages(fd, addr, si, &xfer);
+	xfer.close(&xfer);
+	return ret;
+}
+
+static int dump_one_shmem(struct shmem_info *si, struct page_xfer *xfer)
 {
 	int fd, ret = -1;
 	void *addr;
@@ -863,7 +870,7 @@ static int dump_one_shmem(struct shmem_info *si)
 		fd = -1;
 	}
 
-	ret = do_dump_one_shmem(fd, addr, si);
+	ret = dump_shmem_pages(fd, addr, si, xfer);
 
 	munmap(addr, si->size);
 errc:
@@ -923,6 +930,68 @@ int dump_one_sysv_shmem(void *addr, unsigned long size, unsigned long shmid)
 	return ret;
 }
 
+/*
+ * Shared memory segments are independent from each other, each one has
+ * its own pagemap and pages images. With dump workers enabled the big
+ * ones are scanned and written by the workers, each with its own page
+ * pipe and xfer, while criu goes on with the next segment. The images
+ * are opened here, so that the pages image ids are allocated in one
+ * place, and the workers are waited for at the end of the dump together
+ * with the ones writing the tasks' memory. The small segments are not
+ * worth a fork and are dumped in place.
+ */
+#define SHMEM_WORKER_MIN (8UL << 20)
+
+struct dump_shmem_job {
+	struct shmem_info *si;
+	struct page_xfer *xfer;
+};
+
+static int dump_shmem_job(void *arg)
+{
+	struct dump_shmem_job *job = arg;
+	int ret;
+
+	ret = dump_one_shmem(job->si, job->xfer);
+
+	/* See xfer_pages_job() */
+	if (dump_workers_enabled())
+		job->xfer->close(job->xfer);
+
+	return ret;
+}
+
+static int dump_shmem_segment(struct shmem_info *si)
+{
+	struct page_xfer xfer;
+	struct dump_shmem_job job = {
+		.si = si,
+		.xfer = &xfer,
+	};
+	int ret;
+
+	if (open_page_xfer(&xfer, CR_FD_SHMEM_PAGEMAP, si->shmid))
+		return -1;
+
+	if (!dump_workers_enabled() || si->size < SHMEM_WORKER_MIN) {
+		ret = dump_one_shmem(si, &xfer);
+		xfer.close(&xfer);
+		return ret;
+	}
+
+	if (page_xfer_flush(&xfer)) {
+		xfer.close(&xfer);
+		return -1;
+	}
+
+	pr_debug("Dumping shmem %lx of %lu KB in a dump worker\n", si->shmid, si->size >> 10);
+	ret = dump_worker_run(dump_shmem_job, &job);
+	if (ret == 1)
+		xfer.close(&xfer);
+
+	return ret < 0 ? -1 : 0;
+}
+
 int cr_dump_shmem(void)
 {
 	int ret = 0, i;
@@ -932,7 +1001,7 @@ int cr_dump_shmem(void)
 	{
 		if (si->pid == SYSVIPC_SHMEM_PID)
 			continue;
-		ret = dump_one_shmem(si);
+		ret = dump_shmem_segment(si);
 		if (ret)
 			goto out;
 	}
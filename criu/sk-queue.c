@@ -76,6 +76,7 @@ struct collect_image_info sk_queues_cinfo = {
 	.pb_type = PB_SK_QUEUES,
 	.priv_size = sizeof(struct sk_packet),
 	.collect = collect_one_packet,
+	.flags = COLLECT_IMG_DATA,
 };
 
 static int dump_scm_rights(struct cmsghdr *ch, SkPacketEntry *pe)
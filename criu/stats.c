@@ -4,11 +4,13 @@
 #include "int.h"
 #include "atomic.h"
 #include "cr_options.h"
+#include "page.h"
 #include "rst-malloc.h"
 #include "protobuf.h"
 #include "stats.h"
 #include "util.h"
 #include "image.h"
+#include "dump-workers.h"
 #include "images/stats.pb-c.h"
 
 struct timing {
@@ -16,9 +18,16 @@ struct timing {
 	struct timeval total;
 };
 
+struct dump_worker_stats {
+	struct timing timings[DUMP_TIME_NR_STATS];
+	unsigned long counts[DUMP_CNT_NR_STATS];
+	unsigned int jobs;
+};
+
 struct dump_stats {
 	struct timing timings[DUMP_TIME_NR_STATS];
 	unsigned long counts[DUMP_CNT_NR_STATS];
+	struct dump_worker_stats workers[DUMP_WORKERS_MAX];
 };
 
 struct restore_stats {
@@ -29,9 +38,29 @@ struct restore_stats {
 struct dump_stats *dstats;
 struct restore_stats *rstats;
 
+/*
+ * Dump workers run in parallel with criu and with each other, so
+ * each one accounts into its own slot and the slots are summed up
+ * when the stats are written.
+ */
+static struct dump_worker_stats *wstats;
+
+void stats_set_dump_worker(int id)
+{
+	if (dstats == NULL)
+		return;
+
+	BUG_ON(id >= DUMP_WORKERS_MAX);
+	wstats = &dstats->workers[id];
+	wstats->jobs++;
+}
+
 void cnt_add(int c, unsigned long val)
 {
-	if (dstats != NULL) {
+	if (wstats != NULL) {
+		BUG_ON(c >= DUMP_CNT_NR_STATS);
+		wstats->counts[c] += val;
+	} else if (dstats != NULL) {
 		BUG_ON(c >= DUMP_CNT_NR_STATS);
 		dstats->counts[c] += val;
 	} else if (rstats != NULL) {
@@ -43,7 +72,10 @@ void cnt_add(int c, unsigned long val)
 
 void cnt_sub(int c, unsigned long val)
 {
-	if (dstats != NULL) {
+	if (wstats != NULL) {
+		BUG_ON(c >= DUMP_CNT_NR_STATS);
+		wstats->counts[c] -= val;
+	} else if (dstats != NULL) {
 		BUG_ON(c >= DUMP_CNT_NR_STATS);
 		dstats->counts[c] -= val;
 	} else if (rstats != NULL) {
@@ -72,7 +104,10 @@ static void timeval_accumulate(const struct timeval *from, const struct timeval
 
 static struct timing *get_timing(int t)
 {
-	if (dstats != NULL) {
+	if (wstats != NULL) {
+		BUG_ON(t >= DUMP_TIME_NR_STATS);
+		return &wstats->timings[t];
+	} else if (dstats != NULL) {
 		BUG_ON(t >= DUMP_TIME_NR_STATS);
 		return &dstats->timings[t];
 	} else if (rstats != NULL) {
@@ -110,16 +145,44 @@ void timing_stop(int t)
 	timeval_accumulate(&tm->start, &now, &tm->total);
 }
 
+static u_int32_t timing_usec(struct timing *tm)
+{
+	return tm->total.tv_sec * USEC_PER_SEC + tm->total.tv_usec;
+}
+
 static void encode_time(int t, u_int32_t *to)
 {
-	struct timing *tm;
+	*to = timing_usec(get_timing(t));
+}
 
-	tm = get_timing(t);
-	*to = tm->total.tv_sec * USEC_PER_SEC + tm->total.tv_usec;
+unsigned long dump_cnt(int c)
+{
+	unsigned long val = dstats->counts[c];
+	int i;
+
+	for (i = 0; i < DUMP_WORKERS_MAX; i++)
+		val += dstats->workers[i].counts[c];
+
+	return val;
+}
+
+/*
+ * Time spent by workers is summed up, so with several of them
+ * it can be longer than the dump itself.
+ */
+static void encode_dump_time(int t, u_int32_t *to)
+{
+	int i;
+
+	encode_time(t, to);
+	for (i = 0; i < DUMP_WORKERS_MAX; i++)
+		*to += timing_usec(&dstats->workers[i].timings[t]);
 }
 
 static void display_stats(int what, StatsEntry *stats)
 {
+	int i;
+
 	if (what == DUMP_STATS) {
 		pr_msg("Displaying dump stats:\n");
 		pr_msg("Freezing time: %d us\n", stats->dump->freezing_time);
@@ -136,6 +199,21 @@ static void display_stats(int what, StatsEntry *stats)
 		       stats->dump->pages_written);
 		pr_msg("Lazy memory pages: %" PRIu64 " (0x%" PRIx64 ")\n", stats->dump->pages_lazy,
 		       stats->dump->pages_lazy);
+		if (stats->dump->pages_compressed)
+			pr_msg("Memory pages compressed: %" PRIu64 " into %" PRIu64 " bytes\n",
+			       stats->dump->pages_compressed, stats->dump->compressed_bytes);
+		if (stats->dump->pages_deduped)
+			pr_msg("Memory pages deduplicated: %" PRIu64 " (0x%" PRIx64 ")\n", stats->dump->pages_deduped,
+			       stats->dump->pages_deduped);
+		if (stats->dump->pages_zero)
+			pr_msg("Zero memory pages skipped: %" PRIu64 " (0x%" PRIx64 ")\n", stats->dump->pages_zero,
+			       stats->dump->pages_zero);
+		for (i = 0; i < stats->dump->n_workers; i++) {
+			DumpWorkerStatsEntry *we = stats->dump->workers[i];
+
+			pr_msg("Dump worker %u: %u jobs, %" PRIu64 " pages written, memory write time %u us\n", we->id,
+			       we->jobs, we->pages_written, we->memwrite_time);
+		}
 	} else if (what == RESTORE_STATS) {
 		pr_msg("Displaying restore stats:\n");
 		pr_msg("Pages compared: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_compared,
@@ -145,6 +223,17 @@ static void display_stats(int what, StatsEntry *stats)
 		if (stats->restore->has_pages_restored)
 			pr_msg("Pages restored: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_restored,
 			       stats->restore->pages_restored);
+		if (stats->restore->pages_read) {
+			uint64_t us = stats->restore->pages_read_time ?: 1;
+
+			pr_msg("Pages read: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_read,
+			       stats->restore->pages_read);
+			pr_msg("Pages read time: %u us (%" PRIu64 " MB/s)\n", stats->restore->pages_read_time,
+			       stats->restore->pages_read * PAGE_SIZE / us);
+		}
+		if (stats->restore->pages_prefetched)
+			pr_msg("Pages prefetched: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_prefetched,
+			       stats->restore->pages_prefetched);
 		pr_msg("Restore time: %d us\n", stats->restore->restore_time);
 		pr_msg("Forking time: %d us\n", stats->restore->forking_time);
 	} else
@@ -156,7 +245,10 @@ void write_stats(int what)
 	StatsEntry stats = STATS_ENTRY__INIT;
 	DumpStatsEntry ds_entry = DUMP_STATS_ENTRY__INIT;
 	RestoreStatsEntry rs_entry = RESTORE_STATS_ENTRY__INIT;
+	DumpWorkerStatsEntry w_entries[DUMP_WORKERS_MAX];
+	DumpWorkerStatsEntry *w_ptrs[DUMP_WORKERS_MAX];
 	char *name;
+	int i;
 	struct cr_img *img;
 
 	pr_info("Writing stats\n");
@@ -166,26 +258,53 @@ void write_stats(int what)
 		encode_time(TIME_FREEZING, &ds_entry.freezing_time);
 		encode_time(TIME_FROZEN, &ds_entry.frozen_time);
 		encode_time(TIME_MEMDUMP, &ds_entry.memdump_time);
-		encode_time(TIME_MEMWRITE, &ds_entry.memwrite_time);
+		encode_dump_time(TIME_MEMWRITE, &ds_entry.memwrite_time);
 		ds_entry.has_irmap_resolve = true;
 		encode_time(TIME_IRMAP_RESOLVE, &ds_entry.irmap_resolve);
 
-		ds_entry.pages_scanned = dstats->counts[CNT_PAGES_SCANNED];
-		ds_entry.pages_skipped_parent = dstats->counts[CNT_PAGES_SKIPPED_PARENT];
-		ds_entry.pages_written = dstats->counts[CNT_PAGES_WRITTEN];
-		ds_entry.pages_lazy = dstats->counts[CNT_PAGES_LAZY];
-		ds_entry.page_pipes = dstats->counts[CNT_PAGE_PIPES];
+		ds_entry.pages_scanned = dump_cnt(CNT_PAGES_SCANNED);
+		ds_entry.pages_skipped_parent = dump_cnt(CNT_PAGES_SKIPPED_PARENT);
+		ds_entry.pages_written = dump_cnt(CNT_PAGES_WRITTEN);
+		ds_entry.pages_lazy = dump_cnt(CNT_PAGES_LAZY);
+		ds_entry.page_pipes = dump_cnt(CNT_PAGE_PIPES);
 		ds_entry.has_page_pipes = true;
-		ds_entry.page_pipe_bufs = dstats->counts[CNT_PAGE_PIPE_BUFS];
+		ds_entry.page_pipe_bufs = dump_cnt(CNT_PAGE_PIPE_BUFS);
 		ds_entry.has_page_pipe_bufs = true;
 
-		ds_entry.shpages_scanned = dstats->counts[CNT_SHPAGES_SCANNED];
+		ds_entry.shpages_scanned = dump_cnt(CNT_SHPAGES_SCANNED);
 		ds_entry.has_shpages_scanned = true;
-		ds_entry.shpages_skipped_parent = dstats->counts[CNT_SHPAGES_SKIPPED_PARENT];
+		ds_entry.shpages_skipped_parent = dump_cnt(CNT_SHPAGES_SKIPPED_PARENT);
 		ds_entry.has_shpages_skipped_parent = true;
-		ds_entry.shpages_written = dstats->counts[CNT_SHPAGES_WRITTEN];
+		ds_entry.shpages_written = dump_cnt(CNT_SHPAGES_WRITTEN);
 		ds_entry.has_shpages_written = true;
 
+		ds_entry.pages_compressed = dump_cnt(CNT_PAGES_COMPRESSED);
+		ds_entry.has_pages_compressed = true;
+		ds_entry.compressed_bytes = dump_cnt(CNT_COMPRESSED_BYTES);
+		ds_entry.has_compressed_bytes = true;
+
+		ds_entry.pages_deduped = dump_cnt(CNT_PAGES_DEDUPED);
+		ds_entry.has_pages_deduped = true;
+		ds_entry.pages_zero = dump_cnt(CNT_PAGES_ZERO);
+		ds_entry.has_pages_zero = true;
+
+		for (i = 0; i < DUMP_WORKERS_MAX; i++) {
+			struct dump_worker_stats *ws = &dstats->workers[i];
+			DumpWorkerStatsEntry *we;
+
+			if (!ws->jobs)
+				continue;
+
+			we = &w_entries[ds_entry.n_workers];
+			dump_worker_stats_entry__init(we);
+			we->id = i;
+			we->jobs = ws->jobs;
+			we->pages_written = ws->counts[CNT_PAGES_WRITTEN];
+			we->memwrite_time = timing_usec(&ws->timings[TIME_MEMWRITE]);
+			w_ptrs[ds_entry.n_workers++] = we;
+		}
+		ds_entry.workers = w_ptrs;
+
 		name = "dump";
 	} else if (what == RESTORE_STATS) {
 		stats.restore = &rs_entry;
@@ -194,6 +313,12 @@ void write_stats(int what)
 		rs_entry.pages_skipped_cow = atomic_read(&rstats->counts[CNT_PAGES_SKIPPED_COW]);
 		rs_entry.has_pages_restored = true;
 		rs_entry.pages_restored = atomic_read(&rstats->counts[CNT_PAGES_RESTORED]);
+		rs_entry.has_pages_read = true;
+		rs_entry.pages_read = atomic_read(&rstats->counts[CNT_PAGES_READ]);
+		rs_entry.has_pages_read_time = true;
+		rs_entry.pages_read_time = atomic_read(&rstats->counts[CNT_PAGES_READ_TIME]);
+		rs_entry.has_pages_prefetched = true;
+		rs_entry.pages_prefetched = atomic_read(&rstats->counts[CNT_PAGES_PREFETCHED]);
 
 		encode_time(TIME_FORK, &rs_entry.forking_time);
 		encode_time(TIME_RESTORE, &rs_entry.restore_time);
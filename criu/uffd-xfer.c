@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include "cr_options.h"
+#include "page.h"
+#include "uffd-xfer.h"
+#include "util.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "uffd-xfer: "
+
+/*
+ * A page fault that comes while background requests are in flight
+ * has to wait for them, when the pages come from a page server over
+ * one connection. So the background transfer should be as fast as
+ * the link allows, but not at the cost of the faults.
+ */
+
+/* A batch may take this part of the time between the faults */
+#define XFER_FAULT_SHARE 4
+/* ... but not longer than that, us */
+#define XFER_BUDGET_MAX 100000
+
+static inline u64 ewma(u64 avg, u64 sample)
+{
+	return avg ? (avg * 7 + sample) / 8 : sample;
+}
+
+/*
+ * The original heuristics: transfer larger chunks when there is no
+ * page faults and drop the background transfer size each time #PF
+ * occurs to the default value.
+ */
+static void fixed_fault(struct xfer_ctl *c, u64 now)
+{
+	c->len = DEFAULT_XFER_LEN;
+}
+
+static void fixed_issue(struct xfer_ctl *c)
+{
+	c->len = min(c->len + DEFAULT_XFER_LEN, (unsigned long)MAX_XFER_LEN);
+}
+
+static void fixed_done(struct xfer_ctl *c, u64 now)
+{
+}
+
+/*
+ * Sizes the batches by the measured bandwidth so that each takes a
+ * fraction of the time between the faults, and keeps as many of them
+ * in flight as fit into the bandwidth-delay product of the link. Until
+ * the first batch completes nothing is known and the defaults are used.
+ */
+static void adaptive_update(struct xfer_ctl *c, u64 now)
+{
+	u64 gap = ~0ULL, budget, bdp;
+	unsigned long len;
+
+	if (!c->bw)
+		return;
+
+	/* The quiet period since the last fault counts as a growing gap */
+	if (c->fault_gap)
+		gap = max(c->fault_gap, now - c->last_fault);
+
+	budget = min_t(u64, gap / XFER_FAULT_SHARE / 1000, XFER_BUDGET_MAX);
+	len = c->bw * budget / USEC_PER_SEC;
+	len = max_t(unsigned long, min_t(unsigned long, len, MAX_XFER_LEN), DEFAULT_XFER_LEN);
+	c->len = len & PAGE_MASK;
+
+	/* Frequent faults shouldn't queue up behind several batches */
+	c->depth = 1;
+	if (gap > XFER_FAULT_SHARE * c->rtt) {
+		bdp = c->bw * c->rtt_min / NSEC_PER_SEC;
+		c->depth = min_t(u64, 1 + bdp / c->len, MAX_XFER_DEPTH);
+	}
+}
+
+static void adaptive_issue(struct xfer_ctl *c)
+{
+}
+
+static const struct xfer_ctl_ops xfer_ctls[] = {
+	[XFER_CTL_ADAPTIVE] = {
+		.name = "adaptive",
+		.fault = adaptive_update,
+		.issue = adaptive_issue,
+		.done = adaptive_update,
+	},
+	[XFER_CTL_FIXED] = {
+		.name = "fixed",
+		.fault = fixed_fault,
+		.issue = fixed_issue,
+		.done = fixed_done,
+	},
+};
+
+int xfer_ctl_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(xfer_ctls); i++)
+		if (!strcmp(xfer_ctls[i].name, name))
+			return i;
+
+	return -1;
+}
+
+void xfer_ctl_init(struct xfer_ctl *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->ops = &xfer_ctls[opts.lazy_xfer];
+	c->len = DEFAULT_XFER_LEN;
+	c->depth = 1;
+}
+
+void xfer_ctl_fault(struct xfer_ctl *c, u64 now)
+{
+	if (c->last_fault)
+		c->fault_gap = ewma(c->fault_gap, now - c->last_fault);
+	c->last_fault = now;
+	c->nr_faults++;
+
+	c->ops->fault(c, now);
+}
+
+void xfer_ctl_issue(struct xfer_ctl *c)
+{
+	c->ops->issue(c);
+}
+
+/*
+ * Called when the pages of a request issued at @issued arrive. The
+ * minimal latency of all requests is taken as the round trip time,
+ * the rest of a batch latency is the transfer time.
+ */
+void xfer_ctl_done(struct xfer_ctl *c, bool pf, unsigned long bytes, u64 issued, u64 now)
+{
+	u64 lat = max_t(u64, now - issued, 1);
+
+	if (!c->rtt_min || lat < c->rtt_min)
+		c->rtt_min = lat;
+
+	if (pf) {
+		c->rtt = ewma(c->rtt, lat);
+		c->nr_fault_lat++;
+		c->fault_lat_sum += lat;
+		c->fault_lat_max = max(c->fault_lat_max, lat);
+	} else {
+		if (lat > c->rtt_min)
+			lat -= c->rtt_min;
+		c->bw = ewma(c->bw, bytes * NSEC_PER_SEC / lat);
+		c->nr_batches++;
+		c->batch_bytes += bytes;
+	}
+
+	c->ops->done(c, now);
+}
@@ -7,6 +7,7 @@
 #include <poll.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
@@ -26,6 +27,7 @@
 #include "kerndat.h"
 #include "mem.h"
 #include "uffd.h"
+#include "uffd-xfer.h"
 #include "util-pie.h"
 #include "protobuf.h"
 #include "pstree.h"
@@ -58,22 +60,25 @@
 
 #define LAZY_PAGES_RESTORE_FINISHED 0x52535446 /* ReSTore Finished */
 
+static mutex_t *lazy_sock_mutex;
+
 /*
- * Background transfer parameters.
- * The default xfer length is arbitrary set to 64Kbytes
- * The limit of 4Mbytes matches the maximal chunk size we can have in
- * a pipe in the page-server
+ * The page faults are collected while the events read at once are
+ * handled, and the ones that are no more than LAZY_PF_GAP apart are
+ * served with a single request, see handle_page_faults().
  */
-#define DEFAULT_XFER_LEN (64 << 10)
-#define MAX_XFER_LEN	 (4 << 20)
-
-static mutex_t *lazy_sock_mutex;
+#define LAZY_PF_BATCH 32
+#define LAZY_PF_GAP   (16 * PAGE_SIZE)
 
 struct lazy_iov {
 	struct list_head l;
 	unsigned long start;	 /* run-time start address, tracks remaps */
 	unsigned long end;	 /* run-time end address, tracks remaps */
 	unsigned long img_start; /* start address at the dump time */
+	bool hot;		 /* pages were recently used, see PE_HOT */
+	bool pf;		 /* requested on a page fault */
+	bool thp;		 /* transferred in huge pages, see thp_extend() */
+	u64 ts;			 /* when the request was issued, ns */
 };
 
 struct lazy_pages_info {
@@ -88,9 +93,15 @@ struct lazy_pages_info {
 
 	struct page_read pr;
 
-	unsigned long xfer_len; /* in pages */
+	struct xfer_ctl xfer;
+	unsigned long last_pf; /* address of the latest page fault */
+	unsigned long pfs[LAZY_PF_BATCH]; /* page faults not served yet */
+	unsigned int nr_pfs;
 	unsigned long total_pages;
 	unsigned long copied_pages;
+	unsigned long pushed_pages; /* pages pushed by the page server */
+	/* pages transferred in the background, and hot ones after a cold one */
+	unsigned long xfer_hot, xfer_cold, xfer_hot_late;
 
 	struct epoll_rfd lpfd;
 
@@ -125,7 +136,7 @@ static struct lazy_pages_info *lpi_init(void)
 	INIT_LIST_HEAD(&lpi->reqs);
 	INIT_LIST_HEAD(&lpi->l);
 	lpi->lpfd.read_event = handle_uffd_event;
-	lpi->xfer_len = DEFAULT_XFER_LEN;
+	xfer_ctl_init(&lpi->xfer);
 	lpi->ref_cnt = 1;
 
 	return lpi;
@@ -251,6 +262,13 @@ bool uffd_noncooperative(void)
 	return (kdat.uffd_features & features) == features;
 }
 
+bool uffd_wp_async(void)
+{
+	unsigned long features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED;
+
+	return (kdat.uffd_features & features) == features;
+}
+
 static int uffd_api_ioctl(void *arg, int fd, pid_t pid)
 {
 	struct uffdio_api *uffdio_api = arg;
@@ -430,6 +448,10 @@ static int split_iov(struct lazy_iov *iov, unsigned long addr)
 	new->start = addr;
 	new->img_start = iov->img_start + addr - iov->start;
 	new->end = iov->end;
+	new->hot = iov->hot;
+	new->pf = iov->pf;
+	new->thp = iov->thp;
+	new->ts = iov->ts;
 	iov->end = addr;
 	list_add(&new->l, &iov->l);
 
@@ -480,6 +502,8 @@ static int __copy_iov_list(struct list_head *src, struct list_head *dst)
 		new->start = iov->start;
 		new->img_start = iov->img_start;
 		new->end = iov->end;
+		new->hot = iov->hot;
+		new->thp = iov->thp;
 
 		list_add_tail(&new->l, dst);
 	}
@@ -658,6 +682,72 @@ static int remap_iovs(struct lazy_pages_info *lpi, unsigned long from, unsigned
 	return 0;
 }
 
+/*
+ * The lazy pages of the VMAs that get the transparent huge pages are
+ * transferred in whole huge pages, aligned to their size. UFFDIO_COPY
+ * always maps small pages, but once all the pages of a huge one are in
+ * place, khugepaged can collapse them back without waiting for the rest
+ * of the VMA. Otherwise the restored process would run on small pages
+ * for long, if not for good.
+ */
+static unsigned long thp_size;
+static bool thp_always;
+
+static void lazy_thp_init(void)
+{
+	char buf[64];
+	int fd, ret;
+
+	fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+	if (fd < 0)
+		return;
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return;
+	buf[ret] = '\0';
+
+	if (strstr(buf, "[never]"))
+		return;
+	thp_always = strstr(buf, "[always]") != NULL;
+
+	fd = open("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", O_RDONLY);
+	if (fd < 0)
+		return;
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return;
+	buf[ret] = '\0';
+
+	thp_size = strtoul(buf, NULL, 10);
+	if (thp_size & (thp_size - 1) || thp_size <= PAGE_SIZE)
+		thp_size = 0;
+
+	pr_debug("Huge pages of %lu KB, %s\n", thp_size >> 10, thp_always ? "always" : "madvise");
+}
+
+static bool lazy_vma_thp(MmEntry *mm, VmaEntry *vma)
+{
+	if (!thp_size || (mm->has_thp_disabled && mm->thp_disabled))
+		return false;
+
+	if (vma->has_madv && (vma->madv & (1ul << MADV_NOHUGEPAGE)))
+		return false;
+
+	return thp_always || vma_entry_has_thp(vma);
+}
+
+/* Extends the range to the whole huge pages that fit into the iov */
+static void thp_extend(struct lazy_iov *iov, unsigned long *start, unsigned long *end)
+{
+	if (!iov->thp)
+		return;
+
+	*start = max(round_down(*start, thp_size), iov->start);
+	*end = min(round_up(*end, thp_size), iov->end);
+}
+
 /*
  * Create a list of IOVs that can be handled using userfaultfd. The
  * IOVs generally correspond to lazy pagemap entries, except the cases
@@ -701,6 +791,8 @@ static int collect_iovs(struct lazy_pages_info *lpi)
 			iov->start = start;
 			iov->img_start = start;
 			iov->end = iov->start + len;
+			iov->hot = pagemap_hot(pr->pe);
+			iov->thp = lazy_vma_thp(mm, vma);
 			list_add_tail(&iov->l, &lpi->iovs);
 
 			if (len > max_iov_len)
@@ -844,13 +936,21 @@ static int uffd_check_op_error(struct lazy_pages_info *lpi, const char *op, int
 	return 0;
 }
 
-static int uffd_copy(struct lazy_pages_info *lpi, __u64 address, int *nr_pages)
+static u64 clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int uffd_copy(struct lazy_pages_info *lpi, __u64 address, void *buf, int *nr_pages)
 {
 	struct uffdio_copy uffdio_copy;
 	unsigned long len = *nr_pages * page_size();
 
 	uffdio_copy.dst = address;
-	uffdio_copy.src = (unsigned long)lpi->buf;
+	uffdio_copy.src = (unsigned long)buf;
 	uffdio_copy.len = len;
 	uffdio_copy.mode = 0;
 	uffdio_copy.copy = 0;
@@ -903,7 +1003,9 @@ static int uffd_io_complete(struct page_read *pr, unsigned long img_addr, int nr
 	req_pages = (req->end - req->start) / PAGE_SIZE;
 	nr = min(nr, req_pages);
 
-	ret = uffd_copy(lpi, addr, &nr);
+	xfer_ctl_done(&lpi->xfer, req->pf, nr * PAGE_SIZE, req->ts, clock_ns());
+
+	ret = uffd_copy(lpi, addr, lpi->buf, &nr);
 	if (ret < 0)
 		return ret;
 
@@ -920,6 +1022,52 @@ static int uffd_io_complete(struct page_read *pr, unsigned long img_addr, int nr
 	return drop_iovs(lpi, addr, nr * PAGE_SIZE);
 }
 
+/*
+ * Places the pages pushed by the page server (see --lazy-push) into all
+ * the processes still waiting for them, the ranges are matched by the
+ * image addresses. The pages that are requested already are left for
+ * the answer.
+ */
+static int uffd_push_complete(unsigned long img_id, unsigned long img_addr, int nr, void *buf)
+{
+	unsigned long img_end = img_addr + nr * PAGE_SIZE;
+	struct lazy_pages_info *lpi;
+	struct lazy_iov *iov, *n;
+	int ret;
+
+	list_for_each_entry(lpi, &lpis, l) {
+		if (lpi->exited || lpi->pr.img_id != img_id)
+			continue;
+
+		list_for_each_entry_safe(iov, n, &lpi->iovs, l) {
+			unsigned long start = max(iov->img_start, img_addr);
+			unsigned long end = min(iov->img_start + iov->end - iov->start, img_end);
+			int nr_pages;
+
+			if (start >= end)
+				continue;
+
+			/* the pieces around the range are behind n, if any */
+			iov = extract_range(iov, iov->start + start - iov->img_start, iov->start + end - iov->img_start);
+			if (!iov)
+				return -1;
+
+			nr_pages = (end - start) / PAGE_SIZE;
+			ret = uffd_copy(lpi, iov->start, buf + start - img_addr, &nr_pages);
+			if (ret < 0)
+				return ret;
+			if (lpi->exited)
+				break;
+
+			lpi->pushed_pages += nr_pages;
+			if (drop_iovs(lpi, iov->start, nr_pages * PAGE_SIZE))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int uffd_zero(struct lazy_pages_info *lpi, __u64 address, int nr_pages)
 {
 	struct uffdio_zeropage uffdio_zeropage;
@@ -978,49 +1126,75 @@ static int uffd_handle_pages(struct lazy_pages_info *lpi, __u64 address, int nr,
 	return 0;
 }
 
+/*
+ * The ranges that were recently used at the dump time (see PE_HOT) are
+ * transferred first, as they are likely to be accessed soon. Among the
+ * ranges of the same kind the one following the latest page fault is
+ * preferred, the next faults are likely to be near it.
+ */
 static struct lazy_iov *pick_next_range(struct lazy_pages_info *lpi)
 {
-	return list_first_entry(&lpi->iovs, struct lazy_iov, l);
+	struct lazy_iov *iov, *best = NULL;
+	int rank, best_rank = INT_MAX;
+
+	list_for_each_entry(iov, &lpi->iovs, l) {
+		rank = (iov->hot ? 0 : 2) + (iov->end > lpi->last_pf ? 0 : 1);
+		if (rank < best_rank) {
+			best = iov;
+			best_rank = rank;
+			if (!rank)
+				break;
+		}
+	}
+
+	return best;
 }
 
-/*
- * This is very simple heurstics for background transfer control.
- * The idea is to transfer larger chunks when there is no page faults
- * and drop the background transfer size each time #PF occurs to some
- * default value. The default is empirically set to 64Kbytes
- */
-static void update_xfer_len(struct lazy_pages_info *lpi, bool pf)
+/* Background requests in flight */
+static unsigned int nr_xfer_reqs(struct lazy_pages_info *lpi)
 {
-	if (pf)
-		lpi->xfer_len = DEFAULT_XFER_LEN;
-	else
-		lpi->xfer_len += DEFAULT_XFER_LEN;
+	struct lazy_iov *req;
+	unsigned int nr = 0;
+
+	list_for_each_entry(req, &lpi->reqs, l)
+		if (!req->pf)
+			nr++;
 
-	if (lpi->xfer_len > MAX_XFER_LEN)
-		lpi->xfer_len = MAX_XFER_LEN;
+	return nr;
 }
 
 static int xfer_pages(struct lazy_pages_info *lpi)
 {
 	struct lazy_iov *iov;
 	unsigned int nr_pages;
-	unsigned long len;
+	unsigned long start, end;
 	int err;
 
 	iov = pick_next_range(lpi);
 	if (!iov)
 		return 0;
 
-	len = min(iov->end - iov->start, lpi->xfer_len);
+	start = iov->start;
+	end = start + min(iov->end - iov->start, lpi->xfer.len);
+	thp_extend(iov, &start, &end);
 
-	iov = extract_range(iov, iov->start, iov->start + len);
+	iov = extract_range(iov, start, end);
 	if (!iov)
 		return -1;
 	list_move(&iov->l, &lpi->reqs);
+	iov->pf = false;
+	iov->ts = clock_ns();
 
 	nr_pages = (iov->end - iov->start) / PAGE_SIZE;
+	if (!iov->hot)
+		lpi->xfer_cold += nr_pages;
+	else {
+		lpi->xfer_hot += nr_pages;
+		if (lpi->xfer_cold)
+			lpi->xfer_hot_late += nr_pages;
+	}
 
-	update_xfer_len(lpi, false);
+	xfer_ctl_issue(&lpi->xfer);
 
 	err = uffd_handle_pages(lpi, iov->img_start, nr_pages, PR_ASYNC | PR_ASAP);
 	if (err < 0) {
@@ -1148,11 +1322,88 @@ static bool is_page_queued(struct lazy_pages_info *lpi, unsigned long addr)
 	return false;
 }
 
-static int handle_page_fault(struct lazy_pages_info *lpi, struct uffd_msg *msg)
+static int cmp_pf(const void *a, const void *b)
+{
+	unsigned long x = *(unsigned long *)a, y = *(unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int request_pf_range(struct lazy_pages_info *lpi, struct lazy_iov *iov, unsigned long start,
+			    unsigned long end)
+{
+	int ret;
+
+	iov = extract_range(iov, start, end);
+	if (!iov)
+		return -1;
+
+	list_move(&iov->l, &lpi->reqs);
+	iov->pf = true;
+	iov->ts = clock_ns();
+
+	ret = uffd_handle_pages(lpi, iov->img_start, (end - start) / PAGE_SIZE, PR_ASYNC | PR_ASAP);
+	if (ret < 0) {
+		lp_err(lpi, "Error during regular page copy\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Serves the page faults collected by handle_page_fault(). The faults
+ * close to each other within the same lazy range are served with one
+ * request, that brings the pages in between as well, they are likely
+ * to be accessed soon. In the huge pages the whole ones are requested.
+ * The requests to the page server are sent out
+ * together afterwards, see flush_remote_pages().
+ */
+static int handle_page_faults(struct lazy_pages_info *lpi)
 {
+	unsigned int i, nr = lpi->nr_pfs;
+	unsigned long start, end;
 	struct lazy_iov *iov;
+
+	lpi->nr_pfs = 0;
+	qsort(lpi->pfs, nr, sizeof(lpi->pfs[0]), cmp_pf);
+
+	for (i = 0; i < nr && !lpi->exited; i++) {
+		start = lpi->pfs[i];
+
+		/* the range may be requested or removed in the meantime */
+		if (is_page_queued(lpi, start))
+			continue;
+
+		iov = find_iov(lpi, start);
+		if (!iov) {
+			if (uffd_zero(lpi, start, 1))
+				return -1;
+			continue;
+		}
+
+		end = start + PAGE_SIZE;
+		thp_extend(iov, &start, &end);
+		while (i + 1 < nr && lpi->pfs[i + 1] < iov->end && lpi->pfs[i + 1] <= end + LAZY_PF_GAP) {
+			unsigned long next = lpi->pfs[++i] + PAGE_SIZE;
+
+			if (next > end) {
+				end = next;
+				thp_extend(iov, &start, &end);
+			}
+		}
+
+		if (request_pf_range(lpi, iov, start, end))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int handle_page_fault(struct lazy_pages_info *lpi, struct uffd_msg *msg)
+{
 	__u64 address;
-	int ret;
+	unsigned int i;
 
 	/* Align requested address to the next page boundary */
 	address = msg->arg.pagefault.address & ~(page_size() - 1);
@@ -1161,25 +1412,22 @@ static int handle_page_fault(struct lazy_pages_info *lpi, struct uffd_msg *msg)
 	if (is_page_queued(lpi, address))
 		return 0;
 
-	iov = find_iov(lpi, address);
-	if (!iov)
+	if (!find_iov(lpi, address))
 		return uffd_zero(lpi, address, 1);
 
-	iov = extract_range(iov, address, address + PAGE_SIZE);
-	if (!iov)
-		return -1;
-
-	list_move(&iov->l, &lpi->reqs);
+	for (i = 0; i < lpi->nr_pfs; i++)
+		if (lpi->pfs[i] == address)
+			return 1;
 
-	update_xfer_len(lpi, true);
+	lpi->last_pf = address;
+	xfer_ctl_fault(&lpi->xfer, clock_ns());
 
-	ret = uffd_handle_pages(lpi, iov->img_start, 1, PR_ASYNC | PR_ASAP);
-	if (ret < 0) {
-		lp_err(lpi, "Error during regular page copy\n");
+	lpi->pfs[lpi->nr_pfs++] = address;
+	if (lpi->nr_pfs == LAZY_PF_BATCH && handle_page_faults(lpi))
 		return -1;
-	}
 
-	return 0;
+	/* stop the events loop to serve the faults, see flush_requests() */
+	return 1;
 }
 
 static int handle_uffd_event(struct epoll_rfd *lpfd)
@@ -1228,8 +1476,22 @@ static int handle_uffd_event(struct epoll_rfd *lpfd)
 
 static void lazy_pages_summary(struct lazy_pages_info *lpi)
 {
+	struct xfer_ctl *c = &lpi->xfer;
+
 	lp_debug(lpi, "UFFD transferred pages: (%ld/%ld)\n", lpi->copied_pages, lpi->total_pages);
 
+	lp_info(lpi, "%lu faults, latency avg %" PRIu64 " max %" PRIu64 " us, every %" PRIu64 " us\n", c->nr_faults,
+		c->nr_fault_lat ? c->fault_lat_sum / c->nr_fault_lat / 1000 : 0, c->fault_lat_max / 1000,
+		c->fault_gap / 1000);
+	lp_info(lpi, "%lu %s batches of %lu KB, rtt %" PRIu64 " us (min %" PRIu64 "), bandwidth %" PRIu64 " KB/s\n",
+		c->nr_batches, c->ops->name, c->nr_batches ? c->batch_bytes / c->nr_batches >> 10 : 0, c->rtt / 1000,
+		c->rtt_min / 1000, c->bw >> 10);
+	lp_info(lpi, "Last batch %lu KB, %u in flight\n", c->len >> 10, c->depth);
+	lp_info(lpi, "%lu hot and %lu cold pages in the background, %lu hot after the cold ones\n", lpi->xfer_hot,
+		lpi->xfer_cold, lpi->xfer_hot_late);
+	if (opts.lazy_push)
+		lp_info(lpi, "%lu pages pushed by the page server\n", lpi->pushed_pages);
+
 #if 0
 	if ((lpi->copied_pages != lpi->total_pages) && (lpi->total_pages > 0)) {
 		lp_warn(lpi, "Only %ld of %ld pages transferred via UFFD\n"
@@ -1240,7 +1502,180 @@ static void lazy_pages_summary(struct lazy_pages_info *lpi)
 #endif
 }
 
-static int handle_requests(int epollfd, struct epoll_event **events, int nr_fds)
+/*
+ * With --lazy-workers the processes are split between forked workers
+ * once the restore is finished, so that a process that faults a lot
+ * doesn't delay the faults of the others. The workers are processes,
+ * not threads, as neither the logging nor the page_read objects are
+ * thread-safe, and this way each worker has its own copy of all the
+ * page_read-s. The pages are read with pread(), so the shared image
+ * files are fine.
+ *
+ * A forked process stays with the worker of its parent, as the fork
+ * event comes via the parent's userfaultfd.
+ */
+static pid_t lazy_workers[LAZY_WORKERS_MAX];
+static unsigned int nr_lazy_workers;
+static unsigned int lazy_worker_id;
+static bool lazy_workers_started;
+
+static unsigned int lazy_workers_nr(void)
+{
+	if (opts.lazy_workers <= 1)
+		return 1;
+
+	/* The remote pages come over the only page server connection */
+	if (opts.use_page_server)
+		return 1;
+
+	return min_t(unsigned int, opts.lazy_workers, LAZY_WORKERS_MAX);
+}
+
+/* Leaves in the lpis list only the processes served by this worker */
+static int shard_lpis(unsigned int nr, int old_epollfd)
+{
+	struct lazy_pages_info *lpi, *n;
+	unsigned int i = 0;
+
+	list_for_each_entry_safe(lpi, n, &lpis, l) {
+		if (i++ % nr == lazy_worker_id) {
+			if (lazy_worker_id && !lpi->exited && epoll_add_rfd(epollfd, &lpi->lpfd))
+				return -1;
+			continue;
+		}
+
+		/*
+		 * The epoll is shared with the workers until they
+		 * have their own ones, so the worker 0 only drops
+		 * what is served by others.
+		 */
+		if (!lazy_worker_id && !lpi->exited && epoll_del_rfd(old_epollfd, &lpi->lpfd))
+			return -1;
+		if (lpi->lpfd.fd > 0)
+			close(lpi->lpfd.fd);
+		lpi->lpfd.fd = -1;
+
+		/* The other lpis may refer to it as to their parent */
+		list_del_init(&lpi->l);
+	}
+
+	return 0;
+}
+
+static int start_lazy_workers(int nr_fds)
+{
+	unsigned int nr = lazy_workers_nr(), nr_lpis = 0, id;
+	struct lazy_pages_info *lpi;
+	int old_epollfd = epollfd;
+	pid_t pid = -1;
+
+	list_for_each_entry(lpi, &lpis, l)
+		nr_lpis++;
+	nr = min(nr, nr_lpis);
+
+	if (lazy_workers_started || nr <= 1)
+		return 0;
+
+	lazy_workers_started = true;
+
+	for (id = 1; id < nr; id++) {
+		pid = fork();
+		if (pid < 0) {
+			pr_perror("Can't fork lazy-pages worker");
+			return -1;
+		}
+
+		if (pid == 0)
+			break;
+
+		lazy_workers[nr_lazy_workers++] = pid;
+	}
+
+	if (pid == 0) {
+		lazy_worker_id = id;
+		nr_lazy_workers = 0;
+
+		epollfd = epoll_create(nr_fds);
+		if (epollfd < 0) {
+			pr_perror("Can't create epoll for worker %u", id);
+			return -1;
+		}
+		close(old_epollfd);
+		close_safe(&lazy_sk_rfd.fd);
+	}
+
+	if (shard_lpis(nr, old_epollfd))
+		return -1;
+
+	pr_info("Lazy-pages worker %u started\n", lazy_worker_id);
+	return 0;
+}
+
+static int wait_lazy_workers(int ret)
+{
+	unsigned int i;
+	int status;
+
+	if (lazy_worker_id)
+		exit(ret ? 1 : 0);
+
+	for (i = 0; i < nr_lazy_workers; i++) {
+		if (ret)
+			kill(lazy_workers[i], SIGKILL);
+
+		if (waitpid(lazy_workers[i], &status, 0) != lazy_workers[i]) {
+			pr_perror("Unable to wait for lazy-pages worker %d", lazy_workers[i]);
+			ret = -1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			pr_err("Lazy-pages worker %d failed (status 0x%x)\n", lazy_workers[i], status);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * The push starts once the restore is finished, as the pages can't be
+ * placed while the restorer remaps the memory.
+ */
+static int start_lazy_push(void)
+{
+	static bool started;
+
+	if (!opts.lazy_push || started)
+		return 0;
+
+	started = true;
+	return page_server_start_push(uffd_push_complete);
+}
+
+/*
+ * Serves the page faults of the events handled so far, and sends the
+ * requests for the remote pages of both the faults and the background
+ * transfer in one go.
+ */
+static int flush_requests(void)
+{
+	struct lazy_pages_info *lpi;
+
+again:
+	/* an exited process is moved to the end of the list */
+	list_for_each_entry(lpi, &lpis, l) {
+		if (lpi->nr_pfs) {
+			if (handle_page_faults(lpi))
+				return -1;
+			goto again;
+		}
+	}
+
+	return flush_remote_pages();
+}
+
+static int handle_requests(struct epoll_event **events, int nr_fds)
 {
 	struct lazy_pages_info *lpi, *n;
 	int poll_timeout = -1;
@@ -1250,12 +1685,22 @@ static int handle_requests(int epollfd, struct epoll_event **events, int nr_fds)
 		ret = epoll_run_rfds(epollfd, *events, nr_fds, poll_timeout);
 		if (ret < 0)
 			goto out;
+		if (flush_requests()) {
+			ret = -1;
+			goto out;
+		}
 		if (ret > 0) {
 			ret = complete_forks(epollfd, events, &nr_fds);
 			if (ret < 0)
 				goto out;
-			if (restore_finished)
-				poll_timeout = 0;
+			if (restore_finished) {
+				if (start_lazy_workers(nr_fds) || start_lazy_push()) {
+					ret = -1;
+					goto out;
+				}
+				/* Nothing to request while the page server pushes */
+				poll_timeout = page_server_pushing() ? -1 : 0;
+			}
 			if (!restore_finished || !ret)
 				continue;
 		}
@@ -1264,14 +1709,14 @@ static int handle_requests(int epollfd, struct epoll_event **events, int nr_fds)
 		ret = 0;
 
 		list_for_each_entry_safe(lpi, n, &lpis, l) {
-			if (!list_empty(&lpi->iovs) && list_empty(&lpi->reqs)) {
+			if (!page_server_pushing() && !list_empty(&lpi->iovs) && nr_xfer_reqs(lpi) < lpi->xfer.depth) {
 				ret = xfer_pages(lpi);
 				if (ret < 0)
 					goto out;
 				break;
 			}
 
-			if (list_empty(&lpi->reqs)) {
+			if (list_empty(&lpi->iovs) && list_empty(&lpi->reqs)) {
 				lazy_pages_summary(lpi);
 				list_del(&lpi->l);
 				lpi_put(lpi);
@@ -1283,7 +1728,7 @@ static int handle_requests(int epollfd, struct epoll_event **events, int nr_fds)
 	}
 
 out:
-	return ret;
+	return wait_lazy_workers(ret);
 }
 
 int lazy_pages_finish_restore(void)
@@ -1417,6 +1862,8 @@ int cr_lazy_pages(bool daemon)
 	if (prepare_dummy_pstree())
 		return -1;
 
+	lazy_thp_init();
+
 	lazy_sk = prepare_lazy_socket();
 	if (lazy_sk < 0)
 		return -1;
@@ -1464,9 +1911,10 @@ int cr_lazy_pages(bool daemon)
 			xfree(events);
 			return -1;
 		}
+
 	}
 
-	ret = handle_requests(epollfd, &events, nr_fds);
+	ret = handle_requests(&events, nr_fds);
 
 	disconnect_from_page_server();
 
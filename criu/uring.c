@@ -0,0 +1,568 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "common/config.h"
+#include "cr_options.h"
+#include "kerndat.h"
+#include "page.h"
+#include "uring.h"
+#include "util.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "uring: "
+
+#ifdef CONFIG_HAS_IO_URING
+#include <linux/io_uring.h>
+
+/*
+ * There's no liburing dependency, the ring is set up and driven with
+ * the raw syscalls. The ring belongs to the process that has set it
+ * up, so the forked dump workers and page server streams get their
+ * own ones on first use.
+ *
+ * Reads and small writes (bfd buffer flushes) are submitted in
+ * batches, the big writes and the splices are submitted right away to
+ * get the disk busy as soon as possible. The splices are never left in
+ * the queue also because the caller may block on writing more data
+ * into the pipe. Short reads and writes are resubmitted for the rest
+ * of the data from the completion handler.
+ */
+
+#define URING_BATCH	  8
+#define URING_BATCH_BYTES (64 << 10)
+
+/* Memory registered with the ring and used for bfd buffers */
+#define URING_FIXED_PAGES 64
+
+struct uring_req {
+	bool busy;
+	u8 opcode;
+	int pipe;
+	int fd;
+	void *buf;
+	unsigned long len;
+	off_t off;
+	uring_done_fn done;
+	void *arg;
+};
+
+static struct uring {
+	pid_t owner;
+	int fd;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+
+	unsigned int depth;
+	unsigned int inflight;
+	unsigned int pending;
+	unsigned int next_req;
+	struct uring_req *reqs;
+
+	void *fixed;
+	bool fixed_registered;
+	bool fixed_claimed;
+	bool failed;
+} ring = {
+	.fd = -1,
+};
+
+static bool uring_disabled;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_probe(void)
+{
+	struct io_uring_params p = {};
+	struct io_uring_probe *probe;
+	size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	bool ret = false;
+	int fd;
+
+	fd = sys_io_uring_setup(2, &p);
+	if (fd < 0) {
+		pr_debug("io_uring isn't available: %s\n", strerror(errno));
+		return false;
+	}
+
+	probe = xzalloc(len);
+	if (!probe)
+		goto out;
+
+	if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		pr_debug("Can't probe io_uring ops: %s\n", strerror(errno));
+		goto out;
+	}
+
+	if (probe->last_op < IORING_OP_SPLICE) {
+		pr_debug("io_uring doesn't know splice\n");
+		goto out;
+	}
+
+	ret = (probe->ops[IORING_OP_SPLICE].flags & IO_URING_OP_SUPPORTED) &&
+	      (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+	      (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+	      (probe->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED);
+out:
+	xfree(probe);
+	close(fd);
+	return ret;
+}
+
+static void uring_unmap(void)
+{
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_sz);
+	if (ring.cq_ring)
+		munmap(ring.cq_ring, ring.cq_ring_sz);
+	if (ring.sq_ring)
+		munmap(ring.sq_ring, ring.sq_ring_sz);
+	close_safe(&ring.fd);
+
+	ring.sqes = NULL;
+	ring.cq_ring = ring.sq_ring = NULL;
+	ring.fixed_registered = false;
+}
+
+static int uring_register_fixed(void)
+{
+	struct iovec iov;
+
+	if (!ring.fixed) {
+		ring.fixed = mmap(NULL, URING_FIXED_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ring.fixed == MAP_FAILED) {
+			ring.fixed = NULL;
+			return 0;
+		}
+	}
+
+	iov.iov_base = ring.fixed;
+	iov.iov_len = URING_FIXED_PAGES * PAGE_SIZE;
+	if (sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+		/* E.g. RLIMIT_MEMLOCK, the buffers are just used unregistered */
+		pr_warn("Can't register buffers: %s\n", strerror(errno));
+		ring.fixed_registered = false;
+		return 0;
+	}
+
+	ring.fixed_registered = true;
+	return 0;
+}
+
+static int uring_setup(void)
+{
+	struct io_uring_params p = {};
+
+	/* Inherited from the parent, the rings are not ours to touch */
+	if (ring.fd >= 0)
+		uring_unmap();
+
+	ring.depth = opts.io_uring_depth;
+	if (!ring.reqs) {
+		ring.reqs = xmalloc(ring.depth * sizeof(*ring.reqs));
+		if (!ring.reqs)
+			return -1;
+	}
+	memset(ring.reqs, 0, ring.depth * sizeof(*ring.reqs));
+	ring.inflight = ring.pending = ring.next_req = 0;
+	ring.failed = false;
+
+	ring.fd = sys_io_uring_setup(ring.depth, &p);
+	if (ring.fd < 0) {
+		pr_perror("Can't set up io_uring");
+		return -1;
+	}
+
+	ring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+			    IORING_OFF_SQ_RING);
+	ring.cq_ring = mmap(NULL, ring.cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+			    IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+			 IORING_OFF_SQES);
+	if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		pr_perror("Can't map io_uring");
+		if (ring.sq_ring == MAP_FAILED)
+			ring.sq_ring = NULL;
+		if (ring.cq_ring == MAP_FAILED)
+			ring.cq_ring = NULL;
+		if (ring.sqes == MAP_FAILED)
+			ring.sqes = NULL;
+		uring_unmap();
+		return -1;
+	}
+
+	ring.sq_head = ring.sq_ring + p.sq_off.head;
+	ring.sq_tail = ring.sq_ring + p.sq_off.tail;
+	ring.sq_mask = ring.sq_ring + p.sq_off.ring_mask;
+	ring.sq_array = ring.sq_ring + p.sq_off.array;
+	ring.cq_head = ring.cq_ring + p.cq_off.head;
+	ring.cq_tail = ring.cq_ring + p.cq_off.tail;
+	ring.cq_mask = ring.cq_ring + p.cq_off.ring_mask;
+	ring.cqes = ring.cq_ring + p.cq_off.cqes;
+
+	ring.owner = getpid();
+	pr_info("Set up io_uring with %u entries\n", p.sq_entries);
+
+	return uring_register_fixed();
+}
+
+bool uring_enabled(void)
+{
+	if (!opts.io_uring || uring_disabled)
+		return false;
+
+	if (ring.fd >= 0 && ring.owner == getpid())
+		return true;
+
+	if (!kdat.has_io_uring) {
+		pr_warn_once("io_uring is not available, images are accessed synchronously\n");
+		uring_disabled = true;
+		return false;
+	}
+
+	if (uring_setup()) {
+		pr_warn("Images are accessed synchronously\n");
+		uring_disabled = true;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The bfd buffers are taken from the registered memory, so that their
+ * flushes don't need the pages to be pinned on every write.
+ */
+void *uring_fixed_bufs(unsigned long size, unsigned int *nr)
+{
+	if (ring.fd < 0 || ring.owner != getpid() || !ring.fixed || ring.fixed_claimed)
+		return NULL;
+
+	ring.fixed_claimed = true;
+	*nr = URING_FIXED_PAGES * PAGE_SIZE / size;
+	return ring.fixed;
+}
+
+static bool uring_fixed_buf(void *buf, unsigned long len)
+{
+	return ring.fixed_registered && buf >= ring.fixed && buf + len <= ring.fixed + URING_FIXED_PAGES * PAGE_SIZE;
+}
+
+static int uring_submit(unsigned int min_complete)
+{
+	unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+	while (ring.pending || min_complete) {
+		int ret;
+
+		ret = sys_io_uring_enter(ring.fd, ring.pending, min_complete, flags);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			pr_perror("Can't submit io_uring requests");
+			return -1;
+		}
+
+		ring.pending -= ret;
+		if (min_complete)
+			break;
+	}
+
+	return 0;
+}
+
+static void uring_prep(struct uring_req *req)
+{
+	unsigned int tail = *ring.sq_tail, idx = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->opcode;
+	sqe->fd = req->fd;
+	sqe->off = req->off;
+	sqe->len = req->len;
+	sqe->user_data = req - ring.reqs;
+
+	if (req->opcode == IORING_OP_SPLICE) {
+		sqe->splice_off_in = -1;
+		sqe->splice_fd_in = req->pipe;
+		sqe->splice_flags = SPLICE_F_MOVE;
+	} else {
+		sqe->addr = (unsigned long)req->buf;
+		if (req->opcode == IORING_OP_WRITE_FIXED)
+			sqe->buf_index = 0;
+	}
+
+	ring.sq_array[idx] = idx;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.pending++;
+}
+
+static void uring_complete(struct uring_req *req, int res)
+{
+	if (res <= 0) {
+		pr_err("Can't %s %lu bytes at %jd of %d: %s\n", req->opcode == IORING_OP_READ ? "read" : "write",
+		       req->len, (intmax_t)req->off, req->fd, res ? strerror(-res) : "no progress");
+		res = res ? res : -EIO;
+		ring.failed = true;
+	} else if (res < req->len) {
+		/* Short write, the slot stays busy for the rest */
+		req->len -= res;
+		req->off += res;
+		if (req->buf)
+			req->buf += res;
+		uring_prep(req);
+		return;
+	}
+
+	req->busy = false;
+	ring.inflight--;
+	if (req->done)
+		req->done(req->arg, min(res, 0));
+}
+
+static int uring_reap(unsigned int min_complete)
+{
+	unsigned int head, tail;
+
+	if (uring_submit(min_complete))
+		return -1;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+		__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+		uring_complete(&ring.reqs[cqe->user_data], cqe->res);
+	}
+
+	return 0;
+}
+
+static struct uring_req *uring_get_req(void)
+{
+	unsigned int i;
+
+	while (ring.inflight == ring.depth)
+		if (uring_reap(1))
+			return NULL;
+
+	for (i = ring.next_req; ring.reqs[i].busy; i = (i + 1) % ring.depth)
+		;
+
+	ring.next_req = (i + 1) % ring.depth;
+	ring.inflight++;
+	ring.reqs[i].busy = true;
+	return &ring.reqs[i];
+}
+
+static int uring_queue(struct uring_req *req)
+{
+	uring_prep(req);
+
+	if (ring.pending >= URING_BATCH)
+		return uring_submit(0);
+	if (req->opcode != IORING_OP_READ && req->len >= URING_BATCH_BYTES)
+		return uring_submit(0);
+
+	return 0;
+}
+
+static bool uring_busy_fd(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < ring.depth; i++) {
+		struct uring_req *req = &ring.reqs[i];
+
+		if (req->busy && (req->fd == fd || req->pipe == fd))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Waits for all the requests that write into @fd or read from it,
+ * returns -1 if any request has failed since the ring was set up.
+ */
+int uring_wait_fd(int fd)
+{
+	if (ring.fd < 0 || ring.owner != getpid())
+		return 0;
+
+	while (uring_busy_fd(fd))
+		if (uring_reap(1))
+			return -1;
+
+	return ring.failed ? -1 : 0;
+}
+
+/*
+ * Splices @len bytes from @pipe into @fd at @off. The data is taken
+ * from the pipe in order, so the previous requests for the same pipe
+ * are waited for first. The caller has to check uring_enabled().
+ */
+int uring_splice(int pipe, int fd, off_t off, unsigned long len)
+{
+	struct uring_req *req;
+
+	if (uring_wait_fd(pipe))
+		return -1;
+
+	req = uring_get_req();
+	if (!req)
+		return -1;
+
+	req->opcode = IORING_OP_SPLICE;
+	req->pipe = pipe;
+	req->fd = fd;
+	req->buf = NULL;
+	req->len = len;
+	req->off = off;
+	req->done = NULL;
+	req->arg = NULL;
+
+	uring_prep(req);
+	return uring_submit(0);
+}
+
+/*
+ * Writes @len bytes from @buf into @fd at @off, @done is called when
+ * the data is written and @buf can be reused. The caller has to check
+ * uring_enabled().
+ */
+int uring_write(int fd, void *buf, unsigned long len, off_t off, uring_done_fn done, void *arg)
+{
+	struct uring_req *req;
+
+	req = uring_get_req();
+	if (!req)
+		return -1;
+
+	req->opcode = uring_fixed_buf(buf, len) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	req->pipe = -1;
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->off = off;
+	req->done = done;
+	req->arg = arg;
+
+	return uring_queue(req);
+}
+
+/*
+ * Reads @len bytes at @off of @fd into @buf, the data is there after
+ * uring_wait_fd(). The caller has to check uring_enabled().
+ */
+int uring_read(int fd, void *buf, unsigned long len, off_t off)
+{
+	struct uring_req *req;
+
+	req = uring_get_req();
+	if (!req)
+		return -1;
+
+	req->opcode = IORING_OP_READ;
+	req->pipe = -1;
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->off = off;
+	req->done = NULL;
+	req->arg = NULL;
+
+	return uring_queue(req);
+}
+
+/*
+ * Waits for all the requests and closes the ring, the next request
+ * sets it up again.
+ */
+void uring_close(void)
+{
+	if (ring.fd < 0 || ring.owner != getpid())
+		return;
+
+	while (ring.inflight)
+		if (uring_reap(1))
+			break;
+
+	uring_unmap();
+}
+
+#else /* CONFIG_HAS_IO_URING */
+
+bool uring_probe(void)
+{
+	return false;
+}
+
+bool uring_enabled(void)
+{
+	if (opts.io_uring)
+		pr_warn_once("CRIU was built without io_uring support, images are accessed synchronously\n");
+	return false;
+}
+
+int uring_splice(int pipe, int fd, off_t off, unsigned long len)
+{
+	return -1;
+}
+
+int uring_write(int fd, void *buf, unsigned long len, off_t off, uring_done_fn done, void *arg)
+{
+	return -1;
+}
+
+int uring_read(int fd, void *buf, unsigned long len, off_t off)
+{
+	return -1;
+}
+
+int uring_wait_fd(int fd)
+{
+	return 0;
+}
+
+void *uring_fixed_bufs(unsigned long size, unsigned int *nr)
+{
+	return NULL;
+}
+
+void uring_close(void)
+{
+}
+
+#endif /* CONFIG_HAS_IO_URING */
@@ -0,0 +1,129 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "page.h"
+#include "zero-page.h"
+#include "log.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "zero-page: "
+
+/*
+ * Zero pages are looked for in all the dumped anonymous memory, so
+ * the check is done with the widest vector instructions the CPU has.
+ * All the variants OR the page contents together and look at the
+ * result once per 256 bytes to bail out early on non-zero pages,
+ * which are the most of them.
+ */
+
+#define ZERO_CHECK_STRIDE 256
+
+static bool is_zero_page_generic(const void *page)
+{
+	const unsigned long *p = page, *end = page + PAGE_SIZE;
+
+	for (; p < end; p += ZERO_CHECK_STRIDE / sizeof(*p)) {
+		unsigned long acc = 0;
+		int i;
+
+		for (i = 0; i < ZERO_CHECK_STRIDE / sizeof(*p); i++)
+			acc |= p[i];
+		if (acc)
+			return false;
+	}
+
+	return true;
+}
+
+#if defined(__x86_64__)
+static bool is_zero_page_sse2(const void *page)
+{
+	const __m128i *p = page, *end = page + PAGE_SIZE;
+
+	for (; p < end; p += ZERO_CHECK_STRIDE / sizeof(*p)) {
+		__m128i acc = _mm_setzero_si128();
+		int i;
+
+		for (i = 0; i < ZERO_CHECK_STRIDE / sizeof(*p); i++)
+			acc = _mm_or_si128(acc, _mm_load_si128(p + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+
+	return true;
+}
+
+static __attribute__((target("avx2"))) bool is_zero_page_avx2(const void *page)
+{
+	const __m256i *p = page, *end = page + PAGE_SIZE;
+
+	for (; p < end; p += ZERO_CHECK_STRIDE / sizeof(*p)) {
+		__m256i acc = _mm256_setzero_si256();
+		int i;
+
+		for (i = 0; i < ZERO_CHECK_STRIDE / sizeof(*p); i++)
+			acc = _mm256_or_si256(acc, _mm256_load_si256(p + i));
+		if (!_mm256_testz_si256(acc, acc))
+			return false;
+	}
+
+	return true;
+}
+#elif defined(__aarch64__)
+static bool is_zero_page_neon(const void *page)
+{
+	const uint64_t *p = page, *end = page + PAGE_SIZE;
+
+	for (; p < end; p += ZERO_CHECK_STRIDE / sizeof(*p)) {
+		uint64x2_t acc = vdupq_n_u64(0);
+		int i;
+
+		for (i = 0; i < ZERO_CHECK_STRIDE / sizeof(*p); i += 2)
+			acc = vorrq_u64(acc, vld1q_u64(p + i));
+		if (vmaxvq_u32(vreinterpretq_u32_u64(acc)))
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+static bool (*is_zero_page_fn)(const void *page);
+
+static void is_zero_page_init(void)
+{
+	const char *name = "generic";
+
+	is_zero_page_fn = is_zero_page_generic;
+#if defined(__x86_64__)
+	/* SSE2 is always there on x86_64, AVX2 needs to be checked */
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		is_zero_page_fn = is_zero_page_avx2;
+		name = "avx2";
+	} else {
+		is_zero_page_fn = is_zero_page_sse2;
+		name = "sse2";
+	}
+#elif defined(__aarch64__)
+	/* NEON is mandatory on aarch64 */
+	is_zero_page_fn = is_zero_page_neon;
+	name = "neon";
+#endif
+	pr_debug("Using %s zero pages check\n", name);
+}
+
+/* The @page has to be page-aligned */
+bool is_zero_page(const void *page)
+{
+	if (!is_zero_page_fn)
+		is_zero_page_init();
+
+	return is_zero_page_fn(page);
+}
@@ -138,6 +138,10 @@ pmap_flags_map = [
     ('PE_PARENT', 1 << 0),
     ('PE_LAZY', 1 << 1),
     ('PE_PRESENT', 1 << 2),
+    ('PE_COMPRESSED', 1 << 3),
+    ('PE_DEDUP', 1 << 4),
+    ('PE_ZERO', 1 << 5),
+    ('PE_HOT', 1 << 6),
 ]
 
 flags_maps = {
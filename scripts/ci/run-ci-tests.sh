@@ -6,7 +6,7 @@ CI_PKGS=(protobuf-c-compiler libprotobuf-c-dev libaio-dev libgnutls28-dev
 		libnl-3-dev gdb bash libnet-dev util-linux asciidoctor
 		libnl-route-3-dev time libbsd-dev python3-yaml
 		libperl-dev pkg-config python3-protobuf python3-pip
-		python3-importlib-metadata python3-junit.xml libdrm-dev)
+		python3-importlib-metadata python3-junit.xml libdrm-dev libzstd-dev)
 
 X86_64_PKGS=(gcc-multilib)
 
@@ -235,6 +235,12 @@ LAZY_OPTS=(-p 2 -T "$LAZY_TESTS" "${LAZY_EXCLUDE[@]}" "${ZDTM_OPTS[@]}")
 ./test/zdtm.py run "${LAZY_OPTS[@]}" --remote-lazy-pages
 ./test/zdtm.py run "${LAZY_OPTS[@]}" --remote-lazy-pages --tls
 
+# The multiplexed streaming is run against the in-tree test streamer,
+# the dump workers stream the pages images at once with it
+STREAM_MUX_TESTS=(-t zdtm/static/env00 -t zdtm/static/maps00 -t zdtm/static/mem_workers00
+	-t zdtm/static/shmem_workers00 -t zdtm/static/files_many00 -t zdtm/transition/fork)
+./test/zdtm.py run -p 2 "${STREAM_MUX_TESTS[@]}" --stream-mux "${ZDTM_OPTS[@]}"
+
 bash -x ./test/jenkins/criu-fault.sh
 if [ "$UNAME_M" == "x86_64" ]; then
 	# This fails on aarch64 (aws-graviton2) with:
@@ -202,3 +202,13 @@ int main(void)
 	return 0;
 }
 endef
+
+define FEATURE_TEST_IO_URING
+
+#include <linux/io_uring.h>
+
+int main(void)
+{
+	return IORING_OP_SPLICE + IORING_OP_WRITE_FIXED + IORING_REGISTER_PROBE;
+}
+endef
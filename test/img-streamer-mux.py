@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+#
+# A test peer for the multiplexed streaming protocol of criu (--stream-mux),
+# see criu/img-streamer.c for the protocol. It takes the command line of
+# criu-image-streamer, so zdtm.py runs it the same way: the captured images
+# go to stdout and the images to serve or extract come from stdin.
+#
+# The stream is a sequence of records, one per image:
+#
+#   u32 name length, u64 data length, name, data
+#
+import argparse
+import json
+import os
+import select
+import socket
+import struct
+import sys
+
+MUX_VERSION = 1
+MUX_WINDOW = 4 << 20
+MUX_CHUNK = 1 << 20
+
+MUX_HELLO = 1
+MUX_OPEN = 2
+MUX_REPLY = 3
+MUX_DATA = 4
+MUX_CREDIT = 5
+MUX_CLOSE = 6
+
+frame_hdr = struct.Struct("=IIII")
+record_hdr = struct.Struct("=IQ")
+
+
+class mux_exc(Exception):
+    pass
+
+
+def recv_all(sk, size):
+    buf = bytearray()
+    while len(buf) < size:
+        data = sk.recv(size - len(buf))
+        if not data:
+            if buf:
+                raise mux_exc("criu has closed the connection mid-frame")
+            return None
+        buf += data
+    return bytes(buf)
+
+
+def recv_frame(sk):
+    hdr = recv_all(sk, frame_hdr.size)
+    if hdr is None:
+        return None
+    cmd, chan, size, arg = frame_hdr.unpack(hdr)
+    payload = recv_all(sk, size) if size else b""
+    if payload is None:
+        raise mux_exc("criu has closed the connection mid-frame")
+    return cmd, chan, arg, payload
+
+
+def send_frame(sk, cmd, chan, arg, payload=b""):
+    sk.sendall(frame_hdr.pack(cmd, chan, len(payload), arg) + payload)
+
+
+def read_records(f):
+    images = {}
+    while True:
+        hdr = f.read(record_hdr.size)
+        if not hdr:
+            return images
+        if len(hdr) != record_hdr.size:
+            raise mux_exc("Truncated image stream")
+        name_len, data_len = record_hdr.unpack(hdr)
+        name = f.read(name_len).decode()
+        data = f.read(data_len)
+        if len(data) != data_len:
+            raise mux_exc("Truncated image %s" % name)
+        images[name] = data
+
+
+def write_records(f, images):
+    for name, data in images.items():
+        name = name.encode()
+        f.write(record_hdr.pack(len(name), len(data)))
+        f.write(name)
+        f.write(data)
+    f.flush()
+
+
+def report(progress, msg):
+    progress.write(msg + "\n")
+    progress.flush()
+
+
+def report_stats(progress, images):
+    report(progress, json.dumps({
+        "img_size": sum(len(d) for d in images.values()),
+        "nr_images": len(images),
+    }))
+
+
+def accept(images_dir, name, progress):
+    path = os.path.join(images_dir, name)
+    if os.path.exists(path):
+        os.unlink(path)
+
+    lsk = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    lsk.bind(path)
+    lsk.listen(1)
+    report(progress, "socket-init")
+    progress.close()
+
+    sk, _ = lsk.accept()
+    lsk.close()
+    os.unlink(path)
+
+    f = recv_frame(sk)
+    if f is None or f[0] != MUX_HELLO or f[3]:
+        raise mux_exc("criu hasn't said hello")
+    if f[2] != MUX_VERSION:
+        raise mux_exc("Unsupported protocol version %d" % f[2])
+    send_frame(sk, MUX_HELLO, 0, MUX_VERSION)
+    return sk
+
+
+def capture(args, progress):
+    sk = accept(args.images_dir, "streamer-capture.sock", progress)
+    chans = {}
+    images = {}
+
+    while True:
+        f = recv_frame(sk)
+        if f is None:
+            break
+
+        cmd, chan, arg, payload = f
+        if cmd == MUX_OPEN:
+            if chan in chans:
+                raise mux_exc("Channel %d is open already" % chan)
+            chans[chan] = [payload.decode(), bytearray()]
+        elif cmd == MUX_DATA:
+            if chan not in chans:
+                raise mux_exc("Data for unknown channel %d" % chan)
+            # Every frame is credited back at once, so it's the window
+            if len(payload) > MUX_WINDOW:
+                raise mux_exc("Channel %d has overrun its window" % chan)
+            chans[chan][1] += payload
+            send_frame(sk, MUX_CREDIT, chan, len(payload))
+        elif cmd == MUX_CLOSE:
+            if chan not in chans:
+                raise mux_exc("Close of unknown channel %d" % chan)
+            name, data = chans.pop(chan)
+            # An image written twice is the latest one
+            images.pop(name, None)
+            images[name] = bytes(data)
+        else:
+            raise mux_exc("Unexpected frame %d for channel %d" % (cmd, chan))
+
+    if chans:
+        raise mux_exc("criu has left %d channels open" % len(chans))
+
+    write_records(sys.stdout.buffer, images)
+    print("Captured %d images" % len(images), file=sys.stderr)
+
+
+class serve_chan:
+    def __init__(self, data):
+        self.data = memoryview(data)
+        self.off = 0
+        self.credit = MUX_WINDOW
+
+
+def serve_frame(sk, images, chans, f):
+    cmd, chan, arg, payload = f
+    if cmd == MUX_OPEN:
+        name = payload.decode()
+        exists = name in images
+        send_frame(sk, MUX_REPLY, chan, int(exists))
+        if exists:
+            chans[chan] = serve_chan(images[name])
+    elif cmd == MUX_CREDIT:
+        if chan in chans:
+            chans[chan].credit += arg
+    elif cmd == MUX_CLOSE:
+        # The image isn't read till the end, criu waits for our close
+        c = chans.get(chan)
+        if c:
+            c.off = len(c.data)
+    else:
+        raise mux_exc("Unexpected frame %d for channel %d" % (cmd, chan))
+
+
+def serve_data(sk, chans):
+    sent = False
+    for chan, c in list(chans.items()):
+        size = min(len(c.data) - c.off, c.credit, MUX_CHUNK)
+        if size:
+            send_frame(sk, MUX_DATA, chan, 0, c.data[c.off:c.off + size])
+            c.off += size
+            c.credit -= size
+            sent = True
+        if c.off == len(c.data):
+            send_frame(sk, MUX_CLOSE, chan, 0)
+            del chans[chan]
+            sent = True
+    return sent
+
+
+def serve(args, progress):
+    images = read_records(sys.stdin.buffer)
+    report_stats(progress, images)
+    sk = accept(args.images_dir, "streamer-serve.sock", progress)
+    chans = {}
+    sendable = False
+
+    while True:
+        # The frames of criu come first, they may close the channels
+        r, _, _ = select.select([sk], [], [], 0 if sendable else None)
+        if r:
+            f = recv_frame(sk)
+            if f is None:
+                break
+            serve_frame(sk, images, chans, f)
+        sendable = serve_data(sk, chans)
+
+    print("Served %d images" % len(images), file=sys.stderr)
+
+
+def extract(args, progress):
+    images = read_records(sys.stdin.buffer)
+    report_stats(progress, images)
+    progress.close()
+
+    for name, data in images.items():
+        with open(os.path.join(args.images_dir, name), "wb") as f:
+            f.write(data)
+
+
+def main():
+    p = argparse.ArgumentParser("img-streamer-mux")
+    p.add_argument("--images-dir", default=".")
+    p.add_argument("--progress-fd", type=int)
+    p.add_argument("--version", action="store_true")
+    p.add_argument("action", nargs="?", choices=["capture", "serve", "extract"])
+    args = p.parse_args()
+
+    if args.version:
+        print("img-streamer-mux %d" % MUX_VERSION)
+        return 0
+    if not args.action:
+        p.error("no action given")
+
+    if args.progress_fd is None:
+        progress = open(os.devnull, "w")
+    else:
+        progress = os.fdopen(args.progress_fd, "w")
+
+    try:
+        globals()[args.action](args, progress)
+    except (mux_exc, OSError) as e:
+        print("Error: %s" % e, file=sys.stderr)
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
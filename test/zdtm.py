@@ -586,6 +586,12 @@ class zdtm_test:
         return self.__getcropts() + self.__freezer.getropts(
         ) + self.__desc.get('ropts', '').split()
 
+    def getlpopts(self):
+        return self.__desc.get('lpopts', '').split()
+
+    def getlogs(self):
+        return self.__desc.get('logs', {})
+
     def unlink_pidfile(self):
         self.__pid = 0
         os.unlink(self.__pidfile())
@@ -618,6 +624,18 @@ class zdtm_test:
     def blocking(self):
         return test_flag(self.__desc, 'crfail')
 
+    def page_server(self):
+        return test_flag(self.__desc, 'pageserver')
+
+    def lazy_pages(self):
+        return test_flag(self.__desc, 'lazy')
+
+    def remote_lazy_pages(self):
+        return test_flag(self.__desc, 'remotelazy')
+
+    def images_file(self):
+        return test_flag(self.__desc, 'imagesfile')
+
     @staticmethod
     def available():
         if not os.access("umount2", os.X_OK):
@@ -1055,8 +1073,10 @@ class criu:
         self.__user = bool(opts['user'])
         self.__rootless = bool(opts['rootless'])
         self.__leave_stopped = bool(opts['stop'])
-        self.__stream = bool(opts['stream'])
+        self.__stream_mux = bool(opts['stream_mux'])
+        self.__stream = bool(opts['stream']) or self.__stream_mux
         self.__show_stats = bool(opts['show_stats'])
+        self.__images_file = False
         self.__lazy_pages_p = None
         self.__page_server_p = None
         self.__dump_process = None
@@ -1100,13 +1120,34 @@ class criu:
             if ret:
                 raise test_fail_exc("criu-image-streamer exited with %s" % ret)
 
-        return
+        self.check_logs()
+
+    # The messages the test expects in the logs of the last iteration
+    def check_logs(self):
+        tlogs = getattr(self.__test, "getlogs", lambda: {})()
+        for name, patterns in tlogs.items():
+            path = os.path.join(self.__ddir(), name)
+            if not isinstance(patterns, list):
+                patterns = [patterns]
+            with open(path) as f:
+                log = f.read()
+            for pattern in patterns:
+                if not re.search(pattern, log, re.M):
+                    raise test_fail_exc("no \"%s\" in %s" % (pattern, path))
 
     def logs(self):
         return self.__dump_path
 
     def set_test(self, test):
         self.__test = test
+        if getattr(test, "page_server", lambda: False)():
+            self.__page_server = True
+        if getattr(test, "lazy_pages", lambda: False)():
+            self.__lazy_pages = True
+        if getattr(test, "remote_lazy_pages", lambda: False)():
+            self.__remote_lazy_pages = True
+            self.__lazy_pages = True
+        self.__images_file = getattr(test, "images_file", lambda: False)()
         self.__dump_path = "dump/" + test.getname() + "/" + test.getpid()
         if os.path.exists(self.__dump_path):
             for i in range(100):
@@ -1136,6 +1177,12 @@ class criu:
     def __ddir(self):
         return os.path.join(self.__dump_path, "%d" % self.__iter)
 
+    def __images_file_opts(self):
+        if not self.__images_file:
+            return []
+        return ["--images-file",
+                os.path.realpath(os.path.join(self.__ddir(), "images.img"))]
+
     def set_user_id(self):
         # Numbers should match those in zdtm_test
         os.setresgid(58467, 58467, 58467)
@@ -1253,12 +1300,23 @@ class criu:
         if not os.access(self.__stats_file("dump"), os.R_OK):
             return
 
+        # the pages images are in the images file
+        if self.__images_file:
+            return
+
         stats_written = -1
         with open(self.__stats_file("dump"), 'rb') as stfile:
             stats = crpc.images.load(stfile)
             stent = stats['entries'][0]['dump']
             stats_written = int(stent['shpages_written']) + int(
                 stent['pages_written'])
+            # compressed pages take compressed_bytes in pages images
+            stats_compressed = int(stent.get('pages_compressed', 0))
+            stats_compressed_bytes = int(stent.get('compressed_bytes', 0))
+            # deduplicated pages are not in pages-store.img
+            stats_deduped = int(stent.get('pages_deduped', 0))
+            # zero pages are not written at all
+            stats_zero = int(stent.get('pages_zero', 0))
 
         if self.__stream:
             self.spawn_criu_image_streamer("extract")
@@ -1271,6 +1329,9 @@ class criu:
             if f.startswith('pages-'):
                 real_written += os.path.getsize(os.path.join(self.__ddir(), f))
 
+        real_written += stats_compressed * mmap.PAGESIZE - stats_compressed_bytes
+        real_written += (stats_deduped + stats_zero) * mmap.PAGESIZE
+
         if self.__stream:
             # make sure the extracted image is not usable.
             os.unlink(os.path.join(self.__ddir(), "inventory.img"))
@@ -1292,16 +1353,22 @@ class criu:
         fcntl.fcntl(progress_r, fcntl.F_SETFD, fcntl.FD_CLOEXEC)
         fcntl.fcntl(progress_w, fcntl.F_SETFD, 0)
 
+        # The multiplexed protocol is served by the in-tree test peer
+        if self.__stream_mux:
+            streamer = os.path.join(os.getcwd(), "img-streamer-mux.py")
+        else:
+            streamer = "criu-image-streamer"
+
         # We use cat because the streamer requires to work with pipes.
         if action == 'capture':
-            cmd = ["criu-image-streamer",
+            cmd = [streamer,
                    "--images-dir '{images_dir}'",
                    "--progress-fd {progress_fd}",
                    action,
                    "| cat > {img_file}"]
         else:
             cmd = ["cat {img_file} |",
-                   "criu-image-streamer",
+                   streamer,
                    "--images-dir '{images_dir}'",
                    "--progress-fd {progress_fd}",
                    action]
@@ -1373,10 +1440,13 @@ class criu:
             ] + self.__tls
 
         a_opts += self.__test.getdopts()
+        a_opts += self.__images_file_opts()
 
         if self.__stream:
             self.spawn_criu_image_streamer("capture")
             a_opts += ["--stream"]
+            if self.__stream_mux:
+                a_opts += ["--stream-mux"]
 
         if self.__dedup:
             a_opts += ["--auto-dedup"]
@@ -1430,6 +1500,7 @@ class criu:
             r_opts = ["--restore-sibling"]
             self.__test.auto_reap = False
         r_opts += self.__test.getropts()
+        r_opts += self.__images_file_opts()
         if self.__join_ns:
             r_opts.append("--join-ns")
             r_opts.append("net:%s" % join_ns_file)
@@ -1440,6 +1511,8 @@ class criu:
         if self.__stream:
             self.spawn_criu_image_streamer("serve")
             r_opts += ["--stream"]
+            if self.__stream_mux:
+                r_opts += ["--stream-mux"]
 
         if self.__dedup:
             r_opts += ["--auto-dedup"]
@@ -1457,6 +1530,7 @@ class criu:
                     "--page-server", "--port", "12345", "--address",
                     "127.0.0.1"
                 ] + self.__tls
+            lp_opts += getattr(self.__test, "getlpopts", lambda: [])()
 
             if self.__remote_lazy_pages:
                 ps_opts = [
@@ -2082,8 +2156,8 @@ class Launcher:
               'sat', 'script', 'rpc', 'criu_config', 'lazy_pages', 'join_ns',
               'dedup', 'sbs', 'freezecg', 'user', 'dry_run', 'noauto_dedup',
               'remote_lazy_pages', 'show_stats', 'lazy_migrate', 'stream',
-              'tls', 'criu_bin', 'crit_bin', 'pre_dump_mode', 'mntns_compat_mode',
-              'rootless')
+              'stream_mux', 'tls', 'criu_bin', 'crit_bin', 'pre_dump_mode',
+              'mntns_compat_mode', 'rootless')
         arg = repr((name, desc, flavor, {d: self.__opts[d] for d in nd}))
 
         if self.__use_log:
@@ -2737,6 +2811,9 @@ def get_cli_args():
     rp.add_argument("--stream",
                     help="Use criu-image-streamer",
                     action='store_true')
+    rp.add_argument("--stream-mux",
+                    help="Stream the images over one multiplexed connection to the in-tree test streamer",
+                    action='store_true')
     rp.add_argument("-p", "--parallel", help="Run test in parallel")
     rp.add_argument("--dry-run",
                     help="Don't run tests, just pretend to",
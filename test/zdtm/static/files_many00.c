@@ -0,0 +1,86 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check a task with a lot of open files";
+
+char *filename;
+TEST_OPTION(filename, string, "file name", 1);
+
+#define NR_REG	 1024
+#define NR_PIPES 256
+
+int main(int argc, char **argv)
+{
+	static int reg[NR_REG], pipes[NR_PIPES][2];
+	struct stat st, st2;
+	struct rlimit rlim;
+	unsigned char c;
+	int i;
+
+	test_init(argc, argv);
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim)) {
+		pr_perror("Can't get RLIMIT_NOFILE");
+		return 1;
+	}
+
+	if (rlim.rlim_cur < NR_REG + 2 * NR_PIPES + 64) {
+		rlim.rlim_cur = NR_REG + 2 * NR_PIPES + 64;
+		if (setrlimit(RLIMIT_NOFILE, &rlim)) {
+			pr_perror("Can't set RLIMIT_NOFILE");
+			return 1;
+		}
+	}
+
+	/* Each open() is a file of its own, at an offset of its own */
+	for (i = 0; i < NR_REG; i++) {
+		reg[i] = open(filename, O_RDWR | O_CREAT, 0644);
+		if (reg[i] < 0 || lseek(reg[i], i, SEEK_SET) != i) {
+			pr_perror("Can't open %s", filename);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < NR_PIPES; i++) {
+		c = i;
+		if (pipe(pipes[i]) || write(pipes[i][1], &c, 1) != 1) {
+			pr_perror("Can't create pipe");
+			return 1;
+		}
+	}
+
+	if (fstat(reg[0], &st)) {
+		pr_perror("Can't stat %s", filename);
+		return 1;
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_REG; i++) {
+		if (fstat(reg[i], &st2) || st2.st_ino != st.st_ino || st2.st_dev != st.st_dev) {
+			fail("File %d is not %s", i, filename);
+			return 1;
+		}
+
+		if (lseek(reg[i], 0, SEEK_CUR) != i) {
+			fail("File %d has a wrong offset", i);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < NR_PIPES; i++) {
+		if (read(pipes[i][0], &c, 1) != 1 || c != (unsigned char)i) {
+			fail("Pipe %d has lost its data", i);
+			return 1;
+		}
+	}
+
+	unlink(filename);
+	pass();
+	return 0;
+}
@@ -0,0 +1 @@
+files_many00.c
\ No newline at end of file
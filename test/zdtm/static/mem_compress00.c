@@ -0,0 +1,56 @@
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check memory dumped in compressed frames";
+
+/* Not a multiple of frames and chunks sizes */
+#define NR_PAGES 601
+
+int main(int argc, char **argv)
+{
+	size_t size = NR_PAGES * PAGE_SIZE;
+	uint8_t *mem, *copy;
+	uint32_t crc = 0;
+	int i;
+
+	test_init(argc, argv);
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	copy = malloc(size);
+	if (mem == MAP_FAILED || !copy) {
+		pr_perror("Can't allocate memory");
+		return 1;
+	}
+
+	/*
+	 * Mix well compressible pages with random ones, so that
+	 * both compressed and raw frames get into the image.
+	 */
+	for (i = 0; i < NR_PAGES; i++) {
+		uint8_t *page = mem + i * PAGE_SIZE;
+
+		if ((i / 13) % 3)
+			memset(page, i, PAGE_SIZE);
+		else
+			datagen(page, PAGE_SIZE, &crc);
+	}
+	/* Leave a hole in the middle */
+	munmap(mem + 300 * PAGE_SIZE, PAGE_SIZE);
+	memcpy(copy, mem, 300 * PAGE_SIZE);
+	memcpy(copy + 301 * PAGE_SIZE, mem + 301 * PAGE_SIZE, size - 301 * PAGE_SIZE);
+
+	test_daemon();
+	test_waitsig();
+
+	if (memcmp(copy, mem, 300 * PAGE_SIZE) ||
+	    memcmp(copy + 301 * PAGE_SIZE, mem + 301 * PAGE_SIZE, size - 301 * PAGE_SIZE)) {
+		fail("Memory is corrupted");
+		return 1;
+	}
+
+	pass();
+	return 0;
+}
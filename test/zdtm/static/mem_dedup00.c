@@ -0,0 +1,134 @@
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check memory of tasks with identical pages dumped into pages store";
+
+#define NR_TASKS 4
+#define NR_PAGES 64
+
+/*
+ * Every task has the pages inherited from the parent, the
+ * zero pages and the pages of its own, so only the last ones
+ * and one copy of the others should get into the store.
+ */
+
+static int check_mem(uint8_t *same, uint8_t *zero, uint8_t *own, int nr)
+{
+	uint32_t crc;
+	int i;
+
+	crc = ~0;
+	if (datachk(same, NR_PAGES * PAGE_SIZE, &crc)) {
+		fail("Same pages of task %d are corrupted", nr);
+		return 1;
+	}
+
+	for (i = 0; i < NR_PAGES * PAGE_SIZE; i++) {
+		if (zero[i]) {
+			fail("Zero pages of task %d are corrupted", nr);
+			return 1;
+		}
+	}
+
+	crc = ~nr;
+	if (datachk(own, NR_PAGES * PAGE_SIZE, &crc)) {
+		fail("Own pages of task %d are corrupted", nr);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int child(task_waiter_t *t, uint8_t *same, int nr)
+{
+	size_t size = NR_PAGES * PAGE_SIZE;
+	uint8_t *zero, *own;
+	uint32_t crc;
+
+	zero = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (zero == MAP_FAILED) {
+		pr_perror("Can't map memory");
+		return 1;
+	}
+	own = zero + size;
+
+	/* populate the zero pages so that they are dumped */
+	memset(zero, 0, size);
+	crc = ~nr;
+	datagen(own, size, &crc);
+
+	task_waiter_complete_current(t);
+
+	test_waitsig();
+
+	return check_mem(same, zero, own, nr);
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = NR_PAGES * PAGE_SIZE;
+	pid_t pids[NR_TASKS];
+	task_waiter_t t;
+	int i, status, ret = 0;
+	uint8_t *same;
+	uint32_t crc;
+
+	test_init(argc, argv);
+	task_waiter_init(&t);
+
+	same = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (same == MAP_FAILED) {
+		pr_perror("Can't map memory");
+		return 1;
+	}
+
+	crc = ~0;
+	datagen(same, size, &crc);
+
+	for (i = 0; i < NR_TASKS; i++) {
+		pids[i] = test_fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork");
+			return 1;
+		}
+
+		if (pids[i] == 0)
+			exit(child(&t, same, i));
+
+		task_waiter_wait4(&t, pids[i]);
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_TASKS; i++) {
+		kill(pids[i], SIGTERM);
+		if (waitpid(pids[i], &status, 0) != pids[i]) {
+			pr_perror("Can't wait for %d", pids[i]);
+			ret = 1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fail("Task %d exited with 0x%x", i, status);
+			ret = 1;
+		}
+	}
+
+	crc = ~0;
+	if (datachk(same, size, &crc)) {
+		fail("Same pages of the parent are corrupted");
+		ret = 1;
+	}
+
+	if (!ret)
+		pass();
+
+	return ret;
+}
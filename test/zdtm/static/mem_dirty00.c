@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check memory dirtied at a steady rate while being dumped";
+
+#define MEM_PAGES  64
+#define DIRTY_RATE 8 /* pages per ms */
+
+int main(int argc, char **argv)
+{
+	/* Volatile to keep the page written before its backup */
+	volatile unsigned *backup;
+	unsigned rover = 0, pfn;
+	void *mem;
+	int i, fail = 0;
+
+	test_init(argc, argv);
+
+	mem = mmap(NULL, MEM_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	backup = calloc(MEM_PAGES, sizeof(*backup));
+	if (mem == MAP_FAILED || !backup) {
+		pr_perror("Can't allocate memory");
+		return 1;
+	}
+
+	test_daemon();
+	/* Each page is written every MEM_PAGES / DIRTY_RATE ms */
+	while (test_go()) {
+		struct timespec req = {
+			.tv_sec = 0,
+			.tv_nsec = 1000000,
+		};
+
+		for (i = 0; i < DIRTY_RATE; i++) {
+			pfn = rover % MEM_PAGES;
+			*(volatile unsigned *)(mem + pfn * PAGE_SIZE) = rover;
+			backup[pfn] = rover;
+			rover++;
+		}
+		nanosleep(&req, NULL);
+	}
+	test_waitsig();
+
+	/* The tasks may have been frozen between a page and its backup */
+	pfn = rover % MEM_PAGES;
+	if (*(unsigned *)(mem + pfn * PAGE_SIZE) == rover)
+		backup[pfn] = rover;
+
+	test_msg("final rover %u\n", rover);
+	for (i = 0; i < MEM_PAGES; i++)
+		if (backup[i] != *(unsigned *)(mem + i * PAGE_SIZE)) {
+			fail("Page %d differs want %u has %u", i, backup[i], *(unsigned *)(mem + i * PAGE_SIZE));
+			fail = 1;
+		}
+
+	if (!fail)
+		pass();
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check lazy pages written before and after clearing the soft-dirty bits";
+
+#define NR_PAGES 512
+#define RUN	 8
+
+static unsigned page_val(unsigned i, int hot)
+{
+	return hot ? ~i : i + 1;
+}
+
+static int page_hot(unsigned i)
+{
+	return (i / RUN) % 2;
+}
+
+int main(int argc, char **argv)
+{
+	void *mem;
+	unsigned i;
+	int fd;
+
+	test_init(argc, argv);
+
+	mem = mmap(NULL, NR_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	if (mem == MAP_FAILED) {
+		pr_perror("Can't map memory");
+		return 1;
+	}
+
+	for (i = 0; i < NR_PAGES; i++)
+		*(unsigned *)(mem + i * PAGE_SIZE) = page_val(i, 0);
+
+	/* The pages not written after this are dumped as cold ones */
+	fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd < 0 || write(fd, "4", 1) != 1) {
+		pr_perror("Can't clear the soft-dirty bits");
+		return 1;
+	}
+	close(fd);
+
+	for (i = 0; i < NR_PAGES; i++)
+		if (page_hot(i))
+			*(unsigned *)(mem + i * PAGE_SIZE) = page_val(i, 1);
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_PAGES; i++)
+		if (*(unsigned *)(mem + i * PAGE_SIZE) != page_val(i, page_hot(i))) {
+			fail("Page %u differs want %u has %u", i, page_val(i, page_hot(i)),
+			     *(unsigned *)(mem + i * PAGE_SIZE));
+			return 1;
+		}
+
+	pass();
+	return 0;
+}
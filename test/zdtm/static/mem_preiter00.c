@@ -0,0 +1 @@
+mem_workers00.c
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check memory with many short runs of written, zero and absent pages";
+
+#define NR_PAGES   1024
+#define DIRTY_RATE 16 /* pages looked at per ms */
+
+enum {
+	PAGE_WRITTEN,
+	PAGE_ABSENT,
+	PAGE_ZERO,
+};
+
+static unsigned char kind[NR_PAGES];
+
+int main(int argc, char **argv)
+{
+	/* Volatile to keep the page written before its backup */
+	volatile unsigned *backup;
+	volatile unsigned cur = 0;
+	unsigned rover = 1, pfn = 0, run, len, i;
+	unsigned long *zero;
+	void *mem;
+	int fail = 0;
+
+	test_init(argc, argv);
+
+	mem = mmap(NULL, NR_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	backup = calloc(NR_PAGES, sizeof(*backup));
+	zero = calloc(1, PAGE_SIZE);
+	if (mem == MAP_FAILED || !backup || !zero) {
+		pr_perror("Can't allocate memory");
+		return 1;
+	}
+
+	/* Runs of 1 to 7 pages, so the regions start and end everywhere */
+	for (i = 0, run = 0; i < NR_PAGES; run++) {
+		for (len = 1 + run * 5 % 7; len && i < NR_PAGES; len--, i++) {
+			kind[i] = run % 3;
+			if (kind[i] == PAGE_WRITTEN) {
+				*(unsigned *)(mem + i * PAGE_SIZE) = rover;
+				backup[i] = rover++;
+			} else if (kind[i] == PAGE_ZERO) {
+				/* Maps the zero page */
+				(void)*(volatile unsigned *)(mem + i * PAGE_SIZE);
+			}
+		}
+	}
+
+	test_daemon();
+	/* Rewrite some of the written pages, the others stay in the parent images */
+	while (test_go()) {
+		struct timespec req = {
+			.tv_sec = 0,
+			.tv_nsec = 1000000,
+		};
+
+		for (i = 0; i < DIRTY_RATE; i++) {
+			pfn = (pfn + 3) % NR_PAGES;
+			if (kind[pfn] != PAGE_WRITTEN)
+				continue;
+			cur = pfn;
+			*(volatile unsigned *)(mem + pfn * PAGE_SIZE) = rover;
+			backup[pfn] = rover;
+			rover++;
+		}
+		nanosleep(&req, NULL);
+	}
+	test_waitsig();
+
+	/* The task may have been frozen between a page and its backup */
+	if (*(unsigned *)(mem + cur * PAGE_SIZE) == rover)
+		backup[cur] = rover;
+
+	for (i = 0; i < NR_PAGES; i++) {
+		if (kind[i] != PAGE_WRITTEN) {
+			if (memcmp(mem + i * PAGE_SIZE, zero, PAGE_SIZE)) {
+				fail("Page %u isn't zero", i);
+				fail = 1;
+			}
+		} else if (backup[i] != *(unsigned *)(mem + i * PAGE_SIZE)) {
+			fail("Page %u differs want %u has %u", i, backup[i], *(unsigned *)(mem + i * PAGE_SIZE));
+			fail = 1;
+		}
+	}
+
+	if (!fail)
+		pass();
+
+	return 0;
+}
@@ -0,0 +1 @@
+mem_regions00.c
\ No newline at end of file
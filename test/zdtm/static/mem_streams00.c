@@ -0,0 +1,48 @@
+#include <sys/mman.h>
+#include <stdlib.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check memory sent over several page server streams";
+
+#define NR_VMAS	 32
+#define NR_PAGES 97
+
+int main(int argc, char **argv)
+{
+	size_t size = NR_PAGES * PAGE_SIZE;
+	uint8_t *mem[NR_VMAS];
+	uint32_t crc;
+	int i;
+
+	test_init(argc, argv);
+
+	/*
+	 * Enough memory of different mappings to get many
+	 * pagemap entries, which are spread over the streams.
+	 */
+	for (i = 0; i < NR_VMAS; i++) {
+		mem[i] = mmap(NULL, size + i * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem[i] == MAP_FAILED) {
+			pr_perror("Can't map memory");
+			return 1;
+		}
+
+		crc = ~i;
+		datagen(mem[i], size + i * PAGE_SIZE, &crc);
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_VMAS; i++) {
+		crc = ~i;
+		if (datachk(mem[i], size + i * PAGE_SIZE, &crc)) {
+			fail("Memory of mapping %d is corrupted", i);
+			return 1;
+		}
+	}
+
+	pass();
+	return 0;
+}
@@ -0,0 +1,87 @@
+#include <sys/mman.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check memory read with io_uring and no io_uring threads left";
+
+#define NR_VMAS	 16
+#define NR_PAGES 256
+
+/* The io_uring workers and poller are threads of the submitter */
+static int count_uring_threads(void)
+{
+	char path[PATH_MAX], comm[32];
+	struct dirent *de;
+	int nr = 0;
+	DIR *d;
+
+	d = opendir("/proc/self/task");
+	if (!d) {
+		pr_perror("Can't open /proc/self/task");
+		return -1;
+	}
+
+	while ((de = readdir(d))) {
+		FILE *f;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/self/task/%s/comm", de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue; /* gone */
+		if (fgets(comm, sizeof(comm), f) && !strncmp(comm, "iou-", 4)) {
+			test_msg("Thread %s is %s", de->d_name, comm);
+			nr++;
+		}
+		fclose(f);
+	}
+
+	closedir(d);
+	return nr;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = NR_PAGES * PAGE_SIZE;
+	uint8_t *mem[NR_VMAS];
+	uint32_t crc;
+	int i;
+
+	test_init(argc, argv);
+
+	for (i = 0; i < NR_VMAS; i++) {
+		mem[i] = mmap(NULL, size + i * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem[i] == MAP_FAILED) {
+			pr_perror("Can't map memory");
+			return 1;
+		}
+
+		crc = ~i;
+		datagen(mem[i], size + i * PAGE_SIZE, &crc);
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_VMAS; i++) {
+		crc = ~i;
+		if (datachk(mem[i], size + i * PAGE_SIZE, &crc)) {
+			fail("Memory of mapping %d is corrupted", i);
+			return 1;
+		}
+	}
+
+	if (count_uring_threads()) {
+		fail("io_uring threads are left after restore");
+		return 1;
+	}
+
+	pass();
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check memory of many tasks dumped by parallel dump workers";
+
+#define NR_TASKS 8
+#define NR_PAGES 64
+
+static int child(task_waiter_t *t, int nr)
+{
+	size_t size = (NR_PAGES + nr) * PAGE_SIZE;
+	uint32_t crc = ~nr;
+	uint8_t *mem;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		pr_perror("Can't map memory");
+		return 1;
+	}
+
+	datagen(mem, size, &crc);
+	task_waiter_complete_current(t);
+
+	test_waitsig();
+
+	crc = ~nr;
+	if (datachk(mem, size, &crc)) {
+		fail("Memory of task %d is corrupted", nr);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	pid_t pids[NR_TASKS];
+	task_waiter_t t;
+	int i, status, ret = 0;
+
+	test_init(argc, argv);
+	task_waiter_init(&t);
+
+	for (i = 0; i < NR_TASKS; i++) {
+		pids[i] = test_fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork");
+			return 1;
+		}
+
+		if (pids[i] == 0)
+			exit(child(&t, i));
+
+		task_waiter_wait4(&t, pids[i]);
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_TASKS; i++) {
+		kill(pids[i], SIGTERM);
+		if (waitpid(pids[i], &status, 0) != pids[i]) {
+			pr_perror("Can't wait for %d", pids[i]);
+			ret = 1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fail("Task %d exited with 0x%x", i, status);
+			ret = 1;
+		}
+	}
+
+	if (!ret)
+		pass();
+
+	return ret;
+}
@@ -0,0 +1 @@
+mem_dirty00.c
\ No newline at end of file
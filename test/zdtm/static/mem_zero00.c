@@ -0,0 +1,116 @@
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check anonymous memory with zero pages dumped with --skip-zero-pages";
+
+#define NR_PAGES 256
+
+static inline bool page_zeroed(int i, int child)
+{
+	/* The child zeroes some of the pages it has inherited */
+	return (i / 7) % 2 || (child && i % 5 == 0);
+}
+
+static inline uint8_t page_byte(int i)
+{
+	return i % 255 + 1;
+}
+
+static void fill_mem(uint8_t *mem, int child)
+{
+	int i;
+
+	for (i = 0; i < NR_PAGES; i++) {
+		uint8_t *page = mem + i * PAGE_SIZE;
+
+		if (page_zeroed(i, child))
+			memset(page, 0, PAGE_SIZE);
+		else
+			memset(page, page_byte(i), PAGE_SIZE);
+	}
+}
+
+static int check_mem(uint8_t *mem, int child)
+{
+	int i, j;
+
+	for (i = 0; i < NR_PAGES; i++) {
+		uint8_t *page = mem + i * PAGE_SIZE;
+		uint8_t c = page_zeroed(i, child) ? 0 : page_byte(i);
+
+		for (j = 0; j < PAGE_SIZE; j++) {
+			if (page[j] != c) {
+				fail("%s: page %d byte %d is %x, not %x", child ? "child" : "parent", i, j,
+				     page[j], c);
+				return 1;
+			}
+		}
+	}
+
+	/* The zero pages must still be private and writable */
+	for (i = 0; i < NR_PAGES; i++)
+		mem[i * PAGE_SIZE] = i;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	task_waiter_t t;
+	uint8_t *mem;
+	int status, ret;
+	pid_t pid;
+
+	test_init(argc, argv);
+	task_waiter_init(&t);
+
+	mem = mmap(NULL, NR_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		pr_perror("Can't map memory");
+		return 1;
+	}
+
+	fill_mem(mem, 0);
+
+	pid = test_fork();
+	if (pid < 0) {
+		pr_perror("Can't fork");
+		return 1;
+	}
+
+	if (pid == 0) {
+		fill_mem(mem, 1);
+		task_waiter_complete_current(&t);
+		test_waitsig();
+		exit(check_mem(mem, 1));
+	}
+
+	task_waiter_wait4(&t, pid);
+
+	test_daemon();
+	test_waitsig();
+
+	ret = check_mem(mem, 0);
+
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait for child");
+		return 1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fail("Child exited with 0x%x", status);
+		ret = 1;
+	}
+
+	if (!ret)
+		pass();
+
+	return ret;
+}
@@ -0,0 +1,109 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check big shared memory segments dumped by dump workers";
+
+#define MB (1UL << 20)
+
+/* The segments of 8 MB and more go to the dump workers */
+static struct {
+	unsigned long size;
+	unsigned long step; /* every step-th page is written */
+	uint8_t *mem;
+} segs[] = {
+	{ 16 * MB, 1 },
+	{ 8 * MB, 2 },
+	{ 12 * MB, 16 },
+	{ 64 << 10, 1 },
+};
+
+static void fill(void)
+{
+	unsigned long off;
+	uint32_t crc;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(segs); i++)
+		for (off = 0; off < segs[i].size; off += segs[i].step * PAGE_SIZE) {
+			crc = i;
+			datagen(segs[i].mem + off, PAGE_SIZE, &crc);
+		}
+}
+
+static int check(void)
+{
+	unsigned long off;
+	uint8_t *zero;
+	uint32_t crc;
+	int i;
+
+	zero = calloc(1, PAGE_SIZE);
+	if (!zero)
+		return 1;
+
+	for (i = 0; i < ARRAY_SIZE(segs); i++)
+		for (off = 0; off < segs[i].size; off += PAGE_SIZE) {
+			crc = i;
+			if (off % (segs[i].step * PAGE_SIZE) ? memcmp(segs[i].mem + off, zero, PAGE_SIZE) :
+							       datachk(segs[i].mem + off, PAGE_SIZE, &crc)) {
+				pr_err("Segment %d differs at %lx\n", i, off);
+				return 1;
+			}
+		}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, status, ret;
+	pid_t pid;
+
+	test_init(argc, argv);
+
+	for (i = 0; i < ARRAY_SIZE(segs); i++) {
+		segs[i].mem = mmap(NULL, segs[i].size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (segs[i].mem == MAP_FAILED) {
+			pr_perror("Can't map %lu bytes of shared memory", segs[i].size);
+			return 1;
+		}
+	}
+
+	fill();
+
+	/* The child keeps the segments shared */
+	pid = test_fork();
+	if (pid < 0) {
+		pr_perror("Can't fork");
+		return 1;
+	}
+
+	if (pid == 0) {
+		test_waitsig();
+		return check();
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	ret = check();
+
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait for the child");
+		return 1;
+	}
+
+	if (ret || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fail("Shared memory differs");
+		return 1;
+	}
+
+	pass();
+	return 0;
+}